@@ -69,10 +69,16 @@
 #define configMESSAGE_BUFFER_LENGTH_TYPE        size_t
 
 /* Memory allocation related definitions. */
-#define configSUPPORT_STATIC_ALLOCATION         0
+/* The idle and timer task memory is provided by main.cc. */
+#define configSUPPORT_STATIC_ALLOCATION         1
+/* STATIC_ALLOCATION builds have no FreeRTOS heap at all. */
+#if STATIC_ALLOCATION
+#define configSUPPORT_DYNAMIC_ALLOCATION        0
+#else
 #define configSUPPORT_DYNAMIC_ALLOCATION        1
-// #define configTOTAL_HEAP_SIZE                   (128*1024)
-#define configTOTAL_HEAP_SIZE                   (64*1024)
+#endif
+/* pvPortMalloc() and vPortFree() are implemented in heap.cc, so there's no
+separate FreeRTOS heap. */
 #define configAPPLICATION_ALLOCATED_HEAP        0
 
 /* Hook function related definitions. */
@@ -80,8 +86,16 @@
 #define configUSE_MALLOC_FAILED_HOOK            1
 #define configUSE_DAEMON_TASK_STARTUP_HOOK      0
 
-/* Run time and task stats gathering related definitions. */
-#define configGENERATE_RUN_TIME_STATS           0
+/* Run time and task stats gathering related definitions. The run time counter
+is the free running 64-bit microsecond timer, which needs no setup and doesn't
+wrap. */
+#define configGENERATE_RUN_TIME_STATS           1
+#define configRUN_TIME_COUNTER_TYPE             uint64_t
+#ifndef __ASSEMBLER__
+#include "hardware/timer.h"
+#endif
+#define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS()
+#define portGET_RUN_TIME_COUNTER_VALUE()        time_us_64()
 #define configUSE_TRACE_FACILITY                1
 #define configUSE_STATS_FORMATTING_FUNCTIONS    0
 
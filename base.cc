@@ -2,8 +2,22 @@
 
 #include <algorithm>
 
+#include "FreeRTOS.h"
 #include "config.h"
+#include "hardware/timer.h"
+#include "heap.h"
+#include "kv_store.h"
 #include "storage.h"
+#include "task.h"
+
+// How often the config saver task writes the deferred KV store values
+#ifndef CONFIG_KV_STORE_FLUSH_MS
+#define CONFIG_KV_STORE_FLUSH_MS 2000
+#endif
+
+static TaskHandle_t config_saver_task_handle;
+static StackType_t config_saver_task_stack[CONFIG_TASK_STACK_SIZE];
+static StaticTask_t config_saver_task_buffer;
 
 void GenericInputDevice::SetKeyboardOutputs(
     const std::vector<std::shared_ptr<KeyboardOutputDevice>>* devices) {
@@ -111,6 +125,14 @@ void Dedup(std::vector<std::shared_ptr<T>>* devices) {
   std::swap(*devices, no_dup);
 }
 
+// Devices live until reboot, so they are allocated from the device arena. The
+// rest, e.g. the config trees and the device lists, stays on the heap.
+template <typename F>
+auto CreateInDeviceArena(const F& creator) {
+  DeviceArenaSection arena;
+  return creator();
+}
+
 void DeviceRegistry::InitializeAllDevices() {
   if (!initialized_) {
     input_devices_.clear();
@@ -123,7 +145,7 @@ void DeviceRegistry::InitializeAllDevices() {
 
     for (const auto [key, value] : GetRegistry()->keyboard_creators_) {
       bool slow = value.first;
-      auto output_device = value.second();
+      auto output_device = CreateInDeviceArena(value.second);
       keyboard_devices_.push_back(output_device);
       output_device->SetTag(key);
       output_device->SetSlow(slow);
@@ -131,7 +153,7 @@ void DeviceRegistry::InitializeAllDevices() {
     }
     for (const auto [key, value] : GetRegistry()->mouse_creators_) {
       bool slow = value.first;
-      auto output_device = value.second();
+      auto output_device = CreateInDeviceArena(value.second);
       mouse_devices_.push_back(output_device);
       output_device->SetTag(key);
       output_device->SetSlow(slow);
@@ -139,7 +161,7 @@ void DeviceRegistry::InitializeAllDevices() {
     }
     for (const auto [key, value] : GetRegistry()->screen_output_creators_) {
       bool slow = value.first;
-      auto output_device = value.second();
+      auto output_device = CreateInDeviceArena(value.second);
       screen_devices_.push_back(output_device);
       output_device->SetTag(key);
       output_device->SetSlow(slow);
@@ -147,7 +169,7 @@ void DeviceRegistry::InitializeAllDevices() {
     }
     for (const auto [key, value] : GetRegistry()->led_output_creators_) {
       bool slow = value.first;
-      auto output_device = value.second();
+      auto output_device = CreateInDeviceArena(value.second);
       led_devices_.push_back(output_device);
       output_device->SetTag(key);
       output_device->SetSlow(slow);
@@ -160,7 +182,8 @@ void DeviceRegistry::InitializeAllDevices() {
     Dedup(&led_devices_);
 
     if (config_modifier_creator_.has_value()) {
-      config_modifier_ = config_modifier_creator_.value()(&global_config_);
+      config_modifier_ = CreateInDeviceArena(
+          [&]() { return config_modifier_creator_.value()(&global_config_); });
       config_modifier_->SetTag(0xff);
       config_modifier_->SetSlow(false);
       config_modifier_->SetKeyboardOutputs(&keyboard_devices_);
@@ -172,7 +195,7 @@ void DeviceRegistry::InitializeAllDevices() {
     }
 
     for (const auto [key, value] : input_creators_) {
-      auto device = value.second();
+      auto device = CreateInDeviceArena(value.second);
       input_devices_.push_back(device);
       device->SetTag(key);
       device->SetKeyboardOutputs(&keyboard_devices_);
@@ -189,17 +212,44 @@ void DeviceRegistry::InitializeAllDevices() {
 
   CreateDefaultConfigImpl();
 
-  // Initialize the config from flash if there's any
-  std::string config_file;
-  if (ReadFileContent(CONFIG_FLASH_JSON_FILE_NAME, &config_file) == OK &&
-      !config_file.empty() &&
-      ParseJsonConfig(config_file, &global_config_) != OK) {
+  // Initialize the config from flash if there's any. The json config is only
+  // imported when there's no valid binary config, e.g. on the first boot after
+  // updating from a firmware which saved json.
+  if (LoadBinaryConfigImpl() != OK) {
     // Reinitialize to default
     CreateDefaultConfigImpl();
+
+    std::string config_file;
+    if (ReadFileContent(CONFIG_FLASH_JSON_FILE_NAME, &config_file) == OK &&
+        !config_file.empty()) {
+      const HeapStats heap_before = GetHeapStats();
+      const uint64_t start_time = time_us_64();
+      const Status status = ParseJsonConfig(config_file, &global_config_);
+      const uint64_t end_time = time_us_64();
+      const HeapStats heap_after = GetHeapStats();
+      LOG_INFO(
+          "Parsing %s took %d us. Heap fragmentation went from %d%% to %d%%",
+          CONFIG_FLASH_JSON_FILE_NAME, (int32_t)(end_time - start_time),
+          heap_before.fragmentation, heap_after.fragmentation);
+
+      if (status == OK) {
+        LOG_INFO("Imported %s", CONFIG_FLASH_JSON_FILE_NAME);
+        uint32_t generation;
+        SaveConfigImpl(&generation);
+      } else {
+        CreateDefaultConfigImpl();
+      }
+    }
   }
+  // Saving what was just loaded would be a no-op
+  saved_generation_ = global_config_.GetGeneration();
 
   UpdateConfigImpl();
 
+  if (StartConfigSaverImpl() != OK) {
+    LOG_ERROR("Failed to start the config saver task");
+  }
+
   initialized_ = true;
 }
 
@@ -252,15 +302,25 @@ void DeviceRegistry::AddConfig(GenericDevice* device) {
     if (config == NULL) {
       return;
     }
-    device_to_config_[device] = {name, config.get()};
+    device_to_config_[device] = {
+        .name = name, .config = config.get(), .applied_generation = 0};
+    BindConfigHandles(config);
     (*global_config_.GetMembers())[name] = std::move(config);
   }
 }
 
-void DeviceRegistry::UpdateConfigImpl() {
-  for (auto& [device, config] : device_to_config_) {
-    device->OnUpdateConfig(config.second);
+bool DeviceRegistry::UpdateConfigImpl() {
+  bool updated = false;
+  for (auto& [device, device_config] : device_to_config_) {
+    const uint32_t generation = device_config.config->GetGeneration();
+    if (generation == device_config.applied_generation) {
+      continue;
+    }
+    device->OnUpdateConfig(device_config.config);
+    device_config.applied_generation = generation;
+    updated = true;
   }
+  return updated;
 }
 
 void DeviceRegistry::CreateDefaultConfigImpl() {
@@ -284,19 +344,149 @@ void DeviceRegistry::CreateDefaultConfigImpl() {
   }
 }
 
-void DeviceRegistry::UpdateConfig() { GetRegistry()->UpdateConfigImpl(); }
+bool DeviceRegistry::UpdateConfig() {
+  return GetRegistry()->UpdateConfigImpl();
+}
+
+void DeviceRegistry::CreateDefaultConfig() { GetRegistry()->ResetConfigImpl(); }
 
-void DeviceRegistry::CreateDefaultConfig() {
-  GetRegistry()->CreateDefaultConfigImpl();
+void DeviceRegistry::BuildDefaultConfigImpl(ConfigObject* defaults) {
+  for (const auto& [device, device_config] : device_to_config_) {
+    (*defaults->GetMembers())[device_config.name] =
+        device->CreateDefaultConfig().second;
+  }
 }
 
-void DeviceRegistry::SaveConfig() {
-  const std::string json = GetRegistry()->global_config_.ToJSON();
-  LOG_INFO("Save config to json:\n%s", json.c_str());
-  if (WriteStringToFile(json, CONFIG_FLASH_JSON_FILE_NAME) != OK) {
-    LOG_ERROR("Failed to save config json");
+// The tree is never rebuilt after boot since the saver task may be walking it.
+// The default values are copied into the existing leaves instead, by way of the
+// binary format. The defaults tree is independent of the live one, since
+// CreateDefaultConfig() leaves the config handles alone.
+void DeviceRegistry::ResetConfigImpl() {
+  ConfigObject defaults;
+  BuildDefaultConfigImpl(&defaults);
+  std::string binary;
+  SerializeBinaryConfig(&defaults, &binary);
+  if (ParseBinaryConfig((const uint8_t*)binary.data(), binary.size(),
+                        &global_config_) != OK) {
+    LOG_ERROR("Failed to reset the config");
+  }
+}
+
+Status DeviceRegistry::LoadBinaryConfigImpl() {
+  // Parsed straight from flash unless the config is larger than a block
+  MappedFile file;
+  if (file.Open(CONFIG_FLASH_BINARY_FILE_NAME) != OK) {
+    return ERROR;
+  }
+  const std::span<const uint8_t> data = file.GetData();
+  return ParseBinaryConfig(data.data(), data.size(), &global_config_);
+}
+
+// Both files are written to a temporary file first and renamed over the old
+// one, which littlefs does atomically. A reset in the middle of a save leaves
+// the previous config intact.
+Status DeviceRegistry::SaveConfigImpl(uint32_t* generation) {
+  // The config menu may keep changing values on the input task. The snapshot
+  // is taken again until no change happened while copying, and both files are
+  // written from it.
+  std::string binary;
+  do {
+    *generation = global_config_.GetGeneration();
+    SerializeBinaryConfig(&global_config_, &binary);
+  } while (global_config_.GetGeneration() != *generation);
+
+  if (WriteStringToFile(binary, CONFIG_FLASH_BINARY_FILE_NAME ".tmp") != OK ||
+      RenameFile(CONFIG_FLASH_BINARY_FILE_NAME ".tmp",
+                 CONFIG_FLASH_BINARY_FILE_NAME) != OK) {
+    LOG_ERROR("Failed to save config");
+    return ERROR;
   }
   LOG_INFO("Done saving config");
+
+  // Only the binary config is loaded at boot. The json is an export for the
+  // user, so failing to write it doesn't fail the save.
+  if (ExportJsonConfigImpl(binary) != OK) {
+    LOG_ERROR("Failed to export config json");
+  }
+  return OK;
+}
+
+// Streamed to the file in small chunks, from a tree holding the snapshot
+Status DeviceRegistry::ExportJsonConfigImpl(const std::string& binary) {
+  ConfigObject snapshot;
+  BuildDefaultConfigImpl(&snapshot);
+  if (ParseBinaryConfig((const uint8_t*)binary.data(), binary.size(),
+                        &snapshot) != OK) {
+    return ERROR;
+  }
+
+  FileWriter file;
+  if (file.Open(CONFIG_FLASH_JSON_FILE_NAME ".tmp") != OK) {
+    return ERROR;
+  }
+  JsonWriter writer([&](const char* data, size_t size) {
+    return file.Write(data, size);
+  });
+  snapshot.WriteJSON(&writer);
+  if (writer.Finish() != OK || file.Close() != OK) {
+    return ERROR;
+  }
+  return RenameFile(CONFIG_FLASH_JSON_FILE_NAME ".tmp",
+                    CONFIG_FLASH_JSON_FILE_NAME);
+}
+
+Status DeviceRegistry::StartConfigSaverImpl() {
+  config_saver_task_handle = xTaskCreateStatic(
+      &ConfigSaverTask, "config_saver_task", CONFIG_TASK_STACK_SIZE, this,
+      tskIDLE_PRIORITY + 1, config_saver_task_stack, &config_saver_task_buffer);
+  return config_saver_task_handle == NULL ? ERROR : OK;
+}
+
+void DeviceRegistry::ConfigSaverTask(void* parameter) {
+  DeviceRegistry* registry = (DeviceRegistry*)parameter;
+  while (true) {
+    // All the requests made since the last save are served at once
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_KV_STORE_FLUSH_MS));
+    FlushKVStore();
+
+    const uint32_t generation = registry->global_config_.GetGeneration();
+    if (generation == registry->saved_generation_) {
+      continue;
+    }
+
+    HeapAllowedSection heap_allowed;
+    uint32_t saved_generation;
+    if (registry->SaveConfigImpl(&saved_generation) == OK) {
+      registry->saved_generation_ = saved_generation;
+    } else {
+      registry->failed_generation_ = saved_generation;
+    }
+  }
+}
+
+uint32_t DeviceRegistry::SaveConfig() {
+  DeviceRegistry* registry = GetRegistry();
+  const uint32_t generation = registry->global_config_.GetGeneration();
+  // A retry after a failed save is pending again
+  registry->failed_generation_ = 0;
+  if (config_saver_task_handle == NULL) {
+    // The saver task failed to start. Reported as a failed save.
+    registry->failed_generation_ = generation;
+    return generation;
+  }
+  xTaskNotifyGive(config_saver_task_handle);
+  return generation;
+}
+
+DeviceRegistry::SaveStatus DeviceRegistry::GetSaveStatus(uint32_t generation) {
+  const DeviceRegistry* registry = GetRegistry();
+  if (registry->saved_generation_ >= generation) {
+    return SAVE_DONE;
+  }
+  if (registry->failed_generation_ >= generation) {
+    return SAVE_FAILED;
+  }
+  return SAVE_PENDING;
 }
 
 Status IBPDriverRegistry::RegisterDriver(uint8_t key, IBPDriverCreator func) {
@@ -1,6 +1,7 @@
 #ifndef BASE_H_
 #define BASE_H_
 
+#include <atomic>
 #include <functional>
 #include <map>
 #include <memory>
@@ -238,18 +239,51 @@ class DeviceRegistry {
   static std::vector<std::shared_ptr<GenericOutputDevice>> GetOutputDevices(
       bool is_slow);
 
-  static void UpdateConfig();
+  // Calls OnUpdateConfig() of the devices whose config changed since the last
+  // call. Returns whether any device was updated.
+  static bool UpdateConfig();
+  // Resets all the config values to their defaults
   static void CreateDefaultConfig();
-  static void SaveConfig();
+
+  // Saves are done by a low priority task, so the caller never waits on
+  // littlefs or flash erases. Requests made while a save is in progress are
+  // coalesced into one more save. Returns the config generation the request
+  // covers.
+  static uint32_t SaveConfig();
+
+  enum SaveStatus {
+    SAVE_PENDING = 0,
+    SAVE_DONE,
+    SAVE_FAILED,
+  };
+  // Status of the save which covers generation, as returned by SaveConfig()
+  static SaveStatus GetSaveStatus(uint32_t generation);
 
  private:
-  DeviceRegistry() : initialized_(false) {}
+  DeviceRegistry()
+      : initialized_(false), saved_generation_(0), failed_generation_(0) {}
 
   void InitializeAllDevices();
 
+  struct DeviceConfig {
+    std::string name;
+    Config* config;
+    // Generation of the config last passed to OnUpdateConfig(). 0 if never.
+    uint32_t applied_generation;
+  };
+
   void AddConfig(GenericDevice* device);
-  void UpdateConfigImpl();
+  bool UpdateConfigImpl();
   void CreateDefaultConfigImpl();
+  // Separate tree with the default values of all the device configs
+  void BuildDefaultConfigImpl(ConfigObject* defaults);
+  void ResetConfigImpl();
+  Status LoadBinaryConfigImpl();
+  // generation is set to the generation of the config saved, even on ERROR
+  Status SaveConfigImpl(uint32_t* generation);
+  Status ExportJsonConfigImpl(const std::string& binary);
+  Status StartConfigSaverImpl();
+  static void ConfigSaverTask(void* parameter);
 
   static DeviceRegistry* GetRegistry();
 
@@ -275,7 +309,11 @@ class DeviceRegistry {
   std::shared_ptr<ConfigModifier> config_modifier_;
 
   ConfigObject global_config_;
-  std::map<GenericDevice*, std::pair<std::string, Config*>> device_to_config_;
+  std::map<GenericDevice*, DeviceConfig> device_to_config_;
+
+  // Updated by the saver task after each save
+  std::atomic<uint32_t> saved_generation_;
+  std::atomic<uint32_t> failed_generation_;
 };
 
 class IBPDriverBase {
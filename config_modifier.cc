@@ -1,10 +1,14 @@
 #include "config_modifier.h"
 
+#include <stdio.h>
+
 #include <algorithm>
 #include <string>
 #include <vector>
 
 #include "base.h"
+#include "hardware/timer.h"
+#include "heap.h"
 #include "runner.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -48,6 +52,16 @@ void ListUI::OnDown() {
 ////////////////////////////////////////////////////////////////////////////////
 
 void HomeScreen::Draw() {
+  if (saving_) {
+    const DeviceRegistry::SaveStatus status =
+        DeviceRegistry::GetSaveStatus(saving_generation_);
+    if (status != DeviceRegistry::SAVE_PENDING) {
+      menu_items_[1] =
+          status == DeviceRegistry::SAVE_DONE ? "Saved" : "Save Failed";
+      saving_ = false;
+      redraw_ = true;
+    }
+  }
   if (!redraw_) {
     return;
   }
@@ -55,20 +69,48 @@ void HomeScreen::Draw() {
   redraw_ = false;
 }
 
+void HomeScreen::OnUp() {
+  ListUI::OnUp();
+  ResetSaveLabel();
+}
+
+void HomeScreen::OnDown() {
+  ListUI::OnDown();
+  ResetSaveLabel();
+}
+
+void HomeScreen::ResetSaveLabel() {
+  if (saving_ || menu_items_[1] == "Save Config") {
+    return;
+  }
+  menu_items_[1] = "Save Config";
+  redraw_ = true;
+}
+
 void HomeScreen::OnSelect() {
   if (current_highlight_ == 0) {
+    ResetSaveLabel();
     config_modifier_->PushUI(std::make_shared<ConfigObjectScreen>(
         config_modifier_, screen_, global_config_object_, screen_top_margin_));
     redraw_ = true;
   }
   if (current_highlight_ == 1) {
-    DeviceRegistry::SaveConfig();
-    LOG_INFO("Saved");
+    // Doesn't wait for the flash. Draw() polls for the outcome.
+    saving_generation_ = DeviceRegistry::SaveConfig();
+    saving_ = true;
+    menu_items_[1] = "Saving...";
+    redraw_ = true;
   }
   if (current_highlight_ == 2) {
     DeviceRegistry::CreateDefaultConfig();
   }
   if (current_highlight_ == 3) {
+    ResetSaveLabel();
+    config_modifier_->PushUI(std::make_shared<SystemScreen>(
+        config_modifier_, screen_, screen_top_margin_));
+    redraw_ = true;
+  }
+  if (current_highlight_ == 4) {
     config_modifier_->EndConfig();
   }
 }
@@ -182,6 +224,56 @@ uint32_t ConfigListScreen::GetListLength() { return indices_.size(); }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+void SystemScreen::UpdateRows() {
+  // 15 characters fit on a row after the cursor
+  char row[32];
+  rows_.clear();
+  rows_.push_back("^ Back");
+
+  const HeapStats heap_stats = GetHeapStats();
+  snprintf(row, sizeof(row), "Heap %uK/%uK",
+           (unsigned)(heap_stats.bytes_in_use / 1024),
+           (unsigned)(heap_stats.peak_bytes_in_use / 1024));
+  rows_.push_back(row);
+  snprintf(row, sizeof(row), "Frag %u%%", (unsigned)heap_stats.fragmentation);
+  rows_.push_back(row);
+
+  // Task name, free stack bytes and CPU usage
+  const size_t num_tasks = sampler_.Sample(&stats_);
+  for (size_t i = 0; i < num_tasks; ++i) {
+    snprintf(row, sizeof(row), "%-6.6s%5u%3u%%", stats_[i].name,
+             (unsigned)stats_[i].min_free_stack_bytes,
+             (unsigned)stats_[i].cpu_percent);
+    rows_.push_back(row);
+  }
+}
+
+void SystemScreen::Draw() {
+  const uint64_t now = time_us_64();
+  if (last_sample_time_ == 0 || now - last_sample_time_ >= 1000000) {
+    UpdateRows();
+    last_sample_time_ = now;
+    current_highlight_ =
+        std::min<uint32_t>(current_highlight_, GetListLength() - 1);
+    redraw_ = true;
+  }
+  if (!redraw_) {
+    return;
+  }
+  ListDrawImpl(rows_);
+  redraw_ = false;
+}
+
+void SystemScreen::OnSelect() {
+  if (current_highlight_ == 0) {
+    config_modifier_->PopUI();
+  }
+}
+
+uint32_t SystemScreen::GetListLength() { return rows_.size(); }
+
+////////////////////////////////////////////////////////////////////////////////
+
 void ConfigIntScreen::Draw() {
   if (!redraw_) {
     return;
@@ -6,6 +6,7 @@
 
 #include "base.h"
 #include "configuration.h"
+#include "runner.h"
 
 class ConfigModifiersImpl;
 
@@ -62,16 +63,28 @@ class HomeScreen : public ListUI {
              ConfigObject* global_config_object, uint8_t screen_top_margin)
       : ListUI(config_modifier, screen, screen_top_margin),
         global_config_object_(global_config_object),
-        menu_items_({"Edit Config", "Save Config", "Load Default", "Exit"}) {}
+        menu_items_({"Edit Config", "Save Config", "Load Default", "System",
+                     "Exit"}),
+        saving_(false),
+        saving_generation_(0) {}
 
   void Draw() override;
+  void OnUp() override;
+  void OnDown() override;
   void OnSelect() override;
 
  protected:
   uint32_t GetListLength() override;
 
+  // Puts "Save Config" back in place of the outcome of the last save, once the
+  // highlight moves or another screen is entered
+  void ResetSaveLabel();
+
   ConfigObject* global_config_object_;
   std::vector<std::string> menu_items_;
+  // Whether the "Save Config" item is waiting for the saver task
+  bool saving_;
+  uint32_t saving_generation_;
 };
 
 class ConfigObjectScreen : public ListUI {
@@ -106,6 +119,29 @@ class ConfigListScreen : public ListUI {
   std::vector<std::string> indices_;
 };
 
+// Heap usage, and the free stack and CPU usage of each task. Refreshed every
+// second.
+class SystemScreen : public ListUI {
+ public:
+  SystemScreen(ConfigModifiersImpl* config_modifier, ScreenOutputDevice* screen,
+               uint8_t screen_top_margin)
+      : ListUI(config_modifier, screen, screen_top_margin),
+        last_sample_time_(0) {}
+
+  void Draw() override;
+  void OnSelect() override;
+
+ protected:
+  uint32_t GetListLength() override;
+
+  void UpdateRows();
+
+  runner::TaskStatsSampler sampler_;
+  std::array<runner::TaskStats, runner::TaskStatsSampler::kMaxTasks> stats_;
+  std::vector<std::string> rows_;
+  uint64_t last_sample_time_;
+};
+
 class ConfigIntScreen : public ConfigUIBase {
  public:
   ConfigIntScreen(ConfigModifiersImpl* config_modifier,
@@ -22,10 +22,17 @@
 #define CONFIG_USB_VENDER_NAME "PicoMK"
 #define CONFIG_USB_SERIAL_NUM "1234"
 
-// Configure the filesystem size and config file name
+// Configure the filesystem size and config file names. The config is saved in
+// the compact binary file. The json file is only imported when there's no valid
+// binary config.
 #define CONFIG_FLASH_FILESYSTEM_SIZE (32 * 4096)
+#define CONFIG_FLASH_BINARY_FILE_NAME "config.bin"
 #define CONFIG_FLASH_JSON_FILE_NAME "config.json"
 
+// Size of the key value store for small values updated often (see kv_store.h),
+// right before the filesystem. Must be a multiple of two sectors.
+#define CONFIG_FLASH_KV_STORE_SIZE (2 * 4096)
+
 ////////////////////////////////////////////////////////////////////////////////
 // Advanced options (usually no need to modify)
 ////////////////////////////////////////////////////////////////////////////////
@@ -1,24 +1,102 @@
 #include "configuration.h"
 
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
 #include "cJSON/cJSON.h"
+#include "heap.h"
 #include "utils.h"
 
-std::string ConfigObject::ToJSON() const {
-  cJSON* root = ToCJSON();
-  if (root == NULL) {
-    LOG_ERROR("Failed to create json for ConfigObject");
-    return "";
+// Only touched by the input task, or during boot
+static uint32_t last_generation = 0;
+
+Config::Config() : generation_(++last_generation), handle_(NULL) {}
+
+void Config::MarkChanged() { generation_ = ++last_generation; }
+
+void JsonWriter::Write(const char* data, size_t size) {
+  while (size > 0) {
+    if (size_ == buffer_.size()) {
+      Flush();
+    }
+    const size_t copy_size = std::min(size, buffer_.size() - size_);
+    memcpy(&buffer_[size_], data, copy_size);
+    size_ += copy_size;
+    data += copy_size;
+    size -= copy_size;
+  }
+}
+
+void JsonWriter::WriteString(const std::string& str) {
+  Write('"');
+  for (const char c : str) {
+    if (c == '"' || c == '\\') {
+      Write('\\');
+      Write(c);
+    } else if ((uint8_t)c < 0x20) {
+      char escaped[8];
+      const int size = snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      Write(escaped, size);
+    } else {
+      Write(c);
+    }
   }
-  char* string = cJSON_Print(root);
-  if (string == NULL) {
-    LOG_ERROR("Failed to print json");
+  Write('"');
+}
+
+void JsonWriter::WriteNumber(int32_t value) {
+  char number[16];
+  const int size = snprintf(number, sizeof(number), "%ld", (long)value);
+  Write(number, size);
+}
+
+void JsonWriter::WriteNumber(float value) {
+  // 9 significant digits round trip any float
+  char number[24];
+  const int size = snprintf(number, sizeof(number), "%.9g", (double)value);
+  Write(number, size);
+}
+
+void JsonWriter::Flush() {
+  if (size_ > 0 && status_ == OK) {
+    status_ = sink_(buffer_.data(), size_);
   }
-  std::string output(string);
-  free((void*)string);
-  cJSON_Delete(root);
+  size_ = 0;
+}
+
+Status JsonWriter::Finish() {
+  Flush();
+  return status_;
+}
+
+std::string ConfigObject::ToJSON() const {
+  std::string output;
+  JsonWriter writer([&](const char* data, size_t size) {
+    output.append(data, size);
+    return OK;
+  });
+  WriteJSON(&writer);
+  writer.Finish();
   return output;
 }
 
+void ConfigObject::WriteJSON(JsonWriter* writer) const {
+  writer->Write('{');
+  bool first = true;
+  for (const auto& [k, v] : members_) {
+    if (!first) {
+      writer->Write(',');
+    }
+    first = false;
+    writer->WriteString(k);
+    writer->Write(':');
+    v->WriteJSON(writer);
+  }
+  writer->Write('}');
+}
+
 cJSON* ConfigObject::ToCJSON() const {
   cJSON* root = cJSON_CreateObject();
   if (root == NULL) {
@@ -47,6 +125,14 @@ Status ConfigObject::FromCJSON(const cJSON* json) {
   return OK;
 }
 
+uint32_t ConfigObject::GetGeneration() const {
+  uint32_t generation = Config::GetGeneration();
+  for (const auto& [k, v] : members_) {
+    generation = std::max(generation, v->GetGeneration());
+  }
+  return generation;
+}
+
 cJSON* ConfigList::ToCJSON() const {
   cJSON* root = cJSON_CreateArray();
   if (root == NULL) {
@@ -76,7 +162,37 @@ Status ConfigList::FromCJSON(const cJSON* json) {
   return OK;
 }
 
-cJSON* ConfigInt::ToCJSON() const { return cJSON_CreateNumber(value_); }
+void ConfigList::WriteJSON(JsonWriter* writer) const {
+  writer->Write('[');
+  for (size_t i = 0; i < list_.size(); ++i) {
+    if (i > 0) {
+      writer->Write(',');
+    }
+    list_[i]->WriteJSON(writer);
+  }
+  writer->Write(']');
+}
+
+uint32_t ConfigList::GetGeneration() const {
+  uint32_t generation = Config::GetGeneration();
+  for (const auto& v : list_) {
+    generation = std::max(generation, v->GetGeneration());
+  }
+  return generation;
+}
+
+void ConfigInt::SetValue(int32_t value) {
+  if (value != GetValue()) {
+    value_.store(value, std::memory_order_relaxed);
+    MarkChanged();
+  }
+}
+
+cJSON* ConfigInt::ToCJSON() const { return cJSON_CreateNumber(GetValue()); }
+
+void ConfigInt::WriteJSON(JsonWriter* writer) const {
+  writer->WriteNumber(GetValue());
+}
 
 Status ConfigInt::FromCJSON(const cJSON* json) {
   if (json == NULL || !cJSON_IsNumber(json)) {
@@ -86,11 +202,22 @@ Status ConfigInt::FromCJSON(const cJSON* json) {
   if (value < min_ || value > max_) {
     return ERROR;
   }
-  value_ = value;
+  SetValue(value);
   return OK;
 }
 
-cJSON* ConfigFloat::ToCJSON() const { return cJSON_CreateNumber(value_); }
+void ConfigFloat::SetValue(float value) {
+  if (value != GetValue()) {
+    value_.store(value, std::memory_order_relaxed);
+    MarkChanged();
+  }
+}
+
+cJSON* ConfigFloat::ToCJSON() const { return cJSON_CreateNumber(GetValue()); }
+
+void ConfigFloat::WriteJSON(JsonWriter* writer) const {
+  writer->WriteNumber(GetValue());
+}
 
 Status ConfigFloat::FromCJSON(const cJSON* json) {
   if (json == NULL || !cJSON_IsNumber(json)) {
@@ -100,16 +227,244 @@ Status ConfigFloat::FromCJSON(const cJSON* json) {
   if (value < min_ || value > max_) {
     return ERROR;
   }
-  value_ = value;
+  SetValue(value);
   return OK;
 }
 
+void BindConfigHandles(const std::shared_ptr<Config>& config) {
+  if (config->GetHandle() != NULL) {
+    config->GetHandle()->Rebind(config);
+  }
+  switch (config->GetType()) {
+    case Config::OBJECT: {
+      for (const auto& [k, v] :
+           *reinterpret_cast<ConfigObject*>(config.get())->GetMembers()) {
+        BindConfigHandles(v);
+      }
+      break;
+    }
+    case Config::LIST: {
+      for (const auto& v :
+           *reinterpret_cast<ConfigList*>(config.get())->GetList()) {
+        BindConfigHandles(v);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
 Status ParseJsonConfig(const std::string& json, Config* default_config) {
+  // The cJSON tree is allocated from the arena, and released in one go
+  ScratchArena arena;
+  CJSONArenaSection arena_section(&arena);
+
   cJSON* c_json = cJSON_ParseWithLength(json.c_str(), json.size());
   if (c_json == NULL) {
     return ERROR;
   }
   const Status status = default_config->FromCJSON(c_json);
   cJSON_Delete(c_json);
+  LOG_DEBUG("Parsing %d bytes of json used %d bytes of scratch arena",
+            (int32_t)json.size(), (int32_t)arena.BytesUsed());
   return status;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+
+// "PMKC"
+constexpr uint32_t kBinaryConfigMagic = 0x434b4d50;
+constexpr uint16_t kBinaryConfigVersion = 1;
+
+struct BinaryConfigHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t num_values;
+  uint32_t schema_hash;
+  // FNV-1a of the values
+  uint32_t checksum;
+};
+
+constexpr uint32_t kFNVOffsetBasis = 2166136261u;
+
+static uint32_t FNV1a(uint32_t hash, const void* data, size_t size) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Hashes the structure and counts the leaves
+static uint32_t HashSchema(const Config* config, uint32_t hash,
+                           uint16_t* num_values) {
+  const uint8_t type = config->GetType();
+  hash = FNV1a(hash, &type, sizeof(type));
+  switch (config->GetType()) {
+    case Config::OBJECT: {
+      for (const auto& [k, v] :
+           *reinterpret_cast<const ConfigObject*>(config)->GetMembers()) {
+        // Including the null terminator
+        hash = FNV1a(hash, k.c_str(), k.size() + 1);
+        hash = HashSchema(v.get(), hash, num_values);
+      }
+      break;
+    }
+    case Config::LIST: {
+      const auto& list =
+          *reinterpret_cast<const ConfigList*>(config)->GetList();
+      const uint32_t size = list.size();
+      hash = FNV1a(hash, &size, sizeof(size));
+      for (const auto& v : list) {
+        hash = HashSchema(v.get(), hash, num_values);
+      }
+      break;
+    }
+    case Config::INTEGER:
+    case Config::FLOAT: {
+      ++(*num_values);
+      break;
+    }
+    default:
+      break;
+  }
+  return hash;
+}
+
+static void WriteValues(const Config* config, uint8_t** cursor) {
+  switch (config->GetType()) {
+    case Config::OBJECT: {
+      for (const auto& [k, v] :
+           *reinterpret_cast<const ConfigObject*>(config)->GetMembers()) {
+        WriteValues(v.get(), cursor);
+      }
+      break;
+    }
+    case Config::LIST: {
+      for (const auto& v :
+           *reinterpret_cast<const ConfigList*>(config)->GetList()) {
+        WriteValues(v.get(), cursor);
+      }
+      break;
+    }
+    case Config::INTEGER: {
+      const int32_t value =
+          reinterpret_cast<const ConfigInt*>(config)->GetValue();
+      memcpy(*cursor, &value, sizeof(value));
+      *cursor += sizeof(value);
+      break;
+    }
+    case Config::FLOAT: {
+      const float value =
+          reinterpret_cast<const ConfigFloat*>(config)->GetValue();
+      memcpy(*cursor, &value, sizeof(value));
+      *cursor += sizeof(value);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+static Status ReadValues(Config* config, const uint8_t** cursor) {
+  switch (config->GetType()) {
+    case Config::OBJECT: {
+      for (auto& [k, v] :
+           *reinterpret_cast<ConfigObject*>(config)->GetMembers()) {
+        if (ReadValues(v.get(), cursor) != OK) {
+          return ERROR;
+        }
+      }
+      return OK;
+    }
+    case Config::LIST: {
+      for (auto& v : *reinterpret_cast<ConfigList*>(config)->GetList()) {
+        if (ReadValues(v.get(), cursor) != OK) {
+          return ERROR;
+        }
+      }
+      return OK;
+    }
+    case Config::INTEGER: {
+      ConfigInt* config_int = reinterpret_cast<ConfigInt*>(config);
+      int32_t value;
+      memcpy(&value, *cursor, sizeof(value));
+      *cursor += sizeof(value);
+      const auto [min, max] = config_int->GetMinMax();
+      if (value < min || value > max) {
+        return ERROR;
+      }
+      config_int->SetValue(value);
+      return OK;
+    }
+    case Config::FLOAT: {
+      ConfigFloat* config_float = reinterpret_cast<ConfigFloat*>(config);
+      float value;
+      memcpy(&value, *cursor, sizeof(value));
+      *cursor += sizeof(value);
+      const auto [min, max] = config_float->GetMinMax();
+      if (!(value >= min && value <= max)) {  // Also rejects NaN
+        return ERROR;
+      }
+      config_float->SetValue(value);
+      return OK;
+    }
+    default:
+      return OK;
+  }
+}
+
+size_t GetBinaryConfigSize(const Config* config) {
+  uint16_t num_values = 0;
+  HashSchema(config, kFNVOffsetBasis, &num_values);
+  return sizeof(BinaryConfigHeader) + num_values * sizeof(uint32_t);
+}
+
+void SerializeBinaryConfig(const Config* config, std::string* output) {
+  BinaryConfigHeader header = {
+      .magic = kBinaryConfigMagic,
+      .version = kBinaryConfigVersion,
+      .num_values = 0,
+  };
+  header.schema_hash = HashSchema(config, kFNVOffsetBasis, &header.num_values);
+
+  output->resize(sizeof(header) + header.num_values * sizeof(uint32_t));
+  uint8_t* values = (uint8_t*)output->data() + sizeof(header);
+  uint8_t* cursor = values;
+  WriteValues(config, &cursor);
+  header.checksum = FNV1a(kFNVOffsetBasis, values, cursor - values);
+
+  memcpy(output->data(), &header, sizeof(header));
+}
+
+Status ParseBinaryConfig(const uint8_t* data, size_t size,
+                         Config* default_config) {
+  BinaryConfigHeader header;
+  if (size < sizeof(header)) {
+    return ERROR;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != kBinaryConfigMagic ||
+      header.version != kBinaryConfigVersion) {
+    return ERROR;
+  }
+
+  uint16_t num_values = 0;
+  const uint32_t schema_hash =
+      HashSchema(default_config, kFNVOffsetBasis, &num_values);
+  const size_t values_size = num_values * sizeof(uint32_t);
+  if (header.schema_hash != schema_hash || header.num_values != num_values ||
+      size != sizeof(header) + values_size) {
+    LOG_WARNING("Binary config doesn't match the config structure");
+    return ERROR;
+  }
+  const uint8_t* values = data + sizeof(header);
+  if (FNV1a(kFNVOffsetBasis, values, values_size) != header.checksum) {
+    LOG_WARNING("Binary config checksum mismatch");
+    return ERROR;
+  }
+
+  const uint8_t* cursor = values;
+  return ReadValues(default_config, &cursor);
+}
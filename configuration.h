@@ -3,9 +3,13 @@
 
 #include <stdint.h>
 
+#include <array>
+#include <atomic>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -39,6 +43,39 @@
   (std::shared_ptr<ConfigFloat>(                  \
       new ConfigFloat((value), (min), (max), (resolution))))
 
+// Streams compact json to a sink, in chunks of at most kChunkSize bytes. Only
+// the chunk buffer is held in RAM, whatever the size of the output.
+class JsonWriter {
+ public:
+  static constexpr size_t kChunkSize = 64;
+
+  using Sink = std::function<Status(const char* data, size_t size)>;
+
+  explicit JsonWriter(Sink sink)
+      : sink_(std::move(sink)), size_(0), status_(OK) {}
+
+  void Write(const char* data, size_t size);
+  void Write(char c) { Write(&c, 1); }
+  // Quoted and escaped
+  void WriteString(const std::string& str);
+  void WriteNumber(int32_t value);
+  void WriteNumber(float value);
+
+  // Sends the rest of the buffer. Returns ERROR if the sink failed at any
+  // point.
+  Status Finish();
+
+ private:
+  void Flush();
+
+  Sink sink_;
+  std::array<char, kChunkSize> buffer_;
+  size_t size_;
+  Status status_;
+};
+
+class ConfigHandleBase;
+
 class Config {
  public:
   enum Type {
@@ -51,6 +88,28 @@ class Config {
   virtual Type GetType() const { return INVALID; }
   virtual cJSON* ToCJSON() const { return NULL; }
   virtual Status FromCJSON(const cJSON* json) { return ERROR; }
+  // Same output as ToCJSON, without building the cJSON tree
+  virtual void WriteJSON(JsonWriter* writer) const {}
+
+  // Generation of the last change to this config or, for objects and lists,
+  // to any config under it. Generations only increase and a new config starts
+  // with a generation newer than any existing one, so a subtree has changed
+  // iff its generation differs from the one seen last time.
+  virtual uint32_t GetGeneration() const { return generation_; }
+
+  // Set by ConfigHandle::Bind(). See BindConfigHandles().
+  ConfigHandleBase* GetHandle() const { return handle_; }
+  void SetHandle(ConfigHandleBase* handle) { handle_ = handle; }
+
+ protected:
+  Config();
+
+  // Called by the setters when the value actually changes
+  void MarkChanged();
+
+ private:
+  uint32_t generation_;
+  ConfigHandleBase* handle_;
 };
 
 class ConfigObject : public Config {
@@ -71,9 +130,12 @@ class ConfigObject : public Config {
     return &members_;
   }
 
+  // Compact json
   std::string ToJSON() const;
   cJSON* ToCJSON() const override;
   Status FromCJSON(const cJSON* json) override;
+  void WriteJSON(JsonWriter* writer) const override;
+  uint32_t GetGeneration() const override;
 
  private:
   std::map<std::string, std::shared_ptr<Config>> members_;
@@ -92,6 +154,8 @@ class ConfigList : public Config {
 
   cJSON* ToCJSON() const override;
   Status FromCJSON(const cJSON* json) override;
+  void WriteJSON(JsonWriter* writer) const override;
+  uint32_t GetGeneration() const override;
 
  private:
   std::vector<std::shared_ptr<Config>> list_;
@@ -111,14 +175,16 @@ class ConfigInt : public Config {
       : value_(value), min_(min), max_(max) {}
 
   std::pair<int32_t, int32_t> GetMinMax() const { return {min_, max_}; }
-  int32_t GetValue() const { return value_; }
-  void SetValue(int32_t value) { value_ = value; }
+  // Can be called from any task
+  int32_t GetValue() const { return value_.load(std::memory_order_relaxed); }
+  void SetValue(int32_t value);
 
   cJSON* ToCJSON() const override;
   Status FromCJSON(const cJSON* json) override;
+  void WriteJSON(JsonWriter* writer) const override;
 
  private:
-  int32_t value_;
+  std::atomic<int32_t> value_;
   const int32_t min_;
   const int32_t max_;
 };
@@ -132,21 +198,84 @@ class ConfigFloat : public Config {
 
   std::pair<float, float> GetMinMax() const { return {min_, max_}; }
   float GetResolution() const { return resolution_; }
-  float GetValue() const { return value_; }
-  void SetValue(float value) { value_ = value; }
+  // Can be called from any task
+  float GetValue() const { return value_.load(std::memory_order_relaxed); }
+  void SetValue(float value);
 
   cJSON* ToCJSON() const override;
   Status FromCJSON(const cJSON* json) override;
+  void WriteJSON(JsonWriter* writer) const override;
 
  private:
-  float value_;
+  std::atomic<float> value_;
   const float min_;
   const float max_;
   const float resolution_;
 };
 
+class ConfigHandleBase {
+ public:
+  virtual void Rebind(const std::shared_ptr<Config>& leaf) = 0;
+};
+
+// Typed handle to an integer or float leaf of a device config. The device marks
+// the leaf when it creates its default config:
+//
+//   CONFIG_OBJECT_ELEM("brightness", brightness_.Bind(CONFIG_FLOAT(...)))
+//
+// Bind() only tags the new leaf, so CreateDefaultConfig() has no side effects
+// and can also be used to build a separate tree of defaults. The handle is
+// pointed at the leaf by BindConfigHandles() when the tree is added to the
+// global config, which only happens at boot. So the leaf is never freed once
+// the tasks run, and Get() is safe from any task and lock-free since the value
+// is a single word.
+//
+// T can be any type the leaf value converts to, e.g. bool, uint8_t or an enum
+// for integers.
+template <typename T>
+class ConfigHandle : public ConfigHandleBase {
+ public:
+  using Leaf = std::conditional_t<std::is_floating_point_v<T>, ConfigFloat,
+                                  ConfigInt>;
+
+  std::shared_ptr<Leaf> Bind(std::shared_ptr<Leaf> leaf) {
+    leaf->SetHandle(this);
+    return leaf;
+  }
+
+  void Rebind(const std::shared_ptr<Config>& leaf) override {
+    leaf_ = std::static_pointer_cast<Leaf>(leaf);
+  }
+
+  T Get() const { return static_cast<T>(leaf_->GetValue()); }
+  // See Config::GetGeneration()
+  uint32_t GetGeneration() const { return leaf_->GetGeneration(); }
+
+ private:
+  std::shared_ptr<Leaf> leaf_;
+};
+
+// Points the handles bound to the leaves under config at those leaves
+void BindConfigHandles(const std::shared_ptr<Config>& config);
+
 // If return is ERROR, default_config will be in an invalid state.
 // default_config is modified in place.
 Status ParseJsonConfig(const std::string& json, Config* default_config);
 
+// Compact binary format. A header with the hash of the tree structure (types,
+// keys and list sizes) followed by the 4 byte values of the leaves, depth
+// first. The values are at fixed offsets given the structure, so parsing
+// doesn't allocate or look up any keys. A config saved by a firmware with a
+// different structure is rejected.
+
+// Size of the binary serialization of config
+size_t GetBinaryConfigSize(const Config* config);
+
+// output is resized to GetBinaryConfigSize()
+void SerializeBinaryConfig(const Config* config, std::string* output);
+
+// Parses in place from data. Same contract as ParseJsonConfig.
+Status ParseBinaryConfig(const uint8_t* data, size_t size,
+                         Config* default_config);
+
 #endif /* CONFIGURATION_H_ */
@@ -0,0 +1,465 @@
+#include "heap.h"
+
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+
+#include "FreeRTOS.h"
+#include "pico/mutex.h"
+#include "pico/platform.h"
+#include "task.h"
+
+extern "C" {
+#include "cJSON/cJSON.h"
+}
+
+#ifndef CONFIG_HEAP_POOL_16_BLOCKS
+#define CONFIG_HEAP_POOL_16_BLOCKS 256
+#endif
+#ifndef CONFIG_HEAP_POOL_32_BLOCKS
+#define CONFIG_HEAP_POOL_32_BLOCKS 128
+#endif
+#ifndef CONFIG_HEAP_POOL_48_BLOCKS
+#define CONFIG_HEAP_POOL_48_BLOCKS 128
+#endif
+#ifndef CONFIG_HEAP_POOL_64_BLOCKS
+#define CONFIG_HEAP_POOL_64_BLOCKS 64
+#endif
+
+namespace {
+
+// Fixed size blocks carved out of a static buffer. Blocks which have never
+// been handed out are taken from the end of the buffer, so nothing has to be
+// initialized at boot. Constant initialized, since static constructors can
+// allocate before the dynamic initialization of this file.
+class BlockPool {
+ public:
+  constexpr BlockPool(uint8_t* storage, size_t block_size, size_t num_blocks)
+      : storage_(storage),
+        block_size_(block_size),
+        num_blocks_(num_blocks),
+        free_list_(NULL),
+        num_touched_(0),
+        in_use_(0),
+        peak_(0) {}
+
+  size_t BlockSize() const { return block_size_; }
+
+  bool Contains(void* ptr) const {
+    return (uintptr_t)ptr >= (uintptr_t)storage_ &&
+           (uintptr_t)ptr < (uintptr_t)storage_ + block_size_ * num_blocks_;
+  }
+
+  // Returns NULL when the pool is exhausted. Requires heap_lock.
+  void* Allocate() {
+    void* ptr;
+    if (free_list_ != NULL) {
+      ptr = free_list_;
+      free_list_ = free_list_->next;
+    } else if (num_touched_ < num_blocks_) {
+      ptr = storage_ + block_size_ * (num_touched_++);
+    } else {
+      return NULL;
+    }
+    peak_ = std::max(peak_, ++in_use_);
+    return ptr;
+  }
+
+  // Requires heap_lock.
+  void Free(void* ptr) {
+    FreeBlock* block = (FreeBlock*)ptr;
+    block->next = free_list_;
+    free_list_ = block;
+    --in_use_;
+  }
+
+  HeapStats::Pool GetStats() const {
+    return {.block_size = block_size_,
+            .num_blocks = num_blocks_,
+            .in_use = in_use_,
+            .peak = peak_};
+  }
+
+ private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  uint8_t* const storage_;
+  const size_t block_size_;
+  const size_t num_blocks_;
+  FreeBlock* free_list_;
+  size_t num_touched_;
+  size_t in_use_;
+  size_t peak_;
+};
+
+}  // namespace
+
+alignas(8) static uint8_t pool_16[16 * CONFIG_HEAP_POOL_16_BLOCKS];
+alignas(8) static uint8_t pool_32[32 * CONFIG_HEAP_POOL_32_BLOCKS];
+alignas(8) static uint8_t pool_48[48 * CONFIG_HEAP_POOL_48_BLOCKS];
+alignas(8) static uint8_t pool_64[64 * CONFIG_HEAP_POOL_64_BLOCKS];
+
+// Ordered by block size
+static BlockPool pools[] = {
+    BlockPool(pool_16, 16, CONFIG_HEAP_POOL_16_BLOCKS),
+    BlockPool(pool_32, 32, CONFIG_HEAP_POOL_32_BLOCKS),
+    BlockPool(pool_48, 48, CONFIG_HEAP_POOL_48_BLOCKS),
+    BlockPool(pool_64, 64, CONFIG_HEAP_POOL_64_BLOCKS),
+};
+
+// malloc and friends are wrapped at link time (see CMakeLists.txt), so the
+// real newlib functions are only reached from here. This replaces pico_malloc,
+// including its lock.
+extern "C" {
+void* __real_malloc(size_t size);
+void __real_free(void* ptr);
+}
+
+auto_init_mutex(malloc_mutex);
+
+// Protects the pools and the counters. Never held while calling malloc, which
+// has its own lock.
+static spin_lock_t* heap_lock = NULL;
+static size_t bytes_in_use = 0;
+static size_t peak_bytes_in_use = 0;
+static size_t general_bytes_in_use = 0;
+
+// The first allocation happens in the static constructors, before anything
+// else runs.
+static spin_lock_t* GetHeapLock() {
+  if (heap_lock == NULL) {
+    heap_lock = spin_lock_init(spin_lock_claim_unused(/*required=*/true));
+  }
+  return heap_lock;
+}
+
+static void CountAllocation(size_t size) {
+  bytes_in_use += size;
+  peak_bytes_in_use = std::max(peak_bytes_in_use, bytes_in_use);
+}
+
+static void* AllocateFromPoolsOrMalloc(size_t size) {
+  for (BlockPool& pool : pools) {
+    if (size > pool.BlockSize()) {
+      continue;
+    }
+    LockSpinlock lock(GetHeapLock());
+    void* ptr = pool.Allocate();
+    if (ptr != NULL) {
+      CountAllocation(pool.BlockSize());
+      return ptr;
+    }
+    // Exhausted. Try the next size.
+  }
+
+  mutex_enter_blocking(&malloc_mutex);
+  void* ptr = __real_malloc(size);
+  mutex_exit(&malloc_mutex);
+  if (ptr != NULL) {
+    const size_t usable_size = malloc_usable_size(ptr);
+    LockSpinlock lock(GetHeapLock());
+    general_bytes_in_use += usable_size;
+    CountAllocation(usable_size);
+  }
+  return ptr;
+}
+
+static void FreeToPoolsOrMalloc(void* ptr) {
+  for (BlockPool& pool : pools) {
+    if (pool.Contains(ptr)) {
+      LockSpinlock lock(GetHeapLock());
+      pool.Free(ptr);
+      bytes_in_use -= pool.BlockSize();
+      return;
+    }
+  }
+
+  const size_t usable_size = malloc_usable_size(ptr);
+  {
+    LockSpinlock lock(GetHeapLock());
+    general_bytes_in_use -= usable_size;
+    bytes_in_use -= usable_size;
+  }
+  mutex_enter_blocking(&malloc_mutex);
+  __real_free(ptr);
+  mutex_exit(&malloc_mutex);
+}
+
+HeapStats GetHeapStats() {
+  extern char end;  // Start of the general heap. Set by the linker.
+  extern char __StackLimit;
+
+  HeapStats stats;
+  stats.heap_size = (char*)sbrk(0) - &end;
+  stats.heap_limit = &__StackLimit - &end;
+
+  LockSpinlock lock(GetHeapLock());
+  stats.bytes_in_use = bytes_in_use;
+  stats.peak_bytes_in_use = peak_bytes_in_use;
+  stats.heap_unused = stats.heap_size > general_bytes_in_use
+                          ? stats.heap_size - general_bytes_in_use
+                          : 0;
+  stats.fragmentation =
+      stats.heap_size > 0 ? stats.heap_unused * 100 / stats.heap_size : 0;
+  for (size_t i = 0; i < stats.pools.size(); ++i) {
+    stats.pools[i] = pools[i].GetStats();
+  }
+  return stats;
+}
+
+void InitializeHeap() {
+  cJSON_Hooks hooks = {.malloc_fn = HeapAlloc, .free_fn = HeapFree};
+  cJSON_InitHooks(&hooks);
+}
+
+ScratchArena::ScratchArena() : head_(NULL), bytes_used_(0) {}
+
+ScratchArena::~ScratchArena() {
+  while (head_ != NULL) {
+    Block* next = head_->next;
+    HeapFree(head_);
+    head_ = next;
+  }
+}
+
+void* ScratchArena::Allocate(size_t size) {
+  const size_t aligned_size = (size + 7) & ~(size_t)7;
+  if (head_ == NULL || head_->used + aligned_size > head_->capacity) {
+    // Larger allocations get a block of their own
+    const size_t capacity = std::max(aligned_size, kBlockSize - sizeof(Block));
+    Block* block = (Block*)HeapAlloc(sizeof(Block) + capacity);
+    if (block == NULL) {
+      return NULL;
+    }
+    block->next = head_;
+    block->used = 0;
+    block->capacity = capacity;
+    head_ = block;
+    bytes_used_ += sizeof(Block);
+  }
+  void* ptr = (uint8_t*)(head_ + 1) + head_->used;
+  head_->used += aligned_size;
+  bytes_used_ += aligned_size;
+  return ptr;
+}
+
+static ScratchArena* cjson_arena = NULL;
+
+static void* CJSONArenaAlloc(size_t size) {
+  return cjson_arena->Allocate(size);
+}
+
+static void CJSONArenaFree(void* ptr) {}
+
+CJSONArenaSection::CJSONArenaSection(ScratchArena* arena)
+    : previous_arena_(cjson_arena) {
+  cjson_arena = arena;
+  cJSON_Hooks hooks = {.malloc_fn = CJSONArenaAlloc,
+                       .free_fn = CJSONArenaFree};
+  cJSON_InitHooks(&hooks);
+}
+
+CJSONArenaSection::~CJSONArenaSection() {
+  // The arena hooks stay installed for the outer section
+  cjson_arena = previous_arena_;
+  if (cjson_arena == NULL) {
+    InitializeHeap();
+  }
+}
+
+extern "C" void* pvPortMalloc(size_t size) {
+  void* ptr = HeapAlloc(size);
+  if (ptr == NULL) {
+    extern void vApplicationMallocFailedHook(void);
+    vApplicationMallocFailedHook();
+  }
+  return ptr;
+}
+
+extern "C" void vPortFree(void* ptr) { HeapFree(ptr); }
+
+void* operator new(size_t size) { return HeapAlloc(size); }
+void* operator new[](size_t size) { return HeapAlloc(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return HeapAlloc(size);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return HeapAlloc(size);
+}
+
+void operator delete(void* ptr) noexcept { HeapFree(ptr); }
+void operator delete[](void* ptr) noexcept { HeapFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { HeapFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { HeapFree(ptr); }
+
+#if STATIC_ALLOCATION
+
+#ifndef CONFIG_DEVICE_ARENA_SIZE
+#define CONFIG_DEVICE_ARENA_SIZE (16 * 1024)
+#endif
+
+// Thread local storage slot holding the HeapAllowedSection depth of each task
+static constexpr BaseType_t kHeapAllowedIndex =
+    configNUM_THREAD_LOCAL_STORAGE_POINTERS - 1;
+
+static bool heap_frozen = false;
+static bool device_arena_active = false;
+alignas(8) static uint8_t device_arena[CONFIG_DEVICE_ARENA_SIZE];
+static size_t device_arena_used = 0;
+
+static bool IsHeapAllowed() {
+  if (!heap_frozen ||
+      xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED) {
+    return true;
+  }
+  return pvTaskGetThreadLocalStoragePointer(NULL, kHeapAllowedIndex) != NULL;
+}
+
+static bool IsInDeviceArena(void* ptr) {
+  return (uintptr_t)ptr >= (uintptr_t)device_arena &&
+         (uintptr_t)ptr < (uintptr_t)device_arena + sizeof(device_arena);
+}
+
+void* HeapAlloc(size_t size) {
+  if (size == 0) {
+    size = 1;
+  }
+
+  if (device_arena_active) {
+    const size_t aligned_size = (size + 7) & ~(size_t)7;
+    if (device_arena_used + aligned_size <= sizeof(device_arena)) {
+      void* ptr = &device_arena[device_arena_used];
+      device_arena_used += aligned_size;
+      return ptr;
+    }
+    LOG_WARNING("Device arena is full. Allocating %d bytes from the heap",
+                size);
+  }
+
+  if (!IsHeapAllowed()) {
+    panic("Heap allocation of %d bytes after boot", size);
+  }
+  return AllocateFromPoolsOrMalloc(size);
+}
+
+void HeapFree(void* ptr) {
+  // Device arena is never freed
+  if (ptr == NULL || IsInDeviceArena(ptr)) {
+    return;
+  }
+  FreeToPoolsOrMalloc(ptr);
+}
+
+void FreezeHeap() {
+  heap_frozen = true;
+  LOG_INFO("Device arena uses %d of %d bytes", device_arena_used,
+           sizeof(device_arena));
+}
+
+HeapAllowedSection::HeapAllowedSection(bool allowed)
+    : allowed_(allowed &&
+               xTaskGetSchedulerState() != taskSCHEDULER_NOT_STARTED) {
+  if (allowed_) {
+    const uintptr_t depth = (uintptr_t)pvTaskGetThreadLocalStoragePointer(
+        NULL, kHeapAllowedIndex);
+    vTaskSetThreadLocalStoragePointer(NULL, kHeapAllowedIndex,
+                                      (void*)(depth + 1));
+  }
+}
+
+HeapAllowedSection::~HeapAllowedSection() {
+  if (allowed_) {
+    const uintptr_t depth = (uintptr_t)pvTaskGetThreadLocalStoragePointer(
+        NULL, kHeapAllowedIndex);
+    vTaskSetThreadLocalStoragePointer(NULL, kHeapAllowedIndex,
+                                      (void*)(depth - 1));
+  }
+}
+
+DeviceArenaSection::DeviceArenaSection() { device_arena_active = true; }
+
+DeviceArenaSection::~DeviceArenaSection() { device_arena_active = false; }
+
+#else
+
+void* HeapAlloc(size_t size) {
+  return AllocateFromPoolsOrMalloc(size == 0 ? 1 : size);
+}
+
+void HeapFree(void* ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  FreeToPoolsOrMalloc(ptr);
+}
+
+void FreezeHeap() {}
+
+HeapAllowedSection::HeapAllowedSection(bool allowed) : allowed_(allowed) {}
+
+HeapAllowedSection::~HeapAllowedSection() {}
+
+DeviceArenaSection::DeviceArenaSection() {}
+
+DeviceArenaSection::~DeviceArenaSection() {}
+
+#endif /* STATIC_ALLOCATION */
+
+// Allocations from C code, e.g. littlefs. The calls newlib makes internally
+// (_malloc_r, e.g. from strdup() or printf()) aren't wrapped and still go to
+// the real malloc. The firmware doesn't use them after boot.
+
+// Bytes which can be copied out of a block by realloc
+static size_t UsableSize(void* ptr) {
+  for (const BlockPool& pool : pools) {
+    if (pool.Contains(ptr)) {
+      return pool.BlockSize();
+    }
+  }
+#if STATIC_ALLOCATION
+  if (IsInDeviceArena(ptr)) {
+    // The size isn't recorded. Up to the end of the arena is safe to read.
+    return (uintptr_t)device_arena + sizeof(device_arena) - (uintptr_t)ptr;
+  }
+#endif
+  return malloc_usable_size(ptr);
+}
+
+extern "C" void* __wrap_malloc(size_t size) { return HeapAlloc(size); }
+
+extern "C" void* __wrap_calloc(size_t count, size_t size) {
+  size_t total;
+  if (__builtin_mul_overflow(count, size, &total)) {
+    return NULL;
+  }
+  void* ptr = HeapAlloc(total);
+  if (ptr != NULL) {
+    memset(ptr, 0, total);
+  }
+  return ptr;
+}
+
+extern "C" void* __wrap_realloc(void* ptr, size_t size) {
+  if (ptr == NULL) {
+    return HeapAlloc(size);
+  }
+  if (size == 0) {
+    HeapFree(ptr);
+    return NULL;
+  }
+  void* new_ptr = HeapAlloc(size);
+  if (new_ptr != NULL) {
+    memcpy(new_ptr, ptr, std::min(size, UsableSize(ptr)));
+    HeapFree(ptr);
+  }
+  return new_ptr;
+}
+
+extern "C" void __wrap_free(void* ptr) { HeapFree(ptr); }
@@ -0,0 +1,116 @@
+#ifndef HEAP_H_
+#define HEAP_H_
+
+#include <stddef.h>
+
+#include <array>
+
+#include "utils.h"
+
+// All the dynamic allocations of the firmware (C++ new, FreeRTOS pvPortMalloc,
+// cJSON and malloc from C code) go through HeapAlloc(). Small blocks are served
+// from fixed size pools, so the churn of shared_ptr control blocks, short
+// strings and cJSON nodes doesn't fragment the general heap. Everything else
+// goes to newlib's malloc, which grows up to the stack limit.
+
+void* HeapAlloc(size_t size);
+void HeapFree(void* ptr);
+
+// Installs the allocator for the C libraries. Called first thing in main().
+void InitializeHeap();
+
+struct HeapStats {
+  struct Pool {
+    size_t block_size;
+    size_t num_blocks;
+    size_t in_use;
+    size_t peak;
+  };
+
+  // Live allocations, pools included
+  size_t bytes_in_use;
+  size_t peak_bytes_in_use;
+
+  // General heap. heap_size is how far it has grown so far, heap_limit how far
+  // it can grow. heap_unused is the part of heap_size not held by live blocks
+  // (free holes and malloc overhead).
+  size_t heap_size;
+  size_t heap_limit;
+  size_t heap_unused;
+  // heap_unused as a percentage of heap_size
+  uint8_t fragmentation;
+
+  std::array<Pool, 4> pools;
+};
+
+HeapStats GetHeapStats();
+
+// Bump allocator for short bursts of small allocations, e.g. the cJSON nodes
+// while parsing. Memory is taken from the heap in blocks of kBlockSize and all
+// released at once by the destructor, so the burst doesn't leave holes in the
+// heap. Free() is a no-op.
+class ScratchArena {
+ public:
+  static constexpr size_t kBlockSize = 1024;
+
+  ScratchArena();
+  virtual ~ScratchArena();
+
+  void* Allocate(size_t size);
+
+  // Including the block headers and alignment
+  size_t BytesUsed() const { return bytes_used_; }
+
+ private:
+  struct alignas(8) Block {
+    Block* next;
+    size_t used;
+    size_t capacity;
+  };
+
+  Block* head_;
+  size_t bytes_used_;
+};
+
+// While alive, cJSON allocates from arena. Sections can be nested, the
+// destructor goes back to the arena (or heap) in use before. cJSON's hooks are
+// global, so a section redirects the cJSON calls of every task. Only use it
+// where a single task calls cJSON, e.g. at boot.
+class CJSONArenaSection {
+ public:
+  explicit CJSONArenaSection(ScratchArena* arena);
+  virtual ~CJSONArenaSection();
+
+ private:
+  ScratchArena* const previous_arena_;
+};
+
+// In STATIC_ALLOCATION builds, the heap is only used while booting. Once
+// FreezeHeap() has been called, any allocation outside of a HeapAllowedSection
+// traps. Without STATIC_ALLOCATION, these are no-ops.
+
+// Called at the end of runner::RunnerStart().
+void FreezeHeap();
+
+// Allows the current task to allocate, e.g. while reloading the config or in
+// config mode. Sections can be nested.
+class HeapAllowedSection {
+ public:
+  explicit HeapAllowedSection(bool allowed = true);
+  virtual ~HeapAllowedSection();
+
+ private:
+  const bool allowed_;
+};
+
+// Allocations made while this is alive are taken from a static arena of
+// CONFIG_DEVICE_ARENA_SIZE bytes and never freed. Used for the device objects,
+// which live until reboot. Falls back to the heap when the arena is full. Only
+// used during boot.
+class DeviceArenaSection {
+ public:
+  DeviceArenaSection();
+  virtual ~DeviceArenaSection();
+};
+
+#endif /* HEAP_H_ */
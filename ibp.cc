@@ -1,9 +1,12 @@
 #include "ibp.h"
 
+#include <assert.h>
 #include <string.h>
 
+#include <algorithm>
 #include <utility>
 
+#include "hardware/timer.h"
 #include "layout.h"
 #include "tusb.h"
 #include "utils.h"
@@ -12,8 +15,98 @@ extern "C" {
 #include "ibp_lib.h"
 }
 
-IBPDeviceBase::IBPDeviceBase() : is_config_mode_(false), has_update_({0}) {
-  packet_semaphore_ = xSemaphoreCreateBinary();
+#ifndef CONFIG_IBP_KEY_FRAME_INTERVAL_TICKS
+#define CONFIG_IBP_KEY_FRAME_INTERVAL_TICKS 100
+#endif
+
+#ifndef CONFIG_IBP_LINK_STATS_LOG_MS
+#define CONFIG_IBP_LINK_STATS_LOG_MS 10000
+#endif
+
+// The remote keys are released when nothing is received for this long
+#define IBP_LINK_TIMEOUT_TICKS (2 * CONFIG_IBP_KEY_FRAME_INTERVAL_TICKS)
+
+constexpr size_t kMaxMatrixSegments =
+    (kMaxMatrixPositions / 8 + IBP_MAX_MATRIX_BYTES - 1) / IBP_MAX_MATRIX_BYTES;
+
+// Bytes of a delta encoded packet left for the key segments, after the packet
+// header, the padding, and the link, consumer, mouse and layers segments.
+constexpr size_t kDeltaKeyBudget = IBP_MAX_PACKET_LEN - 1 - 3 - (2 + 2) -
+                                   (2 + 2) - (2 + 5) -
+                                   (2 + IBP_MAX_ACTIVELAYERS);
+// Enough for the key segments that fit in kDeltaKeyBudget and the others. The
+// keys are empty when sending the matrix.
+constexpr size_t kMaxDeltaSegments = 16;
+
+static bool SameLayers(const IBPLayers& a, const IBPLayers& b) {
+  return a.num_activated_layers == b.num_activated_layers &&
+         memcmp(a.active_layers, b.active_layers, a.num_activated_layers) == 0;
+}
+
+// Packs the local switch states into segments. Returns the number of segments.
+static size_t AddMatrixSegments(const KeyScan::MatrixState& state,
+                                IBPSegment* segments) {
+  const size_t num_bytes = (KeyScan::GetLocalMatrixSize() + 7) / 8;
+  size_t num_segments = 0;
+  for (size_t first = 0; first < num_bytes; first += IBP_MAX_MATRIX_BYTES) {
+    IBPSegment* segment = &segments[num_segments++];
+    memset(segment, 0, sizeof(IBPSegment));
+    segment->field_type = IBP_MATRIX;
+    auto& matrix = segment->field_data.matrix;
+    matrix.first_byte = first;
+    matrix.num_bytes =
+        std::min<size_t>(num_bytes - first, IBP_MAX_MATRIX_BYTES);
+    for (size_t i = 0; i < matrix.num_bytes; ++i) {
+      for (size_t bit = 0; bit < 8; ++bit) {
+        if (state[(first + i) * 8 + bit]) {
+          matrix.bitmap[i] |= (1 << bit);
+        }
+      }
+    }
+  }
+  return num_segments;
+}
+
+static int8_t AddMovement(int8_t a, int8_t b) {
+  return std::clamp<int16_t>((int16_t)a + b, INT8_MIN, INT8_MAX);
+}
+
+// Placeholder for the IBP_LINK segment, filled in when the packet is taken
+static void AddLinkSegment(IBPSegment* segments, size_t* num_segments) {
+  IBPSegment* segment = &segments[(*num_segments)++];
+  memset(segment, 0, sizeof(IBPSegment));
+  segment->field_type = IBP_LINK;
+}
+
+IBPDeviceBase::IBPDeviceBase()
+    : is_config_mode_(false),
+      has_update_({0}),
+      free_packets_((1 << kNumPackets) - 1),
+      inbound_packet_(kNoPacket),
+      outbound_packet_(kNoPacket),
+      send_matrix_(false),
+      delta_encoding_(false),
+      sent_state_({}),
+      outbound_pending_(false),
+      outbound_key_frame_(false),
+      outbound_retransmit_(false),
+      outbound_state_({}),
+      outbound_movement_({}),
+      ticks_since_key_frame_(0),
+      key_frame_due_(true),
+      acknowledge_(false),
+      peer_acks_(false),
+      next_sequence_(1),
+      last_received_sequence_(0),
+      num_in_flight_(0),
+      link_stats_({}),
+      last_link_stats_log_time_(0),
+      remote_delta_(false),
+      remote_awaiting_key_frame_(false),
+      remote_state_({}),
+      ticks_since_remote_key_frame_(0),
+      ticks_since_packet_(0) {
+  packet_semaphore_ = xSemaphoreCreateBinaryStatic(&packet_semaphore_buffer_);
   xSemaphoreGive(packet_semaphore_);
 }
 
@@ -21,6 +114,7 @@ void IBPDeviceBase::SendKeycode(uint8_t keycode) {
   if (is_config_mode_) {
     return;
   }
+  keys_.set(keycode);
   auto& keycodes = segments_[IBP_KEYCODE].field_data.keycodes;
   if (keycode >= HID_KEY_CONTROL_LEFT && keycode <= HID_KEY_GUI_RIGHT) {
     keycodes.modifier_bitmask |= (1 << (keycode - HID_KEY_CONTROL_LEFT));
@@ -91,122 +185,669 @@ void IBPDeviceBase::Pan(int8_t x, int8_t y) {
 void IBPDeviceBase::StartOfInputTick() {
   memset(has_update_, false, sizeof(has_update_));
   memset(segments_, 0, sizeof(segments_));
+  // Zero is IBP_KEYCODE. Each slot is sent as is by the full state encoding.
+  for (size_t i = 0; i < IBP_TOTAL; ++i) {
+    segments_[i].field_type = (FieldType)i;
+  }
+  keys_.reset();
 }
 
-constexpr size_t kOutputBufferSize = 128;
-
 void IBPDeviceBase::FinalizeInputTickOutput() {
-  IBPSegment segments[IBP_TOTAL];
+  if (delta_encoding_) {
+    FinalizeDeltaOutput();
+    return;
+  }
+  IBPSegment segments[IBP_TOTAL + kMaxMatrixSegments];
   size_t num_segments = 0;
+  if (acknowledge_) {
+    AddLinkSegment(segments, &num_segments);
+  }
   for (size_t i = 0; i < IBP_TOTAL; ++i) {
+    // The other half resolves the keys from the matrix
+    if (send_matrix_ && (i == IBP_KEYCODE || i == IBP_CONSUMER)) {
+      continue;
+    }
     if (has_update_[i]) {
+      assert(segments_[i].field_type == i);
       segments[num_segments++] = segments_[i];
     }
   }
-  uint8_t buffer[kOutputBufferSize];
-  const int num_bytes =
-      SerializeSegments(segments, num_segments, buffer, sizeof(buffer));
+  if (send_matrix_) {
+    num_segments += AddMatrixSegments(KeyScan::GetLocalMatrixState(),
+                                      &segments[num_segments]);
+  }
+  // The buffer is owned by this task until published
+  const uint8_t idx = AcquirePacket();
+  if (idx == kNoPacket) {
+    LOG_ERROR("No free IBP packet buffer");
+    return;
+  }
+  PacketBuffer& packet = packets_[idx];
+  const int num_bytes = SerializeSegments(segments, num_segments, packet.data,
+                                          IBP_MAX_PACKET_LEN);
+  LockSemaphore lock(packet_semaphore_);
   if (num_bytes <= 0) {
     LOG_ERROR("Failed to serialize segments");
+    ReleasePacketLocked(idx);
     return;
   }
+  packet.size = num_bytes;
+  PublishOutPacketLocked(idx);
+}
+
+void IBPDeviceBase::FinalizeDeltaOutput() {
+  IBPSegment segments[kMaxDeltaSegments];
+  size_t num_segments = 0;
+  auto new_segment = [&](FieldType field_type) {
+    IBPSegment* segment = &segments[num_segments++];
+    memset(segment, 0, sizeof(IBPSegment));
+    segment->field_type = field_type;
+    return segment;
+  };
+
   LockSemaphore lock(packet_semaphore_);
-  outbound_packet_ = std::string(buffer, buffer + num_bytes);
+  if (acknowledge_) {
+    AddLinkSegment(segments, &num_segments);
+  }
+  if (++ticks_since_key_frame_ >= CONFIG_IBP_KEY_FRAME_INTERVAL_TICKS) {
+    ticks_since_key_frame_ = 0;
+    key_frame_due_ = true;
+  }
+  // Deltas are against every state the other side may be in: the one of the
+  // last packet acked, and the ones of the packets in flight. Without acks,
+  // that's the state of the last packet taken by the transport. If
+  // outbound_packet_ hasn't been taken yet, it's replaced by this one.
+  const DeltaState& latest = LatestSentStateLocked();
+  bool retransmit = false;
+  // Returns true if differs() is true for any of those states. Changes which
+  // are already in the latest packet taken are sent again.
+  auto unacked = [&](auto differs) {
+    bool any = differs(sent_state_);
+    for (size_t i = 0; i < num_in_flight_; ++i) {
+      any = any || differs(in_flight_[i].state);
+    }
+    retransmit = retransmit || (any && !differs(latest));
+    return any;
+  };
+
+  // The other half resolves the keys from the matrix
+  const std::bitset<256> keys = send_matrix_ ? std::bitset<256>() : keys_;
+  std::bitset<256> changed = keys ^ sent_state_.keys;
+  for (size_t i = 0; i < num_in_flight_; ++i) {
+    changed |= keys ^ in_flight_[i].state.keys;
+  }
+  retransmit = (changed & ~(keys ^ latest.keys)).any();
+  const size_t num_changed = changed.count();
+  // 3 bytes for the header, the CRC and the pressed bitmask of each segment
+  const size_t event_bytes =
+      num_changed +
+      3 * ((num_changed + IBP_MAX_KEY_EVENTS - 1) / IBP_MAX_KEY_EVENTS);
+  const bool key_frame = key_frame_due_ || event_bytes > kDeltaKeyBudget;
+
+  DeltaState state = latest;
+  if (key_frame) {
+    // There's always one key frame segment, so the other side clears its keys
+    // even if none is pressed. Keys which don't fit are left out until the
+    // next key frame.
+    state.keys.reset();
+    IBPSegment* frame = new_segment(IBP_KEY_FRAME);
+    size_t key_bytes = 2;
+    for (size_t keycode = 0; keycode < keys.size(); ++keycode) {
+      if (!keys[keycode]) {
+        continue;
+      }
+      if (frame->field_data.key_frame.num_keycodes ==
+          IBP_MAX_KEY_FRAME_KEYCODES) {
+        if (key_bytes + 3 > kDeltaKeyBudget) {
+          break;
+        }
+        frame = new_segment(IBP_KEY_FRAME);
+        key_bytes += 2;
+      } else if (key_bytes + 1 > kDeltaKeyBudget) {
+        break;
+      }
+      auto& frame_data = frame->field_data.key_frame;
+      frame_data.keycodes[frame_data.num_keycodes++] = keycode;
+      state.keys.set(keycode);
+      ++key_bytes;
+    }
+  } else if (num_changed > 0) {
+    IBPSegment* events = NULL;
+    for (size_t keycode = 0; keycode < keys.size(); ++keycode) {
+      if (!changed[keycode]) {
+        continue;
+      }
+      if (events == NULL ||
+          events->field_data.key_events.num_events == IBP_MAX_KEY_EVENTS) {
+        events = new_segment(IBP_KEY_EVENTS);
+      }
+      auto& events_data = events->field_data.key_events;
+      if (keys[keycode]) {
+        events_data.pressed_bitmask |= (1 << events_data.num_events);
+      }
+      events_data.keycodes[events_data.num_events++] = keycode;
+    }
+    state.keys = keys;
+  }
+
+  const auto& consumer = segments_[IBP_CONSUMER].field_data.consumer_keycode;
+  const uint16_t consumer_keycode =
+      send_matrix_ ? 0 : consumer.consumer_keycode;
+  if (unacked([&](const DeltaState& sent) {
+        return sent.consumer_keycode != consumer_keycode;
+      }) ||
+      key_frame) {
+    new_segment(IBP_CONSUMER)->field_data.consumer_keycode.consumer_keycode =
+        consumer_keycode;
+    state.consumer_keycode = consumer_keycode;
+  }
+
+  IBPMouse mouse = segments_[IBP_MOUSE].field_data.mouse;
+  if (outbound_pending_) {
+    mouse.x = AddMovement(mouse.x, outbound_movement_.x);
+    mouse.y = AddMovement(mouse.y, outbound_movement_.y);
+    mouse.vertical = AddMovement(mouse.vertical, outbound_movement_.vertical);
+    mouse.horizontal =
+        AddMovement(mouse.horizontal, outbound_movement_.horizontal);
+  }
+  if (unacked([&](const DeltaState& sent) {
+        return sent.mouse_buttons != mouse.button_bitmask;
+      }) ||
+      key_frame || mouse.x != 0 || mouse.y != 0 || mouse.vertical != 0 ||
+      mouse.horizontal != 0) {
+    new_segment(IBP_MOUSE)->field_data.mouse = mouse;
+    state.mouse_buttons = mouse.button_bitmask;
+  }
+
+  const IBPLayers& layers = segments_[IBP_ACTIVE_LAYERS].field_data.layers;
+  if (has_update_[IBP_ACTIVE_LAYERS] &&
+      (unacked([&](const DeltaState& sent) {
+         return !SameLayers(layers, sent.layers);
+       }) ||
+       key_frame)) {
+    new_segment(IBP_ACTIVE_LAYERS)->field_data.layers = layers;
+    state.layers = layers;
+  }
+
+  if (send_matrix_) {
+    const KeyScan::MatrixState& matrix = KeyScan::GetLocalMatrixState();
+    if (unacked([&](const DeltaState& sent) {
+          return sent.matrix != matrix;
+        }) ||
+        key_frame) {
+      num_segments += AddMatrixSegments(matrix, &segments[num_segments]);
+      state.matrix = matrix;
+    }
+  }
+
+  const uint8_t idx = AcquirePacketLocked();
+  if (idx == kNoPacket) {
+    LOG_ERROR("No free IBP packet buffer");
+    return;
+  }
+  PacketBuffer& packet = packets_[idx];
+  const int num_bytes = SerializeSegments(segments, num_segments, packet.data,
+                                          IBP_MAX_PACKET_LEN);
+  if (num_bytes <= 0) {
+    LOG_ERROR("Failed to serialize segments");
+    ReleasePacketLocked(idx);
+    return;
+  }
+  packet.size = num_bytes;
+  PublishOutPacketLocked(idx);
+  outbound_pending_ = true;
+  outbound_key_frame_ = key_frame;
+  outbound_retransmit_ = retransmit;
+  outbound_state_ = state;
+  outbound_movement_ = mouse;
+}
+
+void IBPDeviceBase::InputLoopStart() {
+#if CONFIG_DEBUG_LOG_LEVEL >= 3  // L_INFO
+  // Every segment is checked on both sides, so this is the cost to expect per
+  // byte on the link
+  static constexpr size_t kIterations = 64;
+  uint8_t buffer[IBP_MAX_PACKET_LEN];
+  for (size_t i = 0; i < sizeof(buffer); ++i) {
+    buffer[i] = i;
+  }
+  uint8_t crc = 0;
+  const uint32_t start_time = time_us_32();
+  for (size_t i = 0; i < kIterations; ++i) {
+    buffer[0] = crc;
+    crc = IBPCalculateCRC8(buffer, sizeof(buffer));
+  }
+  const uint32_t duration = std::max<uint32_t>(time_us_32() - start_time, 1);
+  LOG_INFO("IBP CRC-8 throughput: %d KB/s",
+           kIterations * sizeof(buffer) * 1000 / 1024 / duration);
+#endif
 }
 
 void IBPDeviceBase::InputTick() {
-  std::string local_copy;
+  uint8_t idx;
   {
     LockSemaphore lock(packet_semaphore_);
-    std::swap(local_copy, inbound_packet_);
+    idx = inbound_packet_;
+    inbound_packet_ = kNoPacket;
   }
-  const size_t total_bytes = local_copy.size();
-  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(local_copy.c_str());
+  // Parsed in place, the buffer is owned by this task until released
+  const size_t total_bytes = idx == kNoPacket ? 0 : packets_[idx].size;
+  const uint8_t* bytes = idx == kNoPacket ? NULL : packets_[idx].data;
   size_t offset = 1;
+  bool key_frame_started = false;
+  bool has_matrix = false;
+  KeyScan::MatrixState matrix;
   while (offset < total_bytes) {
     IBPSegment segment;
     int bytes_consumed =
         DeSerializeSegment(bytes + offset, total_bytes - offset, &segment);
     if (bytes_consumed <= 0) {
+      // Anything but the padding is a bad segment
+      if (bytes[offset] != 0) {
+        CountLinkError();
+      }
       break;
     }
+    offset += bytes_consumed;
+    if (ApplyDeltaSegment(segment, &key_frame_started)) {
+      continue;
+    }
     switch (segment.field_type) {
-      case IBP_KEYCODE: {
-        const auto& ibp_keycodes = segment.field_data.keycodes;
-        std::vector<uint8_t> keycodes(
-            ibp_keycodes.keycodes,
-            ibp_keycodes.keycodes + ibp_keycodes.num_keycodes);
-        uint8_t bitmask = ibp_keycodes.modifier_bitmask;
-        for (size_t i = 0; i < 8; ++i) {
-          if (bitmask & 0x01) {
-            keycodes.push_back(HID_KEY_CONTROL_LEFT + i);
-          }
-          bitmask >>= 1;
-        }
-        for (auto& keyboard_output : *keyboard_output_) {
-          if (keyboard_output.get() == this) {
-            continue;
-          }
-          keyboard_output->SendKeycode(keycodes);
-        }
+      case IBP_KEYCODE:
+        SendRemoteKeycodes(segment.field_data.keycodes);
         break;
-      }
       case IBP_CONSUMER: {
         const auto& ibp_consumer = segment.field_data.consumer_keycode;
-        for (auto& keyboard_output : *keyboard_output_) {
-          if (keyboard_output.get() == this) {
-            continue;
-          }
+        for (auto* keyboard_output : remote_keyboard_outputs_) {
           keyboard_output->SendConsumerKeycode(ibp_consumer.consumer_keycode);
         }
         break;
       }
       case IBP_MOUSE: {
         const auto& ibp_mouse = segment.field_data.mouse;
-        std::vector<uint8_t> mouse_keycodes;
-        uint8_t bitmask = ibp_mouse.button_bitmask;
-        for (size_t i = MSE_L; i <= MSE_FORWARD; ++i) {
-          if (bitmask & 0x01) {
-            mouse_keycodes.push_back(i);
-          }
-          bitmask >>= 1;
-        }
-        for (auto& mouse_output : *mouse_output_) {
-          if (mouse_output.get() == this) {
-            continue;
-          }
-          for (auto k : mouse_keycodes) {
-            mouse_output->MouseKeycode(k);
-          }
+        SendRemoteMouseButtons(ibp_mouse.button_bitmask);
+        for (auto* mouse_output : remote_mouse_outputs_) {
           mouse_output->MouseMovement(ibp_mouse.x, ibp_mouse.y);
           mouse_output->Pan(ibp_mouse.horizontal, ibp_mouse.vertical);
         }
         break;
       }
+      case IBP_MATRIX: {
+        // The matrix segments of a packet replace the whole state
+        has_matrix = true;
+        const auto& ibp_matrix = segment.field_data.matrix;
+        for (size_t i = 0; i < ibp_matrix.num_bytes; ++i) {
+          for (size_t bit = 0; bit < 8; ++bit) {
+            const size_t position = (ibp_matrix.first_byte + i) * 8 + bit;
+            if (position < matrix.size() &&
+                (ibp_matrix.bitmap[i] >> bit) & 0x01) {
+              matrix.set(position);
+            }
+          }
+        }
+        break;
+      }
+      case IBP_LINK: {
+        LockSemaphore lock(packet_semaphore_);
+        HandleLinkSegmentLocked(segment.field_data.link);
+        break;
+      }
       // TODO: pass the layers in the future.
       default:
         break;
     }
   }
-}
 
-std::string IBPDeviceBase::GetOutPacket() {
-  uint8_t buffer[kOutputBufferSize];
-  const int num_bytes =
-      SerializeSegments(segments_, /*num_segments=*/0, buffer, sizeof(buffer));
-  if (num_bytes <= 0) {
-    LOG_ERROR("Create empty packet shouldn't fail.");
-    return "";
+  if (idx != kNoPacket) {
+    ReleasePacket(idx);
   }
-  std::string packet_copy(buffer, buffer + num_bytes);
-  {
+
+  // Full state packets always carry the matrix if the other half sends it.
+  // Delta encoded ones only when it changed.
+  if (total_bytes > 0) {
+    ticks_since_packet_ = 0;
+    if (has_matrix || !remote_delta_) {
+      KeyScan::SetRemoteMatrixState(matrix);
+    }
+  } else if (ticks_since_packet_ < IBP_LINK_TIMEOUT_TICKS &&
+             ++ticks_since_packet_ == IBP_LINK_TIMEOUT_TICKS) {
+    KeyScan::SetRemoteMatrixState({});
+    // Start over once the other side is back, from a key frame
     LockSemaphore lock(packet_semaphore_);
-    std::swap(packet_copy, outbound_packet_);
+    peer_acks_ = false;
+    num_in_flight_ = 0;
+    last_received_sequence_ = 0;
+    key_frame_due_ = true;
+  }
+  MaybeLogLinkStats();
+
+  if (remote_delta_) {
+    // Key frames stopped coming, e.g. the link is down. Release everything
+    // instead of holding the keys forever.
+    if (++ticks_since_remote_key_frame_ > IBP_LINK_TIMEOUT_TICKS) {
+      LOG_WARNING("No IBP key frame received, releasing the remote keys");
+      remote_delta_ = false;
+      // Events are relative to a state we no longer have
+      remote_awaiting_key_frame_ = true;
+      ticks_since_remote_key_frame_ = 0;
+      remote_state_ = {};
+      KeyScan::SetRemoteMatrixState({});
+      return;
+    }
+    SendRemoteState();
+  }
+}
+
+bool IBPDeviceBase::ApplyDeltaSegment(const IBPSegment& segment,
+                                      bool* key_frame_started) {
+  switch (segment.field_type) {
+    case IBP_KEY_EVENTS: {
+      if (remote_awaiting_key_frame_) {
+        return true;
+      }
+      const auto& events = segment.field_data.key_events;
+      for (size_t i = 0; i < events.num_events; ++i) {
+        remote_state_.keys.set(events.keycodes[i],
+                               (events.pressed_bitmask >> i) & 0x01);
+      }
+      remote_delta_ = true;
+      return true;
+    }
+    case IBP_KEY_FRAME: {
+      // The first key frame segment of a packet replaces the keys
+      if (!*key_frame_started) {
+        *key_frame_started = true;
+        remote_state_.keys.reset();
+        ticks_since_remote_key_frame_ = 0;
+        remote_awaiting_key_frame_ = false;
+      }
+      const auto& frame = segment.field_data.key_frame;
+      for (size_t i = 0; i < frame.num_keycodes; ++i) {
+        remote_state_.keys.set(frame.keycodes[i]);
+      }
+      remote_delta_ = true;
+      return true;
+    }
+    case IBP_CONSUMER: {
+      if (!remote_delta_) {
+        return false;
+      }
+      remote_state_.consumer_keycode =
+          segment.field_data.consumer_keycode.consumer_keycode;
+      return true;
+    }
+    case IBP_MOUSE: {
+      if (!remote_delta_) {
+        return false;
+      }
+      // Buttons are held until changed, the movement is only applied once
+      const auto& ibp_mouse = segment.field_data.mouse;
+      remote_state_.mouse_buttons = ibp_mouse.button_bitmask;
+      for (auto* mouse_output : remote_mouse_outputs_) {
+        mouse_output->MouseMovement(ibp_mouse.x, ibp_mouse.y);
+        mouse_output->Pan(ibp_mouse.horizontal, ibp_mouse.vertical);
+      }
+      return true;
+    }
+    case IBP_ACTIVE_LAYERS:
+      return remote_delta_;
+    default:
+      return false;
   }
-  return packet_copy;
 }
 
-void IBPDeviceBase::SetInPacket(const std::string& packet) {
+void IBPDeviceBase::SetKeyboardOutputs(
+    const std::vector<std::shared_ptr<KeyboardOutputDevice>>* devices) {
+  GenericInputDevice::SetKeyboardOutputs(devices);
+  remote_keyboard_outputs_.clear();
+  for (const auto& device : *devices) {
+    if (device.get() != this) {
+      remote_keyboard_outputs_.push_back(device.get());
+    }
+  }
+}
+
+void IBPDeviceBase::SetMouseOutputs(
+    const std::vector<std::shared_ptr<MouseOutputDevice>>* devices) {
+  GenericInputDevice::SetMouseOutputs(devices);
+  remote_mouse_outputs_.clear();
+  for (const auto& device : *devices) {
+    if (device.get() != this) {
+      remote_mouse_outputs_.push_back(device.get());
+    }
+  }
+}
+
+void IBPDeviceBase::SendRemoteState() {
+  // Collect the keys once for all the outputs
+  uint8_t keycodes[256];
+  size_t num_keycodes = 0;
+  for (size_t keycode = 0; keycode < remote_state_.keys.size(); ++keycode) {
+    if (remote_state_.keys[keycode]) {
+      keycodes[num_keycodes++] = keycode;
+    }
+  }
+  for (auto* keyboard_output : remote_keyboard_outputs_) {
+    for (size_t i = 0; i < num_keycodes; ++i) {
+      keyboard_output->SendKeycode(keycodes[i]);
+    }
+    if (remote_state_.consumer_keycode != 0) {
+      keyboard_output->SendConsumerKeycode(remote_state_.consumer_keycode);
+    }
+  }
+  SendRemoteMouseButtons(remote_state_.mouse_buttons);
+}
+
+void IBPDeviceBase::SendRemoteKeycodes(const IBPKeyCodes& keycodes) {
+  for (auto* keyboard_output : remote_keyboard_outputs_) {
+    for (size_t i = 0; i < keycodes.num_keycodes; ++i) {
+      keyboard_output->SendKeycode(keycodes.keycodes[i]);
+    }
+    uint8_t bitmask = keycodes.modifier_bitmask;
+    for (size_t i = 0; i < 8; ++i) {
+      if (bitmask & 0x01) {
+        keyboard_output->SendKeycode(HID_KEY_CONTROL_LEFT + i);
+      }
+      bitmask >>= 1;
+    }
+  }
+}
+
+void IBPDeviceBase::SendRemoteMouseButtons(uint8_t button_bitmask) {
+  for (auto* mouse_output : remote_mouse_outputs_) {
+    uint8_t bitmask = button_bitmask;
+    for (size_t i = MSE_L; i <= MSE_FORWARD; ++i) {
+      if (bitmask & 0x01) {
+        mouse_output->MouseKeycode(i);
+      }
+      bitmask >>= 1;
+    }
+  }
+}
+
+uint8_t IBPDeviceBase::AcquirePacketLocked() {
+  for (uint8_t idx = 0; idx < kNumPackets; ++idx) {
+    if (free_packets_ & (1 << idx)) {
+      free_packets_ &= ~(1 << idx);
+      return idx;
+    }
+  }
+  return kNoPacket;
+}
+
+void IBPDeviceBase::ReleasePacketLocked(uint8_t idx) {
+  free_packets_ |= (1 << idx);
+}
+
+void IBPDeviceBase::PublishOutPacketLocked(uint8_t idx) {
+  if (outbound_packet_ != kNoPacket) {
+    ReleasePacketLocked(outbound_packet_);
+  }
+  outbound_packet_ = idx;
+}
+
+uint8_t IBPDeviceBase::TakeOutPacket() {
   LockSemaphore lock(packet_semaphore_);
-  inbound_packet_ = packet;
+  uint8_t idx = outbound_packet_;
+  // What the other side gets from this packet, only used by delta encoding
+  bool key_frame = false;
+  DeltaState state = LatestSentStateLocked();
+  if (idx != kNoPacket) {
+    outbound_packet_ = kNoPacket;
+    if (outbound_pending_) {
+      key_frame = outbound_key_frame_;
+      state = outbound_state_;
+      if (outbound_retransmit_) {
+        ++link_stats_.retransmits;
+      }
+      outbound_pending_ = false;
+    }
+  } else {
+    // Nothing new, send an empty packet
+    idx = AcquirePacketLocked();
+    if (idx == kNoPacket) {
+      return kNoPacket;
+    }
+    IBPSegment link;
+    size_t num_segments = 0;
+    if (acknowledge_) {
+      AddLinkSegment(&link, &num_segments);
+    }
+    PacketBuffer& packet = packets_[idx];
+    const int num_bytes = SerializeSegments(&link, num_segments, packet.data,
+                                            IBP_MAX_PACKET_LEN);
+    if (num_bytes <= 0) {
+      LOG_ERROR("Create empty packet shouldn't fail.");
+      ReleasePacketLocked(idx);
+      return kNoPacket;
+    }
+    packet.size = num_bytes;
+  }
+
+  ++link_stats_.packets_sent;
+  if (acknowledge_) {
+    StampLinkSegmentLocked(&packets_[idx], key_frame, state);
+  }
+  if (!peer_acks_) {
+    sent_state_ = state;
+    if (key_frame) {
+      key_frame_due_ = false;
+    }
+  }
+  return idx;
+}
+
+uint8_t IBPDeviceBase::AcquirePacket() {
+  LockSemaphore lock(packet_semaphore_);
+  return AcquirePacketLocked();
+}
+
+void IBPDeviceBase::PutInPacket(uint8_t idx, uint8_t size) {
+  LockSemaphore lock(packet_semaphore_);
+  if (size > 0) {
+    ++link_stats_.packets_received;
+  }
+  packets_[idx].size = size;
+  if (inbound_packet_ != kNoPacket) {
+    ReleasePacketLocked(inbound_packet_);
+  }
+  inbound_packet_ = idx;
+}
+
+void IBPDeviceBase::ReleasePacket(uint8_t idx) {
+  LockSemaphore lock(packet_semaphore_);
+  ReleasePacketLocked(idx);
+}
+
+void IBPDeviceBase::CountLinkError() {
+  LockSemaphore lock(packet_semaphore_);
+  ++link_stats_.errors;
+}
+
+IBPDeviceBase::LinkStats IBPDeviceBase::GetLinkStats() {
+  LockSemaphore lock(packet_semaphore_);
+  return link_stats_;
+}
+
+const IBPDeviceBase::DeltaState& IBPDeviceBase::LatestSentStateLocked() const {
+  if (num_in_flight_ == 0) {
+    return sent_state_;
+  }
+  return in_flight_[num_in_flight_ - 1].state;
+}
+
+void IBPDeviceBase::StampLinkSegmentLocked(PacketBuffer* packet,
+                                           bool key_frame,
+                                           const DeltaState& state) {
+  const uint8_t sequence = next_sequence_;
+  // 0 is for the packets which aren't numbered
+  next_sequence_ = next_sequence_ == 255 ? 1 : next_sequence_ + 1;
+  // Right after the packet header and the segment header and CRC
+  packet->data[3] = sequence;
+  packet->data[4] = last_received_sequence_;
+  packet->data[2] = IBPCalculateCRC8(&packet->data[3], 2);
+
+  if (num_in_flight_ == kMaxInFlight) {
+    // Acks stopped coming. The other side may be in the state of the packet
+    // dropped here, so deltas can't be trusted until a key frame is acked.
+    std::move(in_flight_ + 1, in_flight_ + kMaxInFlight, in_flight_);
+    --num_in_flight_;
+    key_frame_due_ = true;
+  }
+  in_flight_[num_in_flight_++] = {.sequence = sequence,
+                                  .key_frame = key_frame,
+                                  .taken_time_us = time_us_32(),
+                                  .state = state};
+}
+
+void IBPDeviceBase::HandleLinkSegmentLocked(const IBPLink& link) {
+  if (link.sequence != 0) {
+    if (last_received_sequence_ != 0) {
+      // Sequence numbers are in [1, 255]
+      const int gap = (link.sequence - last_received_sequence_ + 255) % 255;
+      if (gap > 1) {
+        link_stats_.lost += gap - 1;
+      }
+    }
+    last_received_sequence_ = link.sequence;
+  }
+  if (link.ack == 0) {
+    return;
+  }
+  peer_acks_ = true;
+  for (size_t i = 0; i < num_in_flight_; ++i) {
+    const InFlightPacket& packet = in_flight_[i];
+    if (packet.sequence != link.ack) {
+      continue;
+    }
+    sent_state_ = packet.state;
+    if (packet.key_frame) {
+      key_frame_due_ = false;
+    }
+    link_stats_.last_latency_us = time_us_32() - packet.taken_time_us;
+    link_stats_.max_latency_us =
+        std::max(link_stats_.max_latency_us, link_stats_.last_latency_us);
+    // The older packets were either received before or lost, the changes they
+    // carried are in this one too
+    std::move(in_flight_ + i + 1, in_flight_ + num_in_flight_, in_flight_);
+    num_in_flight_ -= i + 1;
+    return;
+  }
+}
+
+void IBPDeviceBase::MaybeLogLinkStats() {
+#if CONFIG_DEBUG_LOG_LEVEL >= 3  // L_INFO
+  const uint64_t now = time_us_64();
+  if (!acknowledge_ || now - last_link_stats_log_time_ <
+                           CONFIG_IBP_LINK_STATS_LOG_MS * 1000ull) {
+    return;
+  }
+  last_link_stats_log_time_ = now;
+  const LinkStats stats = GetLinkStats();
+  LOG_INFO(
+      "IBP link: %d sent, %d received, %d errors, %d lost, %d retransmits, "
+      "%d us latency (max %d us)",
+      stats.packets_sent, stats.packets_received, stats.errors, stats.lost,
+      stats.retransmits, stats.last_latency_us, stats.max_latency_us);
+#endif
 }
@@ -1,11 +1,11 @@
 #ifndef IBP_H_
 #define IBP_H_
 
-#include <string>
-#include <string_view>
+#include <bitset>
 
 #include "FreeRTOS.h"
 #include "base.h"
+#include "keyscan.h"
 #include "semphr.h"
 
 extern "C" {
@@ -19,6 +19,22 @@ class IBPDeviceBase : public virtual KeyboardOutputDevice,
  public:
   IBPDeviceBase();
 
+  struct LinkStats {
+    uint32_t packets_sent;
+    uint32_t packets_received;
+    // Invalid packets and segments
+    uint32_t errors;
+    // Packets of the other side which never arrived, from the gaps in the
+    // sequence numbers
+    uint32_t lost;
+    // Packets sending changes again because the packet carrying them wasn't
+    // acked yet
+    uint32_t retransmits;
+    // From a packet being taken by the transport to its ack
+    uint32_t last_latency_us;
+    uint32_t max_latency_us;
+  };
+
   // No need to run anything on the output task as it's likely subclass will
   // have its own task for communication.
   void OutputTick() override {}
@@ -39,26 +55,166 @@ class IBPDeviceBase : public virtual KeyboardOutputDevice,
 
   void SetConfigMode(bool is_config_mode) { is_config_mode_ = is_config_mode; }
 
-  void InputLoopStart() override {}
+  void InputLoopStart() override;
   void InputTick() override;
+  // The outputs the received packets are fanned out to are collected once
+  // here, without this device
+  void SetKeyboardOutputs(
+      const std::vector<std::shared_ptr<KeyboardOutputDevice>>* devices)
+      override;
+  void SetMouseOutputs(
+      const std::vector<std::shared_ptr<MouseOutputDevice>>* devices) override;
 
- protected:
-  std::string GetOutPacket();
+  // Sequence numbers and acks are only counted with SetAcknowledge()
+  LinkStats GetLinkStats();
 
-  // Full packet with the transaction header.
-  void SetInPacket(const std::string& packet);
+ protected:
+  static constexpr uint8_t kNoPacket = 0xff;
+  // Room for the header window the SPI host clocks after its packet
+  static constexpr size_t kPacketBufferSize = IBP_MAX_PACKET_LEN + 4;
+
+  // Full packet with the transaction header
+  struct alignas(4) PacketBuffer {
+    uint8_t data[kPacketBufferSize];
+    uint8_t size;
+  };
+
+  // Packets are exchanged with the transport task through a fixed pool of
+  // buffers, handed over by index. Only the owner of an index touches its
+  // buffer, so packets are serialized and parsed in place, and sent and
+  // received by the transport, without copies or allocations.
+
+  // Takes the latest out bound packet, or an empty packet if there's nothing
+  // new. Returns kNoPacket if the pool is exhausted.
+  uint8_t TakeOutPacket();
+  // A buffer to receive a packet in. Returns kNoPacket if the pool is
+  // exhausted.
+  uint8_t AcquirePacket();
+  // Hands a received packet over to the input task. Replaces the previous one
+  // if it wasn't parsed yet.
+  void PutInPacket(uint8_t idx, uint8_t size);
+  void ReleasePacket(uint8_t idx);
+  PacketBuffer& GetPacket(uint8_t idx) { return packets_[idx]; }
+
+  // Sends key presses and releases instead of the keys pressed, with a key
+  // frame of the full state every CONFIG_IBP_KEY_FRAME_INTERVAL_TICKS ticks.
+  // Only the sender needs it, both encodings are decoded.
+  void SetDeltaEncoding(bool enabled) { delta_encoding_ = enabled; }
+
+  // Sends the debounced switch states of KeyScan instead of the keycodes, so
+  // the other half resolves the keys with its own layout. See REMOTE() in
+  // layout_helper.h.
+  void SetSendMatrix(bool enabled) { send_matrix_ = enabled; }
+
+  // Numbers the packets and acks the packets of the other side with an
+  // IBP_LINK segment. With delta encoding, the changes are sent again until a
+  // packet carrying them is acked. Both sides should enable it.
+  void SetAcknowledge(bool enabled) { acknowledge_ = enabled; }
+
+  // Called by the transport on invalid packets
+  void CountLinkError();
 
  private:
+  // The state the other side has after receiving a delta encoded packet
+  struct DeltaState {
+    std::bitset<256> keys;
+    uint16_t consumer_keycode;
+    uint8_t mouse_buttons;
+    IBPLayers layers;
+    KeyScan::MatrixState matrix;
+  };
+
+  // One out bound packet being sent, one waiting to be taken and one being
+  // built. Same for the in bound packets.
+  static constexpr size_t kNumPackets = 6;
+
+  // A packet taken by the transport and not acked yet
+  struct InFlightPacket {
+    uint8_t sequence;
+    bool key_frame;
+    uint32_t taken_time_us;
+    DeltaState state;
+  };
+  static constexpr size_t kMaxInFlight = 8;
+
+  // Call with packet_semaphore_ held
+  uint8_t AcquirePacketLocked();
+  void ReleasePacketLocked(uint8_t idx);
+  void PublishOutPacketLocked(uint8_t idx);
+  // The state of the other side once it gets all the packets taken so far
+  const DeltaState& LatestSentStateLocked() const;
+  // Numbers a packet being taken. The IBP_LINK segment is always first.
+  void StampLinkSegmentLocked(PacketBuffer* packet, bool key_frame,
+                              const DeltaState& state);
+  void HandleLinkSegmentLocked(const IBPLink& link);
+  void MaybeLogLinkStats();
+
+  void FinalizeDeltaOutput();
+  // Applies a delta encoded segment to the remote state. Returns false if the
+  // segment isn't delta encoded.
+  bool ApplyDeltaSegment(const IBPSegment& segment, bool* key_frame_started);
+  void SendRemoteState();
+  void SendRemoteKeycodes(const IBPKeyCodes& keycodes);
+  void SendRemoteMouseButtons(uint8_t button_bitmask);
+
   bool is_config_mode_;
   bool has_update_[IBP_TOTAL];
   IBPSegment segments_[IBP_TOTAL];
-  std::string inbound_packet_;
-  std::string outbound_packet_;
 
-  // Protects both the inbound and outbound packets. One lock is enough because
-  // there are usually only two tasks involved: the input task and the low level
-  // protocol task.
+  PacketBuffer packets_[kNumPackets];
+  // Bit i is set if packets_[i] is free
+  uint8_t free_packets_;
+  uint8_t inbound_packet_;
+  uint8_t outbound_packet_;
+
+  bool send_matrix_;
+
+  // Sender side of the delta encoding. keys_ is only touched by the input
+  // task, the rest is protected by packet_semaphore_.
+  bool delta_encoding_;
+  std::bitset<256> keys_;
+  // The state of the last packet acked. Without acks, the state of the last
+  // packet taken by the transport.
+  DeltaState sent_state_;
+  // The state in outbound_packet_, if it's delta encoded
+  bool outbound_pending_;
+  bool outbound_key_frame_;
+  bool outbound_retransmit_;
+  DeltaState outbound_state_;
+  // Mouse movement in outbound_packet_. Added to the next packet if
+  // outbound_packet_ is replaced before being taken.
+  IBPMouse outbound_movement_;
+  uint32_t ticks_since_key_frame_;
+  bool key_frame_due_;
+
+  // Link layer, protected by packet_semaphore_
+  bool acknowledge_;
+  // Set once the other side acks, until the link times out. Before that,
+  // packets count as received once taken.
+  bool peer_acks_;
+  uint8_t next_sequence_;
+  uint8_t last_received_sequence_;
+  // Oldest first
+  InFlightPacket in_flight_[kMaxInFlight];
+  size_t num_in_flight_;
+  LinkStats link_stats_;
+  uint64_t last_link_stats_log_time_;
+
+  // Receiver side, only touched by the input task
+  std::vector<KeyboardOutputDevice*> remote_keyboard_outputs_;
+  std::vector<MouseOutputDevice*> remote_mouse_outputs_;
+  bool remote_delta_;
+  // Set when key frames timed out. Key events are dropped until the next one.
+  bool remote_awaiting_key_frame_;
+  DeltaState remote_state_;
+  uint32_t ticks_since_remote_key_frame_;
+  uint32_t ticks_since_packet_;
+
+  // Protects the packet pool and indices. One lock is enough because there are
+  // usually only two tasks involved: the input task and the low level protocol
+  // task.
   SemaphoreHandle_t packet_semaphore_;
+  StaticSemaphore_t packet_semaphore_buffer_;
 };
 
 #endif /* IBP_H_ */
\ No newline at end of file
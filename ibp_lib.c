@@ -6,12 +6,53 @@
 
 #define SEGMENT_HEADER_BYTES 2
 
-static uint8_t CalculateParity(uint8_t byte) {
-  return 0;  // Dummy
+// CRC-8 with the polynomial x^8 + x^2 + x + 1 (0x07), initial value 0. Catches
+// all the burst errors up to 8 bits, e.g. a few bits shifted by a marginal SPI
+// clock.
+static const uint8_t kCRC8Table[256] = {
+    0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31,
+    0x24, 0x23, 0x2a, 0x2d, 0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65,
+    0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d, 0xe0, 0xe7, 0xee, 0xe9,
+    0xfc, 0xfb, 0xf2, 0xf5, 0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+    0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1,
+    0xb4, 0xb3, 0xba, 0xbd, 0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2,
+    0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea, 0xb7, 0xb0, 0xb9, 0xbe,
+    0xab, 0xac, 0xa5, 0xa2, 0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+    0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16,
+    0x03, 0x04, 0x0d, 0x0a, 0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42,
+    0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a, 0x89, 0x8e, 0x87, 0x80,
+    0x95, 0x92, 0x9b, 0x9c, 0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+    0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8,
+    0xdd, 0xda, 0xd3, 0xd4, 0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c,
+    0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44, 0x19, 0x1e, 0x17, 0x10,
+    0x05, 0x02, 0x0b, 0x0c, 0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+    0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f,
+    0x6a, 0x6d, 0x64, 0x63, 0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b,
+    0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13, 0xae, 0xa9, 0xa0, 0xa7,
+    0xb2, 0xb5, 0xbc, 0xbb, 0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+    0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef,
+    0xfa, 0xfd, 0xf4, 0xf3,
+};
+
+// 0 when the byte has an even number of set bits. Inlined into
+// GetTransactionTotalSize(), which runs from RAM in the SPI interrupt.
+static inline uint8_t CalculateParity(uint8_t byte) {
+  byte ^= byte >> 4;
+  byte ^= byte >> 2;
+  byte ^= byte >> 1;
+  return byte & 0x01;
 }
 
 static uint8_t CalculateCRC8(const uint8_t* data, uint8_t length) {
-  return 0;  // Dummy
+  uint8_t crc = 0;
+  for (uint8_t i = 0; i < length; ++i) {
+    crc = kCRC8Table[crc ^ data[i]];
+  }
+  return crc;
+}
+
+uint8_t IBPCalculateCRC8(const uint8_t* data, uint8_t length) {
+  return CalculateCRC8(data, length);
 }
 
 static bool IsBigEndian(void) {
@@ -48,7 +89,7 @@ static int8_t SerializeConsumerKeycodes(const IBPSegment* consumer_seg,
   if (buf_size < data_size + SEGMENT_HEADER_BYTES) {
     return -1;
   }
-  buf[0] = CreateSegmentHeader(data_size, IBP_KEYCODE);
+  buf[0] = CreateSegmentHeader(data_size, IBP_CONSUMER);
   uint16_t* ptr = (uint16_t*)(&buf[2]);
   *ptr = consumer_seg->field_data.consumer_keycode.consumer_keycode;
   if (IsBigEndian()) {
@@ -66,7 +107,7 @@ static int8_t SerializeMouse(const IBPSegment* mouse_seg, uint8_t* buf,
   if (buf_size < data_size + SEGMENT_HEADER_BYTES) {
     return -1;
   }
-  buf[0] = CreateSegmentHeader(data_size, IBP_KEYCODE);
+  buf[0] = CreateSegmentHeader(data_size, IBP_MOUSE);
   buf[2] = mouse_seg->field_data.mouse.button_bitmask;
   buf[3] = (uint8_t)mouse_seg->field_data.mouse.x;
   buf[4] = (uint8_t)mouse_seg->field_data.mouse.y;
@@ -82,7 +123,7 @@ static int8_t SerializeLayers(const IBPSegment* layer_seg, uint8_t* buf,
   if (buf_size < data_size + SEGMENT_HEADER_BYTES) {
     return -1;
   }
-  buf[0] = CreateSegmentHeader(data_size, IBP_KEYCODE);
+  buf[0] = CreateSegmentHeader(data_size, IBP_ACTIVE_LAYERS);
   for (int i = 0; i < data_size; ++i) {
     buf[2 + i] = layer_seg->field_data.layers.active_layers[i];
   }
@@ -90,6 +131,68 @@ static int8_t SerializeLayers(const IBPSegment* layer_seg, uint8_t* buf,
   return data_size + SEGMENT_HEADER_BYTES;
 }
 
+static int8_t SerializeKeyEvents(const IBPSegment* events_seg, uint8_t* buf,
+                                 uint8_t buf_size) {
+  const IBPKeyEvents* events = &events_seg->field_data.key_events;
+  const uint8_t data_size = 1 + events->num_events;
+  if (events->num_events > IBP_MAX_KEY_EVENTS ||
+      buf_size < data_size + SEGMENT_HEADER_BYTES) {
+    return -1;
+  }
+  buf[0] = CreateSegmentHeader(data_size, IBP_KEY_EVENTS);
+  buf[2] = events->pressed_bitmask;
+  for (int i = 0; i < events->num_events; ++i) {
+    buf[3 + i] = events->keycodes[i];
+  }
+  buf[1] = CalculateCRC8(&buf[2], data_size);
+  return data_size + SEGMENT_HEADER_BYTES;
+}
+
+static int8_t SerializeKeyFrame(const IBPSegment* frame_seg, uint8_t* buf,
+                                uint8_t buf_size) {
+  const IBPKeyFrame* frame = &frame_seg->field_data.key_frame;
+  const uint8_t data_size = frame->num_keycodes;
+  if (buf_size < data_size + SEGMENT_HEADER_BYTES) {
+    return -1;
+  }
+  buf[0] = CreateSegmentHeader(data_size, IBP_KEY_FRAME);
+  for (int i = 0; i < data_size; ++i) {
+    buf[2 + i] = frame->keycodes[i];
+  }
+  buf[1] = CalculateCRC8(&buf[2], data_size);
+  return data_size + SEGMENT_HEADER_BYTES;
+}
+
+static int8_t SerializeMatrix(const IBPSegment* matrix_seg, uint8_t* buf,
+                              uint8_t buf_size) {
+  const IBPMatrix* matrix = &matrix_seg->field_data.matrix;
+  const uint8_t data_size = 1 + matrix->num_bytes;
+  if (matrix->num_bytes > IBP_MAX_MATRIX_BYTES ||
+      buf_size < data_size + SEGMENT_HEADER_BYTES) {
+    return -1;
+  }
+  buf[0] = CreateSegmentHeader(data_size, IBP_MATRIX);
+  buf[2] = matrix->first_byte;
+  for (int i = 0; i < matrix->num_bytes; ++i) {
+    buf[3 + i] = matrix->bitmap[i];
+  }
+  buf[1] = CalculateCRC8(&buf[2], data_size);
+  return data_size + SEGMENT_HEADER_BYTES;
+}
+
+static int8_t SerializeLink(const IBPSegment* link_seg, uint8_t* buf,
+                            uint8_t buf_size) {
+  const uint8_t data_size = 2;
+  if (buf_size < data_size + SEGMENT_HEADER_BYTES) {
+    return -1;
+  }
+  buf[0] = CreateSegmentHeader(data_size, IBP_LINK);
+  buf[2] = link_seg->field_data.link.sequence;
+  buf[3] = link_seg->field_data.link.ack;
+  buf[1] = CalculateCRC8(&buf[2], data_size);
+  return data_size + SEGMENT_HEADER_BYTES;
+}
+
 int8_t SerializeSegments(const IBPSegment* segments, uint8_t num_segments,
                          uint8_t* output, uint8_t buffer_size) {
   uint8_t total_bytes = 1;
@@ -131,6 +234,42 @@ int8_t SerializeSegments(const IBPSegment* segments, uint8_t num_segments,
         total_bytes += byte_count;
         break;
       }
+      case IBP_KEY_EVENTS: {
+        int8_t byte_count = SerializeKeyEvents(
+            &segments[i], &output[total_bytes], buffer_size - total_bytes);
+        if (byte_count < 0) {
+          return -1;
+        }
+        total_bytes += byte_count;
+        break;
+      }
+      case IBP_KEY_FRAME: {
+        int8_t byte_count = SerializeKeyFrame(
+            &segments[i], &output[total_bytes], buffer_size - total_bytes);
+        if (byte_count < 0) {
+          return -1;
+        }
+        total_bytes += byte_count;
+        break;
+      }
+      case IBP_MATRIX: {
+        int8_t byte_count = SerializeMatrix(&segments[i], &output[total_bytes],
+                                            buffer_size - total_bytes);
+        if (byte_count < 0) {
+          return -1;
+        }
+        total_bytes += byte_count;
+        break;
+      }
+      case IBP_LINK: {
+        int8_t byte_count = SerializeLink(&segments[i], &output[total_bytes],
+                                          buffer_size - total_bytes);
+        if (byte_count < 0) {
+          return -1;
+        }
+        total_bytes += byte_count;
+        break;
+      }
 
       default:
         break;
@@ -206,6 +345,54 @@ static bool DeSerializeLayer(const uint8_t* buf, uint8_t buf_size,
   return true;
 }
 
+static bool DeSerializeKeyEvents(const uint8_t* buf, uint8_t buf_size,
+                                 IBPSegment* events_seg) {
+  if (buf_size < 1 || buf_size > IBP_MAX_KEY_EVENTS + 1) {
+    return false;
+  }
+  events_seg->field_data.key_events.pressed_bitmask = buf[0];
+  events_seg->field_data.key_events.num_events = buf_size - 1;
+  for (int i = 1; i < buf_size; ++i) {
+    events_seg->field_data.key_events.keycodes[i - 1] = buf[i];
+  }
+  return true;
+}
+
+static bool DeSerializeKeyFrame(const uint8_t* buf, uint8_t buf_size,
+                                IBPSegment* frame_seg) {
+  if (buf_size > IBP_MAX_KEY_FRAME_KEYCODES) {
+    return false;
+  }
+  frame_seg->field_data.key_frame.num_keycodes = buf_size;
+  for (int i = 0; i < buf_size; ++i) {
+    frame_seg->field_data.key_frame.keycodes[i] = buf[i];
+  }
+  return true;
+}
+
+static bool DeSerializeMatrix(const uint8_t* buf, uint8_t buf_size,
+                              IBPSegment* matrix_seg) {
+  if (buf_size < 1 || buf_size > IBP_MAX_MATRIX_BYTES + 1) {
+    return false;
+  }
+  matrix_seg->field_data.matrix.first_byte = buf[0];
+  matrix_seg->field_data.matrix.num_bytes = buf_size - 1;
+  for (int i = 1; i < buf_size; ++i) {
+    matrix_seg->field_data.matrix.bitmap[i - 1] = buf[i];
+  }
+  return true;
+}
+
+static bool DeSerializeLink(const uint8_t* buf, uint8_t buf_size,
+                            IBPSegment* link_seg) {
+  if (buf_size != 2) {
+    return false;
+  }
+  link_seg->field_data.link.sequence = buf[0];
+  link_seg->field_data.link.ack = buf[1];
+  return true;
+}
+
 int8_t DeSerializeSegment(const uint8_t* input, uint8_t input_buffer_size,
                           IBPSegment* segment) {
   if (input_buffer_size == 0 || input[0] == 0 ||
@@ -243,6 +430,30 @@ int8_t DeSerializeSegment(const uint8_t* input, uint8_t input_buffer_size,
       }
       break;
     }
+    case IBP_KEY_EVENTS: {
+      if (DeSerializeKeyEvents(&input[2], num_data_bytes, segment)) {
+        return num_data_bytes + SEGMENT_HEADER_BYTES;
+      }
+      break;
+    }
+    case IBP_KEY_FRAME: {
+      if (DeSerializeKeyFrame(&input[2], num_data_bytes, segment)) {
+        return num_data_bytes + SEGMENT_HEADER_BYTES;
+      }
+      break;
+    }
+    case IBP_MATRIX: {
+      if (DeSerializeMatrix(&input[2], num_data_bytes, segment)) {
+        return num_data_bytes + SEGMENT_HEADER_BYTES;
+      }
+      break;
+    }
+    case IBP_LINK: {
+      if (DeSerializeLink(&input[2], num_data_bytes, segment)) {
+        return num_data_bytes + SEGMENT_HEADER_BYTES;
+      }
+      break;
+    }
     default:
       break;
   }
@@ -257,8 +468,7 @@ int8_t __no_inline_not_in_flash_func(GetTransactionTotalSize)(
 #endif
   const uint8_t total_bytes = transaction_first_byte >> 1;
   if (transaction_first_byte == 0 ||
-      CalculateParity(transaction_first_byte) != 0 ||
-      transaction_first_byte % 4 != 0) {
+      CalculateParity(transaction_first_byte) != 0 || total_bytes % 4 != 0) {
     return -1;
   }
   return total_bytes;
@@ -11,6 +11,9 @@
 #define IBP_MAX_PACKET_LEN 128
 #define IBP_MAX_KEYCODES 8
 #define IBP_MAX_ACTIVELAYERS 8
+#define IBP_MAX_KEY_EVENTS 8
+#define IBP_MAX_KEY_FRAME_KEYCODES 15
+#define IBP_MAX_MATRIX_BYTES 14
 #define IBP_INVALID_PACKET_DELAY_MS 1
 
 typedef enum {
@@ -18,6 +21,13 @@ typedef enum {
   IBP_CONSUMER,
   IBP_MOUSE,
   IBP_ACTIVE_LAYERS,
+  // Delta encoding, see docs/ibp.md
+  IBP_KEY_EVENTS,
+  IBP_KEY_FRAME,
+  // Switch states, see docs/ibp.md
+  IBP_MATRIX,
+  // Sequence number and acknowledgement, see docs/ibp.md
+  IBP_LINK,
   IBP_TOTAL,
 } FieldType;
 
@@ -49,11 +59,44 @@ typedef struct {
   uint8_t active_layers[IBP_MAX_ACTIVELAYERS];
 } IBPLayers;
 
+typedef struct {
+  // Bit i is set if keycodes[i] was pressed, cleared if it was released.
+  uint8_t pressed_bitmask;
+  uint8_t num_events : 4;
+  uint8_t keycodes[IBP_MAX_KEY_EVENTS];
+} IBPKeyEvents;
+
+typedef struct {
+  // All the keys pressed, modifiers included. A packet may carry several key
+  // frame segments.
+  uint8_t num_keycodes : 4;
+  uint8_t keycodes[IBP_MAX_KEY_FRAME_KEYCODES];
+} IBPKeyFrame;
+
+typedef struct {
+  // Bit i of bitmap[j] is the switch at matrix position
+  // (first_byte + j) * 8 + i. A packet may carry several matrix segments.
+  uint8_t first_byte;
+  uint8_t num_bytes : 4;
+  uint8_t bitmap[IBP_MAX_MATRIX_BYTES];
+} IBPMatrix;
+
+typedef struct {
+  // 0 if the packet isn't numbered, otherwise in [1, 255]
+  uint8_t sequence;
+  // The last sequence number received from the other side, 0 if none
+  uint8_t ack;
+} IBPLink;
+
 typedef union {
   IBPKeyCodes keycodes;
   IBPConsumer consumer_keycode;
   IBPMouse mouse;
   IBPLayers layers;
+  IBPKeyEvents key_events;
+  IBPKeyFrame key_frame;
+  IBPMatrix matrix;
+  IBPLink link;
 } FieldData;
 
 typedef struct {
@@ -61,7 +104,7 @@ typedef struct {
   // +------+------+------+------+------+------+------+------+
   // |   number of data bytes    |     field type     |parity|
   // +------+------+------+------+------+------+------+------+
-  FieldType field_type : 3;
+  FieldType field_type : 4;
   FieldData field_data;
 } IBPSegment;
 
@@ -70,5 +113,7 @@ int8_t SerializeSegments(const IBPSegment* segments, uint8_t num_segments,
 int8_t DeSerializeSegment(const uint8_t* input, uint8_t input_buffer_size,
                           IBPSegment* segment);
 int8_t GetTransactionTotalSize(uint8_t transaction_first_byte);
+// The CRC of the segment data bytes, exposed for benchmarking
+uint8_t IBPCalculateCRC8(const uint8_t* data, uint8_t length);
 
 #endif /* IBP_LIB_H_ */
\ No newline at end of file
@@ -175,172 +175,75 @@ void JoystickInputDeivce::InputTick() {
       (counter_ + 1) % (is_pan_mode_ ? pan_resolution_ : mouse_resolution_);
 }
 
+// Default (reading, speed) points of the x and y profiles
+constexpr std::pair<int32_t, int32_t> kDefaultProfile[] = {
+    {20, 40}, {700, 80}, {1000, 120}, {1500, 180}, {2000, 300}};
+static_assert(sizeof(kDefaultProfile) / sizeof(kDefaultProfile[0]) ==
+              JoystickInputDeivce::kProfileSize);
+
+static std::shared_ptr<ConfigList> CreateProfileConfig(
+    std::array<JoystickInputDeivce::ProfilePointHandles,
+               JoystickInputDeivce::kProfileSize>* handles) {
+  std::shared_ptr<ConfigList> list = CONFIG_LIST();
+  for (size_t i = 0; i < handles->size(); ++i) {
+    auto& [reading, speed] = (*handles)[i];
+    list->GetList()->push_back(CONFIG_PAIR(
+        reading.Bind(CONFIG_INT(kDefaultProfile[i].first, 0, 2048)),
+        speed.Bind(CONFIG_INT(kDefaultProfile[i].second, 40, 1000))));
+  }
+  return list;
+}
+
 std::pair<std::string, std::shared_ptr<Config>>
 JoystickInputDeivce::CreateDefaultConfig() {
   auto config = CONFIG_OBJECT(
-      CONFIG_OBJECT_ELEM("enable_joystick", CONFIG_INT(1, 0, 1)),
-      CONFIG_OBJECT_ELEM("mouse_resolution", CONFIG_INT(5, 1, 100)),
-      CONFIG_OBJECT_ELEM("pan_resolution", CONFIG_INT(20, 1, 100)),
-      CONFIG_OBJECT_ELEM("calib_samples", CONFIG_INT(1000, 0, INT32_MAX)),
-      CONFIG_OBJECT_ELEM("calib_threshold", CONFIG_INT(400, 0, INT32_MAX)),
-      CONFIG_OBJECT_ELEM(
-          "x_profile",
-          CONFIG_LIST(
-              CONFIG_PAIR(CONFIG_INT(20, 0, 2048), CONFIG_INT(40, 40, 1000)),
-              CONFIG_PAIR(CONFIG_INT(700, 0, 2048), CONFIG_INT(80, 40, 1000)),
-              CONFIG_PAIR(CONFIG_INT(1000, 0, 2048), CONFIG_INT(120, 40, 1000)),
-              CONFIG_PAIR(CONFIG_INT(1500, 0, 2048), CONFIG_INT(180, 40, 1000)),
-              CONFIG_PAIR(CONFIG_INT(2000, 0, 2048),
-                          CONFIG_INT(300, 40, 1000)))),
+      CONFIG_OBJECT_ELEM("enable_joystick",
+                         enable_joystick_config_.Bind(CONFIG_INT(1, 0, 1))),
+      CONFIG_OBJECT_ELEM("mouse_resolution",
+                         mouse_resolution_config_.Bind(CONFIG_INT(5, 1, 100))),
+      CONFIG_OBJECT_ELEM("pan_resolution",
+                         pan_resolution_config_.Bind(CONFIG_INT(20, 1, 100))),
+      CONFIG_OBJECT_ELEM("calib_samples", calib_samples_config_.Bind(
+                                              CONFIG_INT(1000, 0, INT32_MAX))),
       CONFIG_OBJECT_ELEM(
-          "y_profile",
-          CONFIG_LIST(
-              CONFIG_PAIR(CONFIG_INT(20, 0, 2048), CONFIG_INT(40, 40, 1000)),
-              CONFIG_PAIR(CONFIG_INT(700, 0, 2048), CONFIG_INT(80, 40, 1000)),
-              CONFIG_PAIR(CONFIG_INT(1000, 0, 2048), CONFIG_INT(120, 40, 1000)),
-              CONFIG_PAIR(CONFIG_INT(1500, 0, 2048), CONFIG_INT(180, 40, 1000)),
-              CONFIG_PAIR(CONFIG_INT(2000, 0, 2048),
-                          CONFIG_INT(300, 40, 1000)))));
+          "calib_threshold",
+          calib_threshold_config_.Bind(CONFIG_INT(400, 0, INT32_MAX))),
+      CONFIG_OBJECT_ELEM("x_profile", CreateProfileConfig(&x_profile_config_)),
+      CONFIG_OBJECT_ELEM("y_profile", CreateProfileConfig(&y_profile_config_)));
 
   return {"Joystick", config};
 }
 
-Status JoystickInputDeivce::ParseProfileConfig(
-    const ConfigList& list,
+void JoystickInputDeivce::ReadProfileConfig(
+    const std::array<ProfilePointHandles, kProfileSize>& handles,
     std::vector<std::pair<uint16_t, uint16_t>>* output) {
   output->clear();
-  const auto& l = *list.GetList();
   output->push_back({0, 0});
-  for (const auto& v : l) {
-    if (v->GetType() != Config::LIST) {
-      return ERROR;
-    }
-    const auto& pair = *(((ConfigList*)v.get())->GetList());
-    if (pair.size() != 2) {
-      return ERROR;
-    }
-    if (pair[0]->GetType() != Config::INTEGER ||
-        pair[1]->GetType() != Config::INTEGER) {
-      return ERROR;
-    }
-    output->push_back(std::make_pair<uint16_t, uint16_t>(
-        ((ConfigInt*)(pair[0].get()))->GetValue(),
-        ((ConfigInt*)(pair[1].get()))->GetValue()));
+  for (const auto& [reading, speed] : handles) {
+    output->push_back({reading.Get(), speed.Get()});
   }
 
   std::sort(output->begin(), output->end(), [](auto a, auto b) {
     return a.first == b.first ? a.second < b.second : a.first < b.first;
   });
-  return OK;
 }
 
 void JoystickInputDeivce::OnUpdateConfig(const Config* config) {
-  if (config->GetType() != Config::OBJECT) {
-    LOG_ERROR("Root config has to be an object.");
-    return;
-  }
-  const auto& root_map = *((ConfigObject*)config)->GetMembers();
-
-  // Whether the joystick is enabled
-
-  auto it = root_map.find("enable_joystick");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `enable_joystick` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::INTEGER) {
-    LOG_ERROR("`enable_joystick` invalid type");
-    return;
-  }
-  enable_joystick_ = ((ConfigInt*)it->second.get())->GetValue() > 0;
-
-  // Get resolutions
-
-  it = root_map.find("mouse_resolution");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `report_n_scan` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::INTEGER) {
-    LOG_ERROR("`report_n_scan` invalid type");
-    return;
-  }
-  mouse_resolution_ = ((ConfigInt*)it->second.get())->GetValue();
+  enable_joystick_ = enable_joystick_config_.Get();
+  mouse_resolution_ = mouse_resolution_config_.Get();
+  pan_resolution_ = pan_resolution_config_.Get();
   counter_ = 0;
 
-  it = root_map.find("pan_resolution");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `report_n_scan` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::INTEGER) {
-    LOG_ERROR("`report_n_scan` invalid type");
-    return;
-  }
-  pan_resolution_ = ((ConfigInt*)it->second.get())->GetValue();
-  counter_ = 0;
-
-  // Get calibration samples
-
-  it = root_map.find("calib_samples");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `calib_samples` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::INTEGER) {
-    LOG_ERROR("`calib_samples` invalid type");
-    return;
-  }
-  const int32_t calib_samples = ((ConfigInt*)it->second.get())->GetValue();
+  const uint32_t calib_samples = calib_samples_config_.Get();
   x_.SetCalibrationSamples(calib_samples);
   y_.SetCalibrationSamples(calib_samples);
 
-  // Get calibration threshold
-
-  it = root_map.find("calib_threshold");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `calib_threshold` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::INTEGER) {
-    LOG_ERROR("`calib_threshold` invalid type");
-    return;
-  }
-  const int32_t calib_threshold = ((ConfigInt*)it->second.get())->GetValue();
-  x_.SetCalibrationThreshold(calib_samples);
-  y_.SetCalibrationThreshold(calib_samples);
-
-  // Get x_profile
-
-  it = root_map.find("x_profile");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `x_profile` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::LIST) {
-    LOG_ERROR("`x_profile` invalid type");
-    return;
-  }
-  if (ParseProfileConfig(*((ConfigList*)it->second.get()), &profile_x_) != OK) {
-    LOG_ERROR("Failed to parse `x_profile`");
-    return;
-  }
-
-  // Get y_profile
+  const uint32_t calib_threshold = calib_threshold_config_.Get();
+  x_.SetCalibrationThreshold(calib_threshold);
+  y_.SetCalibrationThreshold(calib_threshold);
 
-  it = root_map.find("y_profile");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `y_profile` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::LIST) {
-    LOG_ERROR("`y_profile` invalid type");
-    return;
-  }
-  if (ParseProfileConfig(*((ConfigList*)it->second.get()), &profile_x_) != OK) {
-    LOG_ERROR("Failed to parse `y_profile`");
-    return;
-  }
+  ReadProfileConfig(x_profile_config_, &profile_x_);
+  ReadProfileConfig(y_profile_config_, &profile_y_);
 }
 
 void JoystickInputDeivce::SetConfigMode(bool is_config_mode) {
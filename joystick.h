@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include <array>
+#include <utility>
 #include <vector>
 
 #include "FreeRTOS.h"
@@ -46,6 +48,13 @@ class CenteringPotentialMeterDriver {
 class JoystickInputDeivce : virtual public GenericInputDevice,
                             virtual public KeyboardOutputDevice {
  public:
+  // Number of points in the speed profiles
+  static constexpr size_t kProfileSize = 5;
+
+  // Joystick reading and mouse speed
+  using ProfilePointHandles =
+      std::pair<ConfigHandle<uint16_t>, ConfigHandle<uint16_t>>;
+
   JoystickInputDeivce(uint8_t x_adc_pin, uint8_t y_adc_pin, size_t buffer_size,
                       bool flip_x_dir, bool flip_y_dir,
                       bool flip_vertical_scroll, uint8_t scan_num_ticks,
@@ -71,8 +80,17 @@ class JoystickInputDeivce : virtual public GenericInputDevice,
   int16_t GetSpeed(const std::vector<std::pair<uint16_t, uint16_t>>& profile,
                    int16_t reading);
 
-  Status ParseProfileConfig(const ConfigList& list,
-                            std::vector<std::pair<uint16_t, uint16_t>>* output);
+  void ReadProfileConfig(
+      const std::array<ProfilePointHandles, kProfileSize>& handles,
+      std::vector<std::pair<uint16_t, uint16_t>>* output);
+
+  ConfigHandle<bool> enable_joystick_config_;
+  ConfigHandle<int16_t> mouse_resolution_config_;
+  ConfigHandle<int16_t> pan_resolution_config_;
+  ConfigHandle<uint32_t> calib_samples_config_;
+  ConfigHandle<uint32_t> calib_threshold_config_;
+  std::array<ProfilePointHandles, kProfileSize> x_profile_config_;
+  std::array<ProfilePointHandles, kProfileSize> y_profile_config_;
 
   CenteringPotentialMeterDriver x_;
   CenteringPotentialMeterDriver y_;
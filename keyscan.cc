@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <map>
@@ -17,6 +18,10 @@
 #include "tusb.h"
 #include "utils.h"
 
+static KeyScan::MatrixState local_matrix_state;
+static KeyScan::MatrixState remote_matrix_state;
+static size_t local_matrix_size = 0;
+
 void KeyScan::SetMouseButtonState(uint8_t mouse_key, bool is_pressed) {
   for (auto output : *mouse_output_) {
     if (is_pressed) {
@@ -31,13 +36,39 @@ void KeyScan::ConfigDown() { config_modifier_->Down(); }
 
 void KeyScan::ConfigSelect() { config_modifier_->Select(); }
 
-void KeyScan::InputLoopStart() { LayerChanged(); }
+void KeyScan::InputLoopStart() {
+  // Create the custom keycode handlers up front so that the first key press
+  // doesn't allocate.
+  for (size_t i = 0; i < GetTotalScans(); ++i) {
+    for (size_t l = 0; l < GetKeyboardNumLayers(); ++l) {
+      const Keycode kc = GetKeycodeAtLayer(l, i);
+      if (kc.is_custom) {
+        HandlerRegistry::RegisteredHandlerFactory(kc.keycode, this);
+      }
+    }
+  }
+  LayerChanged();
+}
 
 void KeyScan::InputTick() {
-  const std::vector<uint8_t> active_layers = GetActiveLayers();
-  std::vector<uint8_t> pressed_keycode;
+  // Snapshot, since handlers can change the layers in the middle of the scan.
+  // Both buffers are reserved upfront so the tick doesn't allocate.
+  tick_active_layers_ = active_layer_list_;
+  pressed_keycode_.clear();
 
   for (size_t i = 0; i < GetTotalScans(); ++i) {
+    DebounceTimer& d_timer = debounce_timer_[i];
+    bool key_event = false;
+
+    if (IsRemoteKey(i)) {
+      // Already debounced by the other half
+      const bool pressed = remote_matrix_state[GetSinkGPIO(i)];
+      key_event = pressed != d_timer.pressed;
+      d_timer.pressed = pressed;
+      ResolveKey(i, d_timer.pressed, key_event);
+      continue;
+    }
+
     const uint8_t source_pin = GetSourceGPIO(i);
     if (IsSourceChange(i)) {
       // Only source is the output. Others are all input with pull down.
@@ -54,11 +85,8 @@ void KeyScan::InputTick() {
       SinkGPIODelay();
     }
 
-    DebounceTimer& d_timer = debounce_timer_[i];
-
     const bool pressed = gpio_get(GetSinkGPIO(i));
 
-    bool key_event = false;
     if (pressed != d_timer.pressed) {
       d_timer.tick_count += CONFIG_SCAN_TICKS;
       if (d_timer.tick_count >= CONFIG_DEBOUNCE_TICKS) {
@@ -67,33 +95,49 @@ void KeyScan::InputTick() {
         key_event = true;
       }
     }
+    if (key_event && GetMatrixPosition(i) < kMaxMatrixPositions) {
+      local_matrix_state[GetMatrixPosition(i)] = d_timer.pressed;
+    }
 
-    Keycode kc = {0};
-    for (uint8_t l : active_layers) {
-      Keycode layer_kc = GetKeycodeAtLayer(l, i);
-      if (layer_kc.is_custom || layer_kc.keycode != HID_KEY_NONE) {
-        kc = layer_kc;
-        break;
-      }
+    ResolveKey(i, d_timer.pressed, key_event);
+  }
+
+  NotifyOutput(pressed_keycode_);
+}
+
+void KeyScan::ResolveKey(size_t key_idx, bool pressed, bool key_event) {
+  Keycode kc = {0};
+  for (uint8_t l : tick_active_layers_) {
+    Keycode layer_kc = GetKeycodeAtLayer(l, key_idx);
+    if (layer_kc.is_custom || layer_kc.keycode != HID_KEY_NONE) {
+      kc = layer_kc;
+      break;
     }
+  }
 
-    if (kc.is_custom) {
-      auto* handler =
-          HandlerRegistry::RegisteredHandlerFactory(kc.keycode, this);
-      if (handler != NULL) {
-        handler->ProcessKeyState(kc, d_timer.pressed, i);
-        if (key_event) {
-          handler->ProcessKeyEvent(kc, d_timer.pressed, i);
-        }
-      } else {
-        LOG_WARNING("Custom Keycode (%d) missing handler", kc.keycode);
+  if (kc.is_custom) {
+    auto* handler = HandlerRegistry::RegisteredHandlerFactory(kc.keycode, this);
+    if (handler != NULL) {
+      handler->ProcessKeyState(kc, pressed, key_idx);
+      if (key_event) {
+        handler->ProcessKeyEvent(kc, pressed, key_idx);
       }
-    } else if (d_timer.pressed) {
-      pressed_keycode.push_back(kc.keycode);
+    } else {
+      LOG_WARNING("Custom Keycode (%d) missing handler", kc.keycode);
     }
+  } else if (pressed) {
+    pressed_keycode_.push_back(kc.keycode);
   }
+}
 
-  NotifyOutput(pressed_keycode);
+const KeyScan::MatrixState& KeyScan::GetLocalMatrixState() {
+  return local_matrix_state;
+}
+
+size_t KeyScan::GetLocalMatrixSize() { return local_matrix_size; }
+
+void KeyScan::SetRemoteMatrixState(const MatrixState& state) {
+  remote_matrix_state = state;
 }
 
 void KeyScan::SetConfigMode(bool is_config_mode) {
@@ -111,9 +155,20 @@ KeyScan::KeyScan() : is_config_mode_(false) {
   }
 
   debounce_timer_.resize(GetTotalScans());
+  for (size_t i = 0; i < GetTotalScans(); ++i) {
+    if (!IsRemoteKey(i)) {
+      local_matrix_size = std::max<size_t>(
+          local_matrix_size,
+          std::min<size_t>(GetMatrixPosition(i) + 1, kMaxMatrixPositions));
+    }
+  }
 
   active_layers_.resize(GetKeyboardNumLayers());
   active_layers_[0] = true;
+  active_layer_list_.reserve(GetKeyboardNumLayers());
+  tick_active_layers_.reserve(GetKeyboardNumLayers());
+  pressed_keycode_.reserve(GetTotalScans());
+  UpdateActiveLayerList();
 }
 
 Status KeyScan::SetLayerStatus(uint8_t layer, bool active) {
@@ -135,14 +190,15 @@ Status KeyScan::ToggleLayerStatus(uint8_t layer) {
   return SetLayerStatus(layer, !active_layers_[layer]);
 }
 
-std::vector<uint8_t> KeyScan::GetActiveLayers() {
-  std::vector<uint8_t> output;
+std::vector<uint8_t> KeyScan::GetActiveLayers() { return active_layer_list_; }
+
+void KeyScan::UpdateActiveLayerList() {
+  active_layer_list_.clear();
   for (int16_t i = active_layers_.size() - 1; i >= 0; --i) {
     if (active_layers_[i]) {
-      output.push_back(i);
+      active_layer_list_.push_back(i);
     }
   }
-  return output;
 }
 
 void KeyScan::SinkGPIODelay() { busy_wait_us_32(CONFIG_GPIO_SINK_DELAY_US); }
@@ -192,6 +248,7 @@ void KeyScan::NotifyOutput(const std::vector<uint8_t>& pressed_keycode) {
 }
 
 void KeyScan::LayerChanged() {
+  UpdateActiveLayerList();
   for (auto output : *keyboard_output_) {
     output->ChangeActiveLayers(active_layers_);
   }
@@ -1,6 +1,7 @@
 #ifndef KEYSCAN_H_
 #define KEYSCAN_H_
 
+#include <bitset>
 #include <functional>
 #include <map>
 #include <memory>
@@ -46,6 +47,8 @@ class CustomKeycodeHandler {
 class KeyScan : public GenericInputDevice {
  public:
   using CustomKeycodeHandlerCreator = std::function<CustomKeycodeHandler*()>;
+  // Debounced switch states by matrix position, see GetMatrixPosition()
+  using MatrixState = std::bitset<kMaxMatrixPositions>;
 
   KeyScan();
 
@@ -61,6 +64,16 @@ class KeyScan : public GenericInputDevice {
   std::vector<uint8_t> GetActiveLayers();
 
   void SetMouseButtonState(uint8_t mouse_key, bool is_pressed);
+
+  // For split keyboards. The local state is updated every tick and sent to the
+  // other half with IBP_MATRIX segments. The remote state is set from the
+  // segments received, and is read for the keys declared with REMOTE() in the
+  // layout, before the layers are resolved. Only used on the input task.
+  static const MatrixState& GetLocalMatrixState();
+  // Number of positions used by the local keys
+  static size_t GetLocalMatrixSize();
+  static void SetRemoteMatrixState(const MatrixState& state);
+
   void ConfigUp();
   void ConfigDown();
   void ConfigSelect();
@@ -93,8 +106,17 @@ class KeyScan : public GenericInputDevice {
   virtual void NotifyOutput(const std::vector<uint8_t>& pressed_keycode);
   virtual void LayerChanged();
 
+  void UpdateActiveLayerList();
+  // Resolves the keycode of the key on the active layers, and either calls its
+  // handler or adds it to pressed_keycode_.
+  void ResolveKey(size_t key_idx, bool pressed, bool key_event);
+
   std::vector<DebounceTimer> debounce_timer_;
   std::vector<bool> active_layers_;
+  // Active layer indices, from the highest to the lowest
+  std::vector<uint8_t> active_layer_list_;
+  std::vector<uint8_t> tick_active_layers_;
+  std::vector<uint8_t> pressed_keycode_;
   // SemaphoreHandle_t semaphore_;
   bool is_config_mode_;
 };
@@ -0,0 +1,301 @@
+#include "kv_store.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+#include "FreeRTOS.h"
+#include "config.h"
+#include "hardware/flash.h"
+#include "pico/platform.h"
+#include "storage.h"
+#include "sync.h"
+
+#ifndef CONFIG_FLASH_KV_STORE_SIZE
+#define CONFIG_FLASH_KV_STORE_SIZE (2 * 4096)
+#endif
+
+#ifndef CONFIG_KV_STORE_MAX_KEYS
+#define CONFIG_KV_STORE_MAX_KEYS 64
+#endif
+
+// The region is split in two banks. Records are appended to the active bank.
+// When it's full, the latest values are compacted into the other bank, which
+// becomes the active one.
+#define KV_OFFSET                                         \
+  (PICO_FLASH_SIZE_BYTES - CONFIG_FLASH_FILESYSTEM_SIZE - \
+   CONFIG_FLASH_KV_STORE_SIZE)
+#define KV_BANK_SIZE (CONFIG_FLASH_KV_STORE_SIZE / 2)
+
+// First bytes of a bank. The valid bank with the latest sequence is the active
+// one.
+struct KVBankHeader {
+  uint32_t magic;
+  uint32_t sequence;
+};
+
+struct KVRecord {
+  uint16_t key;
+  // Catches records torn by a reset in the middle of a page program
+  uint16_t check;
+  uint32_t value;
+};
+
+static constexpr uint32_t kKVMagic = 0x53564b50;  // "PKVS"
+
+static_assert(sizeof(KVBankHeader) == 8 && sizeof(KVRecord) == 8);
+static_assert(KV_BANK_SIZE % FLASH_SECTOR_SIZE == 0,
+              "CONFIG_FLASH_KV_STORE_SIZE must be a multiple of two sectors");
+static_assert(CONFIG_FLASH_FILESYSTEM_SIZE + CONFIG_FLASH_KV_STORE_SIZE <
+                  PICO_FLASH_SIZE_BYTES,
+              "The filesystem and the KV store don't fit in the flash");
+// A compacted bank must have room for at least one more record
+static_assert(sizeof(KVBankHeader) +
+                      (CONFIG_KV_STORE_MAX_KEYS + 1) * sizeof(KVRecord) <=
+                  KV_BANK_SIZE,
+              "CONFIG_KV_STORE_MAX_KEYS is too large for the KV store size");
+
+// Flash accesses hold the FlashLock shared with littlefs. The RAM index is read
+// without it.
+static std::array<std::atomic<uint32_t>, CONFIG_KV_STORE_MAX_KEYS> values;
+static std::array<std::atomic<bool>, CONFIG_KV_STORE_MAX_KEYS> present;
+
+// Set by SetKVValueDeferred(), cleared once written
+static std::array<std::atomic<uint32_t>, CONFIG_KV_STORE_MAX_KEYS>
+    deferred_values;
+static std::array<std::atomic<bool>, CONFIG_KV_STORE_MAX_KEYS> deferred;
+
+static uint8_t active_bank;
+static uint32_t sequence;
+// Offset of the next record in the active bank
+static uint32_t write_offset;
+
+static uint8_t page_buffer[FLASH_PAGE_SIZE];
+static uint8_t compact_buffer[sizeof(KVBankHeader) +
+                              CONFIG_KV_STORE_MAX_KEYS * sizeof(KVRecord)];
+
+static uint16_t RecordCheck(uint16_t key, uint32_t value) {
+  return ~(key ^ (uint16_t)value ^ (uint16_t)(value >> 16));
+}
+
+static uint32_t BankOffset(uint8_t bank) {
+  return KV_OFFSET + bank * KV_BANK_SIZE;
+}
+
+static const uint8_t* BankData(uint8_t bank) {
+  return (const uint8_t*)(XIP_BASE) + BankOffset(bank);
+}
+
+static void EraseBank(uint8_t bank) {
+  // One blackout per sector
+  for (uint32_t offset = 0; offset < KV_BANK_SIZE;
+       offset += FLASH_SECTOR_SIZE) {
+    FlashBlackoutSection blackout;
+    flash_range_erase(BankOffset(bank) + offset, FLASH_SECTOR_SIZE);
+  }
+}
+
+// Programs data at any offset, one page at a time. The rest of each page is
+// programmed with 0xff, which leaves the bytes already there untouched.
+static Status ProgramRange(uint32_t offset, const void* data, size_t size) {
+  const uint8_t* const expected = (const uint8_t*)data;
+  const uint8_t* cursor = expected;
+  uint32_t current = offset;
+  size_t remaining = size;
+  while (remaining > 0) {
+    const uint32_t page = current & ~(uint32_t)(FLASH_PAGE_SIZE - 1);
+    const uint32_t in_page = current - page;
+    const size_t count = std::min<size_t>(remaining, FLASH_PAGE_SIZE - in_page);
+    memset(page_buffer, 0xff, sizeof(page_buffer));
+    memcpy(page_buffer + in_page, cursor, count);
+    {
+      FlashBlackoutSection blackout;
+      flash_range_program(page, page_buffer, FLASH_PAGE_SIZE);
+    }
+    current += count;
+    cursor += count;
+    remaining -= count;
+  }
+
+  // Bits can only be cleared by a program, so a slot which wasn't erased
+  // doesn't read back what was written
+  if (memcmp((const uint8_t*)(XIP_BASE) + offset, expected, size) != 0) {
+    return ERROR;
+  }
+  return OK;
+}
+
+static Status FormatKVStore() {
+  EraseBank(0);
+  const KVBankHeader header = {.magic = kKVMagic, .sequence = 1};
+  active_bank = 0;
+  sequence = 1;
+  write_offset = sizeof(header);
+  return ProgramRange(BankOffset(0), &header, sizeof(header));
+}
+
+static bool IsErased(const KVRecord& record) {
+  const KVRecord erased = {
+      .key = 0xffff, .check = 0xffff, .value = 0xffffffff};
+  return memcmp(&record, &erased, sizeof(record)) == 0;
+}
+
+// Writes the latest values to the other bank and makes it the active one. The
+// header is programmed last, so a reset in the middle leaves the old bank
+// active.
+static Status CompactKVStore() {
+  const uint8_t bank = 1 - active_bank;
+  EraseBank(bank);
+
+  size_t size = sizeof(KVBankHeader);
+  for (uint16_t key = 0; key < CONFIG_KV_STORE_MAX_KEYS; ++key) {
+    if (!present[key]) {
+      continue;
+    }
+    const uint32_t value = values[key];
+    const KVRecord record = {
+        .key = key, .check = RecordCheck(key, value), .value = value};
+    memcpy(compact_buffer + size, &record, sizeof(record));
+    size += sizeof(record);
+  }
+  if (ProgramRange(BankOffset(bank) + sizeof(KVBankHeader),
+                   compact_buffer + sizeof(KVBankHeader),
+                   size - sizeof(KVBankHeader)) != OK) {
+    return ERROR;
+  }
+
+  const KVBankHeader header = {.magic = kKVMagic, .sequence = sequence + 1};
+  if (ProgramRange(BankOffset(bank), &header, sizeof(header)) != OK) {
+    return ERROR;
+  }
+  active_bank = bank;
+  sequence = header.sequence;
+  write_offset = size;
+  LOG_INFO("Compacted the KV store to %d bytes", (int32_t)size);
+  return OK;
+}
+
+Status InitializeKVStore() {
+  FlashLock lock;
+
+  for (uint16_t key = 0; key < CONFIG_KV_STORE_MAX_KEYS; ++key) {
+    values[key] = 0;
+    present[key] = false;
+    deferred_values[key] = 0;
+    deferred[key] = false;
+  }
+
+  bool found = false;
+  for (uint8_t bank = 0; bank < 2; ++bank) {
+    KVBankHeader header;
+    memcpy(&header, BankData(bank), sizeof(header));
+    if (header.magic != kKVMagic) {
+      continue;
+    }
+    if (!found || (int32_t)(header.sequence - sequence) > 0) {
+      found = true;
+      active_bank = bank;
+      sequence = header.sequence;
+    }
+  }
+  if (!found) {
+    LOG_INFO("Formatting the KV store");
+    return FormatKVStore();
+  }
+
+  // Replay the log. Later records override earlier ones.
+  const uint8_t* data = BankData(active_bank);
+  uint32_t offset = sizeof(KVBankHeader);
+  for (; offset + sizeof(KVRecord) <= KV_BANK_SIZE;
+       offset += sizeof(KVRecord)) {
+    KVRecord record;
+    memcpy(&record, data + offset, sizeof(record));
+    if (IsErased(record)) {
+      break;
+    }
+    if (record.key >= CONFIG_KV_STORE_MAX_KEYS ||
+        record.check != RecordCheck(record.key, record.value)) {
+      LOG_WARNING("Skipping invalid KV record at %d", offset);
+      continue;
+    }
+    values[record.key] = record.value;
+    present[record.key] = true;
+  }
+  write_offset = offset;
+  return OK;
+}
+
+Status GetKVValue(uint16_t key, uint32_t* value) {
+  if (key >= CONFIG_KV_STORE_MAX_KEYS) {
+    return ERROR;
+  }
+  if (deferred[key]) {
+    *value = deferred_values[key];
+    return OK;
+  }
+  if (!present[key]) {
+    return ERROR;
+  }
+  *value = values[key];
+  return OK;
+}
+
+Status SetKVValue(uint16_t key, uint32_t value) {
+  if (key >= CONFIG_KV_STORE_MAX_KEYS) {
+    return ERROR;
+  }
+  FlashLock lock;
+  if (present[key] && values[key] == value) {
+    return OK;
+  }
+
+  // The index is updated first, so a compaction writes the new value along
+  // with the others. If the compaction fails, the new value is kept in RAM
+  // and written by the next successful compaction.
+  const uint32_t previous_value = values[key];
+  const bool previous_present = present[key];
+  values[key] = value;
+  present[key] = true;
+  if (write_offset + sizeof(KVRecord) > KV_BANK_SIZE) {
+    return CompactKVStore();
+  }
+
+  const KVRecord record = {
+      .key = key, .check = RecordCheck(key, value), .value = value};
+  const Status status = ProgramRange(
+      BankOffset(active_bank) + write_offset, &record, sizeof(record));
+  // Skip the slot even if it failed, it can't be programmed again
+  write_offset += sizeof(record);
+  if (status != OK) {
+    // Reads keep returning what's in flash
+    values[key] = previous_value;
+    present[key] = previous_present;
+  }
+  return status;
+}
+
+Status SetKVValueDeferred(uint16_t key, uint32_t value) {
+  if (key >= CONFIG_KV_STORE_MAX_KEYS) {
+    return ERROR;
+  }
+  deferred_values[key] = value;
+  deferred[key] = true;
+  return OK;
+}
+
+Status FlushKVStore() {
+  Status status = OK;
+  for (uint16_t key = 0; key < CONFIG_KV_STORE_MAX_KEYS; ++key) {
+    // A value deferred meanwhile is flushed next time
+    if (!deferred[key].exchange(false)) {
+      continue;
+    }
+    if (SetKVValue(key, deferred_values[key]) != OK) {
+      LOG_WARNING("Failed to write KV key %d", key);
+      status = ERROR;
+    }
+  }
+  return status;
+}
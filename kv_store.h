@@ -0,0 +1,46 @@
+#ifndef KV_STORE_H_
+#define KV_STORE_H_
+
+#include <stdint.h>
+
+#include "utils.h"
+
+// Persistent store for small values updated often, e.g. usage counters, the
+// last brightness or the layer lock state. Each update appends an 8 byte record
+// to a log in its own flash region of CONFIG_FLASH_KV_STORE_SIZE bytes, right
+// before the filesystem. Appending programs a single flash page, so a write
+// takes well under a millisecond and an erase only happens when the log is
+// compacted, once every few hundred writes. The latest values are kept in a RAM
+// index built at boot, so reads never touch the flash.
+//
+// Keys are in [0, CONFIG_KV_STORE_MAX_KEYS).
+
+// Keys used by the firmware. They are stored in flash, so existing ones must
+// never be renumbered.
+enum KVKey : uint16_t {
+  // Float bits of the WS2812 brightness
+  KV_KEY_WS2812_BRIGHTNESS = 0,
+};
+
+// Called by InitializeStorage()
+Status InitializeKVStore();
+
+// Returns ERROR if key has never been set. Deferred values are returned before
+// they're written.
+Status GetKVValue(uint16_t key, uint32_t* value);
+
+// Writing the current value is a no-op. Can be called from any task, but
+// takes the flash for one page program, or a few sector erases when
+// compacting. On ERROR, GetKVValue() keeps returning the previous value, except
+// when the log was being compacted.
+Status SetKVValue(uint16_t key, uint32_t value);
+
+// For tasks which can't wait for the flash, e.g. the input task. Only records
+// the value in RAM, and never blocks. The latest value of each key is written
+// by the next FlushKVStore(), so a burst of updates costs a single write.
+Status SetKVValueDeferred(uint16_t key, uint32_t value);
+
+// Writes the deferred values. Called periodically by the config saver task.
+Status FlushKVStore();
+
+#endif /* KV_STORE_H_ */
@@ -17,6 +17,14 @@ struct GPIO {
   uint8_t sink;    // out
 };
 
+// Source of the keys on the other half of a split keyboard, whose switch states
+// are received over IBP. The sink is the matrix position of the key on the
+// other half. See REMOTE() in layout_helper.h.
+constexpr uint8_t kRemoteSourceGPIO = 0xfe;
+
+// Matrix positions sent over IBP are below this
+constexpr size_t kMaxMatrixPositions = 256;
+
 size_t GetKeyboardNumLayers();
 size_t GetTotalNumGPIOs();
 uint8_t GetGPIOPin(size_t gpio_idx);
@@ -25,6 +33,10 @@ size_t GetTotalScans();
 uint8_t GetSourceGPIO(size_t scan_idx);
 uint8_t GetSinkGPIO(size_t scan_idx);
 bool IsSourceChange(size_t scan_idx);
+// Row * number of columns + column of the key in the layout matrix
+uint16_t GetMatrixPosition(size_t scan_idx);
+// Remote keys are scanned after all the local ones
+bool IsRemoteKey(size_t scan_idx);
 Keycode GetKeycodeAtLayer(uint8_t layer, size_t scan_idx);
 
 enum BuiltInCustomKeyCode {
@@ -53,6 +53,12 @@
 #define G(SOURCE, SINK) \
   { .source = (SOURCE), .sink = (SINK) }
 
+// A key on the other half of a split keyboard, at POSITION (row * number of
+// columns + column) of the layout of the other half. Its state is received with
+// IBP, see docs/ibp.md.
+#define REMOTE(POSITION) \
+  { .source = kRemoteSourceGPIO, .sink = (POSITION) }
+
 // A special custom key that enters config menu
 #define CONFIG CK(ENTER_CONFIG)
 
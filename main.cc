@@ -1,10 +1,12 @@
 #include <stdio.h>
 
 #include "FreeRTOS.h"
+#include "heap.h"
 #include "pico/stdlib.h"
 #include "runner.h"
 #include "storage.h"
 #include "sync.h"
+#include "task.h"
 #include "utils.h"
 
 extern "C" void vApplicationMallocFailedHook(void) {
@@ -17,7 +19,47 @@ extern "C" void vApplicationStackOverflowHook(TaskHandle_t pxTask,
 }
 extern "C" void vApplicationTickHook(void) {}
 
+// Memory of the kernel tasks, required by configSUPPORT_STATIC_ALLOCATION.
+// The smp branch allocates the minimal idle task of the other core itself.
+static StaticTask_t idle_task_buffer;
+static StackType_t idle_task_stack[configMINIMAL_STACK_SIZE];
+static StaticTask_t timer_task_buffer;
+static StackType_t timer_task_stack[configTIMER_TASK_STACK_DEPTH];
+
+extern "C" void vApplicationGetIdleTaskMemory(StaticTask_t **task_buffer,
+                                              StackType_t **stack,
+                                              uint32_t *stack_size) {
+  *task_buffer = &idle_task_buffer;
+  *stack = idle_task_stack;
+  *stack_size = configMINIMAL_STACK_SIZE;
+}
+
+extern "C" void vApplicationGetTimerTaskMemory(StaticTask_t **task_buffer,
+                                               StackType_t **stack,
+                                               uint32_t *stack_size) {
+  *task_buffer = &timer_task_buffer;
+  *stack = timer_task_stack;
+  *stack_size = configTIMER_TASK_STACK_DEPTH;
+}
+
+#if tskKERNEL_VERSION_MAJOR >= 11 && configNUMBER_OF_CORES > 1
+// V11 asks for the passive idle tasks of the other cores as well
+static StaticTask_t passive_idle_task_buffers[configNUMBER_OF_CORES - 1];
+static StackType_t passive_idle_task_stacks[configNUMBER_OF_CORES - 1]
+                                           [configMINIMAL_STACK_SIZE];
+
+extern "C" void vApplicationGetPassiveIdleTaskMemory(
+    StaticTask_t **task_buffer, StackType_t **stack, uint32_t *stack_size,
+    BaseType_t index) {
+  *task_buffer = &passive_idle_task_buffers[index];
+  *stack = passive_idle_task_stacks[index];
+  *stack_size = configMINIMAL_STACK_SIZE;
+}
+#endif
+
 int main() {
+  InitializeHeap();
+
   if (InitializeStorage() == OK &&   //
       runner::RunnerInit() == OK &&  //
       runner::RunnerStart() == OK) {
@@ -1,5 +1,6 @@
 #include "runner.h"
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -7,6 +8,7 @@
 #include "FreeRTOSConfig.h"
 #include "base.h"
 #include "configuration.h"
+#include "heap.h"
 #include "hardware/timer.h"
 #include "hardware/watchdog.h"
 #include "semphr.h"
@@ -15,6 +17,12 @@
 #include "usb.h"
 #include "utils.h"
 
+// How often the slow output task logs the task and heap stats, when the log
+// level includes L_INFO
+#ifndef CONFIG_TASK_STATS_LOG_MS
+#define CONFIG_TASK_STATS_LOG_MS 10000
+#endif
+
 static std::vector<std::shared_ptr<GenericInputDevice>> input_devices;
 static std::vector<std::shared_ptr<GenericOutputDevice>> output_devices;
 static std::vector<std::shared_ptr<GenericOutputDevice>> slow_output_devices;
@@ -26,7 +34,18 @@ static TimerHandle_t output_timer_handle = NULL;
 static TaskHandle_t slow_output_task_handle = NULL;
 static TimerHandle_t slow_output_timer_handle = NULL;
 
+static StackType_t input_task_stack[CONFIG_TASK_STACK_SIZE];
+static StaticTask_t input_task_buffer;
+static StaticTimer_t input_timer_buffer;
+static StackType_t output_task_stack[CONFIG_TASK_STACK_SIZE];
+static StaticTask_t output_task_buffer;
+static StaticTimer_t output_timer_buffer;
+static StackType_t slow_output_task_stack[CONFIG_TASK_STACK_SIZE];
+static StaticTask_t slow_output_task_buffer;
+static StaticTimer_t slow_output_timer_buffer;
+
 static SemaphoreHandle_t semaphore;
+static StaticSemaphore_t semaphore_buffer;
 static bool is_config_mode;
 static bool update_config_flag;
 
@@ -48,7 +67,7 @@ Status RunnerInit() {
   is_config_mode = false;
   update_config_flag = false;
 
-  semaphore = xSemaphoreCreateBinary();
+  semaphore = xSemaphoreCreateBinaryStatic(&semaphore_buffer);
   xSemaphoreGive(semaphore);
   return OK;
 }
@@ -72,16 +91,17 @@ Status RunnerStart() {
 
   // Start output device task
 
-  BaseType_t status = xTaskCreate(&OutputDeviceTask, "output_device_task",
-                                  CONFIG_TASK_STACK_SIZE, NULL,
-                                  CONFIG_TASK_PRIORITY, &output_task_handle);
-  if (status != pdPASS || output_task_handle == NULL) {
+  output_task_handle = xTaskCreateStatic(
+      &OutputDeviceTask, "output_device_task", CONFIG_TASK_STACK_SIZE, NULL,
+      CONFIG_TASK_PRIORITY, output_task_stack, &output_task_buffer);
+  if (output_task_handle == NULL) {
     return ERROR;
   }
 
-  output_timer_handle = xTimerCreate("output_device_timer", CONFIG_SCAN_TICKS,
-                                     pdTRUE,  // Auto reload
-                                     NULL, &OutputDeviceTimerCallback);
+  output_timer_handle = xTimerCreateStatic(
+      "output_device_timer", CONFIG_SCAN_TICKS,
+      pdTRUE,  // Auto reload
+      NULL, &OutputDeviceTimerCallback, &output_timer_buffer);
 
   if (output_timer_handle == NULL) {
     return ERROR;
@@ -92,17 +112,18 @@ Status RunnerStart() {
 
   // Start slow output device task
 
-  status = xTaskCreate(&SlowOutputDeviceTask, "slow_output_device_task",
-                       CONFIG_TASK_STACK_SIZE, NULL, CONFIG_TASK_PRIORITY - 1,
-                       &slow_output_task_handle);
-  if (status != pdPASS || slow_output_task_handle == NULL) {
+  slow_output_task_handle = xTaskCreateStatic(
+      &SlowOutputDeviceTask, "slow_output_device_task", CONFIG_TASK_STACK_SIZE,
+      NULL, CONFIG_TASK_PRIORITY - 1, slow_output_task_stack,
+      &slow_output_task_buffer);
+  if (slow_output_task_handle == NULL) {
     return ERROR;
   }
 
-  slow_output_timer_handle =
-      xTimerCreate("slow_output_device_timer", CONFIG_SLOW_TICKS,
-                   pdTRUE,  // Auto reload
-                   NULL, &SlowOutputDeviceTimerCallback);
+  slow_output_timer_handle = xTimerCreateStatic(
+      "slow_output_device_timer", CONFIG_SLOW_TICKS,
+      pdTRUE,  // Auto reload
+      NULL, &SlowOutputDeviceTimerCallback, &slow_output_timer_buffer);
 
   if (slow_output_timer_handle == NULL) {
     return ERROR;
@@ -117,16 +138,18 @@ Status RunnerStart() {
   // flash writes that will disable the other core. Don't want to block the tick
   // handler as well as usb task (which is also pinned to the tick core) for too
   // long.
-  status = xTaskCreateAffinitySet(
+  input_task_handle = xTaskCreateStaticAffinitySet(
       &InputDeviceTask, "input_device_task", CONFIG_TASK_STACK_SIZE, NULL,
-      CONFIG_TASK_PRIORITY, (1 << (configTICK_CORE)), &input_task_handle);
-  if (status != pdPASS || input_task_handle == NULL) {
+      CONFIG_TASK_PRIORITY, input_task_stack, &input_task_buffer,
+      (1 << (configTICK_CORE)));
+  if (input_task_handle == NULL) {
     return ERROR;
   }
 
-  input_timer_handle = xTimerCreate("input_device_timer", CONFIG_SCAN_TICKS,
-                                    pdTRUE,  // Auto reload
-                                    NULL, &InputDeviceTimerCallback);
+  input_timer_handle = xTimerCreateStatic(
+      "input_device_timer", CONFIG_SCAN_TICKS,
+      pdTRUE,  // Auto reload
+      NULL, &InputDeviceTimerCallback, &input_timer_buffer);
 
   if (input_timer_handle == NULL) {
     return ERROR;
@@ -137,6 +160,8 @@ Status RunnerStart() {
 
   watchdog_enable(/*delay_ms=*/100, /*pause_on_debug=*/true);
 
+  FreezeHeap();
+
   return OK;
 }
 
@@ -145,8 +170,9 @@ extern "C" void InputDeviceTask(void* parameter) {
 
   bool local_is_config_mode = false;
 
-  while (true) {
-    // Initialization
+  // Initialization. Loading the config is allowed to allocate.
+  {
+    HeapAllowedSection heap_allowed;
 
     DeviceRegistry::UpdateConfig();
     for (auto output_device : output_devices) {
@@ -166,66 +192,72 @@ extern "C" void InputDeviceTask(void* parameter) {
     for (auto output_device : slow_output_devices) {
       output_device->FinalizeInputTickOutput();
     }
+  }
 
-    while (true) {
-      const uint64_t sleep_time = time_us_64();
-      // Wait for the timer callback to wake it up. Running this outside the
-      // timer context to avoid overflowing the timer task.
-      xTaskNotifyWait(/*do not clear notification on enter*/ 0,
-                      /*clear notification on exit*/ 0xffffffff,
-                      /*pulNotificationValue=*/NULL, portMAX_DELAY);
-      const uint64_t start_time = time_us_64();
-      if (start_time - sleep_time < 1000) {
-        LOG_WARNING(
-            "Input task didn't sleep enough. Remaining time budget is less "
-            "than 1ms.");
-      }
-      bool should_change_config_mode;
-      bool should_update_config;
-      {
-        LockSemaphore lock(semaphore);
-        should_change_config_mode = local_is_config_mode != is_config_mode;
-        should_update_config = update_config_flag;
-        update_config_flag = false;
+  while (true) {
+    const uint64_t sleep_time = time_us_64();
+    // Wait for the timer callback to wake it up. Running this outside the
+    // timer context to avoid overflowing the timer task.
+    xTaskNotifyWait(/*do not clear notification on enter*/ 0,
+                    /*clear notification on exit*/ 0xffffffff,
+                    /*pulNotificationValue=*/NULL, portMAX_DELAY);
+    const uint64_t start_time = time_us_64();
+    if (start_time - sleep_time < 1000) {
+      LOG_WARNING(
+          "Input task didn't sleep enough. Remaining time budget is less "
+          "than 1ms.");
+    }
+    bool should_change_config_mode;
+    bool should_update_config;
+    {
+      LockSemaphore lock(semaphore);
+      should_change_config_mode = local_is_config_mode != is_config_mode;
+      should_update_config = update_config_flag;
+      update_config_flag = false;
+    }
+    // The config modifier UI and config updates allocate, so the heap is only
+    // available in config mode.
+    HeapAllowedSection heap_allowed(
+        /*allowed=*/local_is_config_mode || should_change_config_mode ||
+        should_update_config);
+    if (should_change_config_mode) {
+      local_is_config_mode = !local_is_config_mode;
+      for (auto device : output_devices) {
+        device->SetConfigMode(local_is_config_mode);
       }
-      if (should_change_config_mode) {
-        local_is_config_mode = !local_is_config_mode;
-        for (auto device : output_devices) {
-          device->SetConfigMode(local_is_config_mode);
-        }
-        for (auto device : input_devices) {
-          device->SetConfigMode(local_is_config_mode);
-        }
-        for (auto device : slow_output_devices) {
-          device->SetConfigMode(local_is_config_mode);
-        }
+      for (auto device : input_devices) {
+        device->SetConfigMode(local_is_config_mode);
       }
-      if (should_update_config) {
-        // Rerun the initialization
-        break;
+      for (auto device : slow_output_devices) {
+        device->SetConfigMode(local_is_config_mode);
       }
+    }
+    if (should_update_config) {
+      // Only the devices whose config changed are updated, in this tick. The
+      // other devices keep their state.
+      DeviceRegistry::UpdateConfig();
+    }
 
-      for (auto output_device : output_devices) {
-        output_device->StartOfInputTick();
-      }
-      for (auto output_device : slow_output_devices) {
-        output_device->StartOfInputTick();
-      }
+    for (auto output_device : output_devices) {
+      output_device->StartOfInputTick();
+    }
+    for (auto output_device : slow_output_devices) {
+      output_device->StartOfInputTick();
+    }
 
-      for (auto input_device : input_devices) {
-        input_device->InputTick();
-      }
+    for (auto input_device : input_devices) {
+      input_device->InputTick();
+    }
 
-      for (auto output_device : output_devices) {
-        output_device->FinalizeInputTickOutput();
-      }
-      for (auto output_device : slow_output_devices) {
-        output_device->FinalizeInputTickOutput();
-      }
-      const uint64_t end_time = time_us_64();
-      LOG_DEBUG("Input task per iteration takes %d us", end_time - start_time);
-      watchdog_update();
+    for (auto output_device : output_devices) {
+      output_device->FinalizeInputTickOutput();
+    }
+    for (auto output_device : slow_output_devices) {
+      output_device->FinalizeInputTickOutput();
     }
+    const uint64_t end_time = time_us_64();
+    LOG_DEBUG("Input task per iteration takes %d us", end_time - start_time);
+    watchdog_update();
   }
 }
 
@@ -261,6 +293,30 @@ extern "C" void OutputDeviceTimerCallback(TimerHandle_t xTimer) {
   xTaskNotifyGive(output_task_handle);
 }
 
+static void MaybeLogStats() {
+#if CONFIG_DEBUG_LOG_LEVEL >= 3  // L_INFO
+  static TaskStatsSampler sampler;
+  static std::array<TaskStats, TaskStatsSampler::kMaxTasks> stats;
+  static uint64_t last_log_time = 0;
+
+  const uint64_t now = time_us_64();
+  if (now - last_log_time < CONFIG_TASK_STATS_LOG_MS * 1000ull) {
+    return;
+  }
+  last_log_time = now;
+
+  const size_t num_tasks = sampler.Sample(&stats);
+  for (size_t i = 0; i < num_tasks; ++i) {
+    LOG_INFO("Task %s: %d bytes of stack left, %d%% cpu", stats[i].name,
+             stats[i].min_free_stack_bytes, stats[i].cpu_percent);
+  }
+  const HeapStats heap_stats = GetHeapStats();
+  LOG_INFO("Heap: %d bytes in use, peak %d, %d%% fragmented",
+           heap_stats.bytes_in_use, heap_stats.peak_bytes_in_use,
+           heap_stats.fragmentation);
+#endif
+}
+
 extern "C" void SlowOutputDeviceTask(void* parameter) {
   (void)parameter;
 
@@ -283,6 +339,7 @@ extern "C" void SlowOutputDeviceTask(void* parameter) {
     const uint64_t end_time = time_us_64();
     LOG_DEBUG("Slow output task per iteration takes %d us",
               end_time - start_time);
+    MaybeLogStats();
   }
 }
 
@@ -300,4 +357,53 @@ void NotifyConfigChange() {
   update_config_flag = true;
 }
 
+TaskStatsSampler::TaskStatsSampler() : num_previous_(0), previous_total_(0) {}
+
+size_t TaskStatsSampler::Sample(std::array<TaskStats, kMaxTasks>* output) {
+  configRUN_TIME_COUNTER_TYPE total;
+  const size_t num_tasks =
+      uxTaskGetSystemState(status_.data(), status_.size(), &total);
+  if (num_tasks == 0) {
+    LOG_WARNING("More than %d tasks. Increase TaskStatsSampler::kMaxTasks",
+                kMaxTasks);
+    return 0;
+  }
+  std::sort(status_.begin(), status_.begin() + num_tasks,
+            [](const TaskStatus_t& a, const TaskStatus_t& b) {
+              return a.xTaskNumber < b.xTaskNumber;
+            });
+
+  const configRUN_TIME_COUNTER_TYPE elapsed = total - previous_total_;
+  for (size_t i = 0; i < num_tasks; ++i) {
+    const TaskStatus_t& status = status_[i];
+
+    // Tasks are never deleted, so a task missing from the previous sample ran
+    // for its whole lifetime within the elapsed time.
+    configRUN_TIME_COUNTER_TYPE previous_run_time = 0;
+    for (size_t j = 0; j < num_previous_; ++j) {
+      if (previous_[j].first == status.xHandle) {
+        previous_run_time = previous_[j].second;
+        break;
+      }
+    }
+    const configRUN_TIME_COUNTER_TYPE run_time =
+        status.ulRunTimeCounter - previous_run_time;
+
+    (*output)[i] = {
+        .name = status.pcTaskName,
+        .min_free_stack_bytes =
+            (uint32_t)(status.usStackHighWaterMark * sizeof(StackType_t)),
+        .cpu_percent =
+            (uint8_t)(elapsed == 0
+                          ? 0
+                          : std::min<configRUN_TIME_COUNTER_TYPE>(
+                                run_time * 100 / elapsed, 100)),
+    };
+    previous_[i] = {status.xHandle, status.ulRunTimeCounter};
+  }
+  num_previous_ = num_tasks;
+  previous_total_ = total;
+  return num_tasks;
+}
+
 }  // namespace runner
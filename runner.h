@@ -1,6 +1,14 @@
 #ifndef RUNNER_H_
 #define RUNNER_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <utility>
+
+#include "FreeRTOS.h"
+#include "task.h"
 #include "utils.h"
 
 namespace runner {
@@ -9,8 +17,40 @@ Status RunnerInit();
 Status RunnerStart();
 
 void SetConfigMode(bool is_config);
+// At the next input tick, calls OnUpdateConfig() of the devices whose config
+// changed. The input loop keeps running.
 void NotifyConfigChange();
 
+struct TaskStats {
+  // Points into the task control block. All the tasks live until reboot.
+  const char* name;
+  // Smallest amount of free stack the task ever had
+  uint32_t min_free_stack_bytes;
+  // Share of one core used since the previous sample
+  uint8_t cpu_percent;
+};
+
+// Samples the stack high-water mark and the CPU usage of every task: input,
+// output, slow output, USB, SPI, the core blockers and the FreeRTOS timer and
+// idle tasks. Each user should have its own sampler, since the CPU usage is
+// relative to the previous sample.
+class TaskStatsSampler {
+ public:
+  static constexpr size_t kMaxTasks = 24;
+
+  TaskStatsSampler();
+
+  // Tasks are sorted by creation order. Returns the number of tasks.
+  size_t Sample(std::array<TaskStats, kMaxTasks>* output);
+
+ private:
+  std::array<TaskStatus_t, kMaxTasks> status_;
+  std::array<std::pair<TaskHandle_t, configRUN_TIME_COUNTER_TYPE>, kMaxTasks>
+      previous_;
+  size_t num_previous_;
+  configRUN_TIME_COUNTER_TYPE previous_total_;
+};
+
 }  // namespace runner
 
-#endif /* RUNNER_H_ */
\ No newline at end of file
+#endif /* RUNNER_H_ */
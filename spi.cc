@@ -1,5 +1,6 @@
 #include "spi.h"
 
+#include <algorithm>
 #include <cstring>
 
 #include "hardware/gpio.h"
@@ -11,6 +12,20 @@
 #define GPIO_DEBUG_PIN_1 4
 #define GPIO_DEBUG_PIN_2 5
 
+// Number of host polls between two link training decisions
+#ifndef CONFIG_IBP_SPI_TRAINING_WINDOW
+#define CONFIG_IBP_SPI_TRAINING_WINDOW 256
+#endif
+
+// The clock is lowered when more errors than this are counted in a window
+#ifndef CONFIG_IBP_SPI_MAX_ERRORS_PER_MILLE
+#define CONFIG_IBP_SPI_MAX_ERRORS_PER_MILLE 10
+#endif
+
+#ifndef CONFIG_IBP_SPI_RETRAIN_WINDOWS
+#define CONFIG_IBP_SPI_RETRAIN_WINDOWS 64
+#endif
+
 namespace {
 
 constexpr size_t kTXTicksToWait = 1;
@@ -39,7 +54,7 @@ void __no_inline_not_in_flash_func(SPIDeviceRXIRQ)(IBPIRQData* irq_data) {
     if (irq_data_local.rx_buf_idx == 0) {
       irq_data_local.rx_packet_size = GetTransactionTotalSize(read);
     }
-    (*irq_data_local.rx_buffer)[irq_data_local.rx_buf_idx++] = read;
+    irq_data_local.rx_buffer[irq_data_local.rx_buf_idx++] = read;
     if (irq_data_local.rx_packet_size < 0) {
       *irq_data = irq_data_local;
       xSemaphoreGiveFromISR(irq_data_local.rx_handle,
@@ -50,7 +65,7 @@ void __no_inline_not_in_flash_func(SPIDeviceRXIRQ)(IBPIRQData* irq_data) {
       while (spi_is_writable(irq_data_local.spi_port) &&
              irq_data_local.tx_buf_idx < irq_data_local.tx_packet_size) {
         spi_get_hw(irq_data_local.spi_port)->dr =
-            (*irq_data_local.tx_buffer)[irq_data_local.tx_buf_idx++];
+            irq_data_local.tx_buffer[irq_data_local.tx_buf_idx++];
       }
       *irq_data = irq_data_local;
 
@@ -73,7 +88,7 @@ void SPIDeviceTXIRQ(IBPIRQData* irq_data) {
   while (spi_is_writable(irq_data_local.spi_port) &&
          irq_data_local.tx_buf_idx < irq_data_local.tx_packet_size) {
     spi_get_hw(irq_data_local.spi_port)->dr =
-        (*irq_data_local.tx_buffer)[irq_data_local.tx_buf_idx++];
+        irq_data_local.tx_buffer[irq_data_local.tx_buf_idx++];
   }
 
   *irq_data = irq_data_local;
@@ -107,6 +122,65 @@ void SPI1DeviceIRQ() {
 }
 
 void SPI1HostIRQ() {}
+
+// Two interrupts per transaction in DMA mode. The first once the first 4 bytes
+// of the host packet are in, to read the packet size from the header. The rest
+// of the host packet is then received by a transfer chained to the one sending
+// the device packet, so the device packet goes out right after the host packet
+// without waiting on the CPU. The second once the device packet is all in the
+// TX FIFO.
+void __no_inline_not_in_flash_func(SPIDeviceDMAIRQ)(IBPIRQData* irq_data) {
+  if (dma_channel_get_irq1_status(irq_data->rx_dma_channel)) {
+    dma_channel_acknowledge_irq1(irq_data->rx_dma_channel);
+    const int8_t size = GetTransactionTotalSize(irq_data->rx_buffer[0]);
+    if (size < 4 || size > IBP_MAX_PACKET_LEN) {
+      irq_data->rx_packet_size = -1;
+      xSemaphoreGiveFromISR(irq_data->rx_handle,
+                            /*pxHigherPriorityTaskWoken=*/NULL);
+      return;
+    }
+    irq_data->rx_packet_size = size;
+    if (size == 4) {
+      dma_channel_start(irq_data->tx_dma_channel);
+    } else {
+      dma_channel_configure(
+          irq_data->rx_dma_channel, &irq_data->rx_body_dma_config,
+          irq_data->rx_buffer + 4,
+          &spi_get_hw(irq_data->spi_port)->dr, size - 4, /*trigger=*/true);
+    }
+  }
+  if (dma_channel_get_irq1_status(irq_data->tx_dma_channel)) {
+    dma_channel_acknowledge_irq1(irq_data->tx_dma_channel);
+    xSemaphoreGiveFromISR(irq_data->rx_handle,
+                          /*pxHigherPriorityTaskWoken=*/NULL);
+  }
+}
+
+// The host drives the clock, so a transfer is over once the last byte is
+// received.
+void __no_inline_not_in_flash_func(SPIHostDMAIRQ)(IBPIRQData* irq_data) {
+  if (dma_channel_get_irq1_status(irq_data->tx_dma_channel)) {
+    dma_channel_acknowledge_irq1(irq_data->tx_dma_channel);
+  }
+  if (dma_channel_get_irq1_status(irq_data->rx_dma_channel)) {
+    dma_channel_acknowledge_irq1(irq_data->rx_dma_channel);
+    xSemaphoreGiveFromISR(irq_data->rx_handle,
+                          /*pxHigherPriorityTaskWoken=*/NULL);
+  }
+}
+
+void SPIDMAIRQHandler() {
+  for (IBPIRQData& data : irq_data) {
+    if (!data.use_dma) {
+      continue;
+    }
+    if (data.is_host) {
+      SPIHostDMAIRQ(&data);
+    } else {
+      SPIDeviceDMAIRQ(&data);
+    }
+  }
+}
 }
 
 }  // namespace
@@ -128,7 +202,12 @@ IBPSPIBase::IBPSPIBase(IBPSPIArgs args)
       tx_pin_(args.tx_pin),
       cs_pin_(args.cs_pin),
       sck_pin_(args.sck_pin),
-      irq_data_(NULL) {}
+      use_dma_(args.use_dma),
+      irq_data_(NULL) {
+  SetDeltaEncoding(args.delta_encoding);
+  SetSendMatrix(args.send_matrix);
+  SetAcknowledge(args.acknowledge);
+}
 
 bool IBPSPIBase::TXEmpty() {
   return (spi_get_const_hw(spi_port_)->sr & SPI_SSPSR_TFE_BITS);
@@ -146,39 +225,73 @@ void IBPSPIBase::InitSPI(bool slave) {
 void IBPSPIBase::InitIRQData(irq_handler_t irq_handler) {
   const uint8_t spi_idx = spi_get_index(spi_port_);
   irq_data_ = &irq_data[spi_idx];
-  irq_data_->rx_buffer =
-      std::make_shared<std::array<uint8_t, IBP_MAX_PACKET_LEN>>();
-  irq_data_->tx_buffer =
-      std::make_shared<std::array<uint8_t, IBP_MAX_PACKET_LEN>>();
+  irq_data_->rx_buffer = NULL;
+  irq_data_->tx_buffer = NULL;
   irq_data_->spi_port = spi_port_;
-  irq_data_->rx_handle = xSemaphoreCreateBinary();
-  irq_data_->tx_handle = xSemaphoreCreateBinary();
+  irq_data_->rx_handle =
+      xSemaphoreCreateBinaryStatic(&irq_data_->rx_handle_buffer);
+  irq_data_->tx_handle =
+      xSemaphoreCreateBinaryStatic(&irq_data_->tx_handle_buffer);
   irq_data_->Clear();
 
   const int irq_nums[2] = {SPI0_IRQ, SPI1_IRQ};
   irq_set_exclusive_handler(irq_nums[spi_idx], irq_handler);
 }
 
+void IBPSPIBase::InitDMA(bool is_host) {
+  irq_data_->rx_dma_channel = dma_claim_unused_channel(/*required=*/true);
+  irq_data_->tx_dma_channel = dma_claim_unused_channel(/*required=*/true);
+  irq_data_->is_host = is_host;
+  dma_channel_set_irq1_enabled(irq_data_->rx_dma_channel, true);
+  dma_channel_set_irq1_enabled(irq_data_->tx_dma_channel, true);
+  irq_data_->use_dma = true;
+
+  // Shared by all the SPI ports
+  static bool handler_added = false;
+  if (!handler_added) {
+    irq_add_shared_handler(DMA_IRQ_1, SPIDMAIRQHandler,
+                           PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_1, true);
+    handler_added = true;
+  }
+}
+
 IBPSPIDevice::IBPSPIDevice(IBPSPIArgs args) : IBPSPIBase(args) {}
 
 Status IBPSPIDevice::IBPInitialize() {
   InitSPI(/*slave=*/true);
   spi_get_hw(spi_port_)->imsc = 0;  // Disable the interrupt for now.
-  if (spi_port_ == spi0) {
+  if (use_dma_) {
+    // Only the DMA interrupt is used
+  } else if (spi_port_ == spi0) {
     irq_set_enabled(SPI0_IRQ, true);
   } else {
     irq_set_enabled(SPI1_IRQ, true);
   }
 
-  BaseType_t status =
-      xTaskCreate(&SPIDeviceTask, "spi_device_task", CONFIG_TASK_STACK_SIZE,
-                  this, CONFIG_TASK_PRIORITY, &task_handle_);
-  if (status != pdPASS || task_handle_ == NULL) {
+  task_handle_ = xTaskCreateStatic(
+      &SPIDeviceTask, "spi_device_task", CONFIG_TASK_STACK_SIZE, this,
+      CONFIG_TASK_PRIORITY, task_stack_, &task_buffer_);
+  if (task_handle_ == NULL) {
     return ERROR;
   }
 
   const irq_handler_t irq_handlers[2] = {SPI0DeviceIRQ, SPI1DeviceIRQ};
   InitIRQData(irq_handlers[spi_get_index(spi_port_)]);
+  if (use_dma_) {
+    InitDMA(/*is_host=*/false);
+
+    dma_channel_config config =
+        dma_channel_get_default_config(irq_data_->rx_dma_channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    channel_config_set_dreq(&config, spi_get_dreq(spi_port_, /*is_tx=*/false));
+    channel_config_set_chain_to(&config, irq_data_->tx_dma_channel);
+    // The transaction is only over once the TX channel is done
+    channel_config_set_irq_quiet(&config, true);
+    irq_data_->rx_body_dma_config = config;
+  }
 
   gpio_init(GPIO_DEBUG_PIN_0);
   gpio_set_dir(GPIO_DEBUG_PIN_0, GPIO_OUT);
@@ -195,21 +308,33 @@ void IBPSPIDevice::DeviceTask() {
     LOG_ERROR("irq_data_ is NULL. Terminate the IBP device task");
     return;
   }
+  if (use_dma_) {
+    DeviceTaskDMA();
+    return;
+  }
 
+  // Kept for the next transaction if the packet received is invalid
+  uint8_t in_idx = kNoPacket;
   while (true) {
     irq_data_->Clear();
 
-    // Get the new out-bound packet.
-    const std::string out_packet = GetOutPacket();
-    if (out_packet.size() > IBP_MAX_PACKET_LEN || out_packet.empty()) {
-      LOG_ERROR("Invalid out bound packet");
+    // Get the new out-bound packet. The IRQ handlers work on the pool buffers
+    // directly.
+    if (in_idx == kNoPacket) {
+      in_idx = AcquirePacket();
+    }
+    const uint8_t out_idx = TakeOutPacket();
+    if (in_idx == kNoPacket || out_idx == kNoPacket) {
+      LOG_ERROR("No free IBP packet buffer");
+      if (out_idx != kNoPacket) {
+        ReleasePacket(out_idx);
+      }
       vTaskDelay(pdMS_TO_TICKS(IBP_INVALID_PACKET_DELAY_MS));
       continue;
     }
-
-    std::memcpy(irq_data_->tx_buffer->data(), out_packet.data(),
-                out_packet.size());
-    irq_data_->tx_packet_size = out_packet.size();
+    irq_data_->tx_buffer = GetPacket(out_idx).data;
+    irq_data_->tx_packet_size = GetPacket(out_idx).size;
+    irq_data_->rx_buffer = GetPacket(in_idx).data;
 
     gpio_put(GPIO_DEBUG_PIN_0, 0);
     gpio_put(GPIO_DEBUG_PIN_1, 0);
@@ -228,12 +353,12 @@ void IBPSPIDevice::DeviceTask() {
       gpio_put(GPIO_DEBUG_PIN_1, 0);
     }
 
-    xSemaphoreTake(irq_data->rx_handle, /*xTicksToWait=*/0);
-    xSemaphoreTake(irq_data->tx_handle, /*xTicksToWait=*/0);
+    xSemaphoreTake(irq_data_->rx_handle, /*xTicksToWait=*/0);
+    xSemaphoreTake(irq_data_->tx_handle, /*xTicksToWait=*/0);
     spi_get_hw(spi_port_)->imsc &= 0b0111;  // Mask TX IRQ
     spi_get_hw(spi_port_)->imsc |= 0b0100;  // Enable RX IRQ
 
-    xSemaphoreTake(irq_data->rx_handle, portMAX_DELAY);
+    xSemaphoreTake(irq_data_->rx_handle, portMAX_DELAY);
 
     gpio_put(GPIO_DEBUG_PIN_0, 0);
 
@@ -242,21 +367,24 @@ void IBPSPIDevice::DeviceTask() {
 
     if (irq_data_->rx_packet_size < 0) {
       LOG_ERROR("Invalid in bound packet");
+      CountLinkError();
+      ReleasePacket(out_idx);
       vTaskDelay(pdMS_TO_TICKS(IBP_INVALID_PACKET_DELAY_MS));
       continue;
     }
 
-    SetInPacket(
-        std::string(irq_data->rx_buffer->data(),
-                    irq_data->rx_buffer->data() + irq_data_->rx_packet_size));
+    PutInPacket(in_idx, irq_data_->rx_packet_size);
+    in_idx = kNoPacket;
 
-    const bool tx_done = xSemaphoreTake(irq_data->tx_handle, kTXTicksToWait);
+    const bool tx_done = xSemaphoreTake(irq_data_->tx_handle, kTXTicksToWait);
 
     gpio_put(GPIO_DEBUG_PIN_1, 0);
 
     // At this point both RX and TX IRQs should be masked. Remask just to be
     // sure.
     spi_get_hw(spi_port_)->imsc = 0;
+    // Whatever is left is in the TX FIFO
+    ReleasePacket(out_idx);
 
     if (tx_done && !TXEmpty()) {
       // If the semaphore is successfully acquired, then we know that TX IRQ has
@@ -266,3 +394,282 @@ void IBPSPIDevice::DeviceTask() {
     }
   }
 }
+
+void IBPSPIDevice::DeviceTaskDMA() {
+  const uint32_t rx_channel = irq_data_->rx_dma_channel;
+  const uint32_t tx_channel = irq_data_->tx_dma_channel;
+  io_rw_32* const dr = &spi_get_hw(spi_port_)->dr;
+
+  // Receives the first 4 bytes of the host packet, which hold the header
+  dma_channel_config header_config = dma_channel_get_default_config(rx_channel);
+  channel_config_set_transfer_data_size(&header_config, DMA_SIZE_8);
+  channel_config_set_read_increment(&header_config, false);
+  channel_config_set_write_increment(&header_config, true);
+  channel_config_set_dreq(&header_config,
+                          spi_get_dreq(spi_port_, /*is_tx=*/false));
+
+  dma_channel_config tx_config = dma_channel_get_default_config(tx_channel);
+  channel_config_set_transfer_data_size(&tx_config, DMA_SIZE_8);
+  channel_config_set_read_increment(&tx_config, true);
+  channel_config_set_write_increment(&tx_config, false);
+  channel_config_set_dreq(&tx_config, spi_get_dreq(spi_port_, /*is_tx=*/true));
+
+  // Kept for the next transaction if the packet received is invalid
+  uint8_t in_idx = kNoPacket;
+  while (true) {
+    // Get the new out-bound packet. The DMA reads and writes the pool buffers
+    // directly.
+    if (in_idx == kNoPacket) {
+      in_idx = AcquirePacket();
+    }
+    const uint8_t out_idx = TakeOutPacket();
+    if (in_idx == kNoPacket || out_idx == kNoPacket) {
+      LOG_ERROR("No free IBP packet buffer");
+      if (out_idx != kNoPacket) {
+        ReleasePacket(out_idx);
+      }
+      vTaskDelay(pdMS_TO_TICKS(IBP_INVALID_PACKET_DELAY_MS));
+      continue;
+    }
+
+    // Both channels are idle unless the last transaction was cut short
+    dma_channel_abort(rx_channel);
+    dma_channel_abort(tx_channel);
+    irq_data_->tx_buffer = GetPacket(out_idx).data;
+    irq_data_->rx_buffer = GetPacket(in_idx).data;
+
+    // Drop what the host clocked in while the last device packet was sent
+    while (spi_is_readable(spi_port_)) {
+      (void)*dr;
+    }
+    spi_get_hw(spi_port_)->icr = SPI_SSPICR_RORIC_BITS;
+    if (!TXEmpty()) {
+      InitSPI(/*slave=*/true);
+    }
+
+    xSemaphoreTake(irq_data_->rx_handle, /*xTicksToWait=*/0);
+    irq_data_->rx_packet_size = -1;
+    dma_channel_configure(tx_channel, &tx_config, dr, irq_data_->tx_buffer,
+                          GetPacket(out_idx).size, /*trigger=*/false);
+    dma_channel_configure(rx_channel, &header_config, irq_data_->rx_buffer, dr,
+                          4, /*trigger=*/true);
+
+    // Given on an invalid header or once the device packet is sent
+    xSemaphoreTake(irq_data_->rx_handle, portMAX_DELAY);
+
+    if (irq_data_->rx_packet_size < 0) {
+      LOG_ERROR("Invalid in bound packet");
+      CountLinkError();
+      // The TX channel never started
+      ReleasePacket(out_idx);
+      vTaskDelay(pdMS_TO_TICKS(IBP_INVALID_PACKET_DELAY_MS));
+      continue;
+    }
+
+    PutInPacket(in_idx, irq_data_->rx_packet_size);
+    in_idx = kNoPacket;
+    ReleasePacket(out_idx);
+
+    if (!TXEmpty()) {
+      // The last bytes of the device packet are still in the TX FIFO
+      vTaskDelay(kTXTicksToWait);
+    }
+  }
+}
+
+IBPSPIHost::IBPSPIHost(IBPSPIArgs args)
+    : IBPSPIBase(args),
+      poll_ticks_(std::max<uint32_t>(args.poll_ticks, 1)),
+      ticks_since_poll_(0),
+      max_baud_rate_(args.max_baud_rate),
+      current_baud_rate_(args.baud_rate),
+      ceiling_baud_rate_(0),
+      clean_windows_(0),
+      window_polls_(0),
+      window_start_errors_(0) {}
+
+Status IBPSPIHost::IBPInitialize() {
+  // The CS pin is driven by the SPI controller, which toggles it between bytes
+  // like the device expects.
+  InitSPI(/*slave=*/false);
+  spi_get_hw(spi_port_)->imsc = 0;  // Only the DMA interrupt is used
+
+  const irq_handler_t irq_handlers[2] = {SPI0HostIRQ, SPI1HostIRQ};
+  InitIRQData(irq_handlers[spi_get_index(spi_port_)]);
+  InitDMA(/*is_host=*/true);
+
+  tx_dma_config_ = dma_channel_get_default_config(irq_data_->tx_dma_channel);
+  channel_config_set_transfer_data_size(&tx_dma_config_, DMA_SIZE_8);
+  channel_config_set_read_increment(&tx_dma_config_, true);
+  channel_config_set_write_increment(&tx_dma_config_, false);
+  channel_config_set_dreq(&tx_dma_config_,
+                          spi_get_dreq(spi_port_, /*is_tx=*/true));
+
+  rx_dma_config_ = dma_channel_get_default_config(irq_data_->rx_dma_channel);
+  channel_config_set_transfer_data_size(&rx_dma_config_, DMA_SIZE_8);
+  channel_config_set_read_increment(&rx_dma_config_, false);
+  channel_config_set_write_increment(&rx_dma_config_, true);
+  channel_config_set_dreq(&rx_dma_config_,
+                          spi_get_dreq(spi_port_, /*is_tx=*/false));
+
+  task_handle_ = xTaskCreateStatic(&SPIHostTask, "spi_host_task",
+                                   CONFIG_TASK_STACK_SIZE, this,
+                                   CONFIG_TASK_PRIORITY, task_stack_,
+                                   &task_buffer_);
+  if (task_handle_ == NULL) {
+    return ERROR;
+  }
+  return OK;
+}
+
+void IBPSPIHost::FinalizeInputTickOutput() {
+  IBPSPIBase::FinalizeInputTickOutput();
+  if (++ticks_since_poll_ >= poll_ticks_) {
+    ticks_since_poll_ = 0;
+    xTaskNotifyGive(task_handle_);
+  }
+}
+
+Status IBPSPIHost::Transfer(const uint8_t* tx, uint8_t* rx, size_t size) {
+  io_rw_32* const dr = &spi_get_hw(spi_port_)->dr;
+  static const uint8_t zero = 0;
+  xSemaphoreTake(irq_data_->rx_handle, /*xTicksToWait=*/0);
+  dma_channel_config tx_config = tx_dma_config_;
+  if (tx == NULL) {
+    channel_config_set_read_increment(&tx_config, false);
+    tx = &zero;
+  }
+  dma_channel_configure(irq_data_->tx_dma_channel, &tx_config, dr, tx, size,
+                        /*trigger=*/false);
+  dma_channel_configure(irq_data_->rx_dma_channel, &rx_dma_config_, rx, dr,
+                        size, /*trigger=*/false);
+  dma_start_channel_mask((1u << irq_data_->tx_dma_channel) |
+                         (1u << irq_data_->rx_dma_channel));
+
+  // The transfer takes well under a tick unless the clock is very slow
+  if (xSemaphoreTake(irq_data_->rx_handle, pdMS_TO_TICKS(10)) != pdTRUE) {
+    dma_channel_abort(irq_data_->tx_dma_channel);
+    dma_channel_abort(irq_data_->rx_dma_channel);
+    return ERROR;
+  }
+  return OK;
+}
+
+uint8_t IBPSPIHost::Poll(uint8_t out_idx, uint8_t in_idx) {
+  // Steps 1 and 2: the host packet followed by kHeaderWindow zeros, sent
+  // straight from the pool buffer. The device header is the first non-zero
+  // byte received during the zeros.
+  PacketBuffer& out_packet = GetPacket(out_idx);
+  std::memset(out_packet.data + out_packet.size, 0, kHeaderWindow);
+  if (Transfer(out_packet.data, rx_scratch_.data(),
+               out_packet.size + kHeaderWindow) != OK) {
+    LOG_ERROR("IBP SPI transfer timed out");
+    return 0;
+  }
+  const uint8_t* window = rx_scratch_.data() + out_packet.size;
+  size_t header_idx = 0;
+  while (header_idx < kHeaderWindow && window[header_idx] == 0) {
+    ++header_idx;
+  }
+  if (header_idx == kHeaderWindow) {
+    return 0;
+  }
+  const int8_t in_size = GetTransactionTotalSize(window[header_idx]);
+  const size_t received = kHeaderWindow - header_idx;
+  if (in_size < (int8_t)received || in_size > IBP_MAX_PACKET_LEN) {
+    return 0;
+  }
+  uint8_t* in_packet = GetPacket(in_idx).data;
+  std::memcpy(in_packet, window + header_idx, received);
+
+  // Step 3: zeros to clock in the rest of the device packet, received
+  // straight into the pool buffer
+  const size_t remaining = in_size - received;
+  if (remaining > 0 &&
+      Transfer(/*tx=*/NULL, in_packet + received, remaining) != OK) {
+    LOG_ERROR("IBP SPI transfer timed out");
+    return 0;
+  }
+  return in_size;
+}
+
+void IBPSPIHost::HostTask() {
+  if (irq_data_ == NULL) {
+    LOG_ERROR("irq_data_ is NULL. Terminate the IBP host task");
+    return;
+  }
+
+  while (true) {
+    // Woken up by FinalizeInputTickOutput()
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    const uint8_t out_idx = TakeOutPacket();
+    const uint8_t in_idx = AcquirePacket();
+    if (out_idx == kNoPacket || in_idx == kNoPacket) {
+      LOG_ERROR("No free IBP packet buffer");
+      if (out_idx != kNoPacket) {
+        ReleasePacket(out_idx);
+      }
+      if (in_idx != kNoPacket) {
+        ReleasePacket(in_idx);
+      }
+      continue;
+    }
+
+    // Like the Linux host, an invalid response clears the inputs of the device
+    // until the next poll
+    const uint8_t in_size = Poll(out_idx, in_idx);
+    if (in_size == 0) {
+      CountLinkError();
+    }
+    PutInPacket(in_idx, in_size);
+    ReleasePacket(out_idx);
+    AdaptBaudRate();
+  }
+}
+
+void IBPSPIHost::AdaptBaudRate() {
+  if (max_baud_rate_ <= baud_rate_ ||
+      ++window_polls_ < CONFIG_IBP_SPI_TRAINING_WINDOW) {
+    return;
+  }
+  // Invalid device packets and segments of both tasks. Errors in the host
+  // packets only show up on the device.
+  const uint32_t errors = GetLinkStats().errors;
+  const uint32_t window_errors = errors - window_start_errors_;
+  window_start_errors_ = errors;
+  window_polls_ = 0;
+
+  uint32_t target = current_baud_rate_;
+  if (window_errors >= CONFIG_IBP_SPI_TRAINING_WINDOW) {
+    // Nothing got through, the device is more likely off than the link noisy
+    return;
+  } else if (window_errors * 1000 > CONFIG_IBP_SPI_TRAINING_WINDOW *
+                                        CONFIG_IBP_SPI_MAX_ERRORS_PER_MILLE) {
+    ceiling_baud_rate_ = current_baud_rate_;
+    clean_windows_ = 0;
+    target = std::max<uint32_t>(current_baud_rate_ / 5 * 4, baud_rate_);
+  } else if (window_errors > 0) {
+    // Close to the limit, stay here
+    clean_windows_ = 0;
+  } else {
+    if (ceiling_baud_rate_ != 0 &&
+        ++clean_windows_ >= CONFIG_IBP_SPI_RETRAIN_WINDOWS) {
+      // The noise may be gone
+      ceiling_baud_rate_ = 0;
+      clean_windows_ = 0;
+    }
+    target = std::min<uint32_t>(current_baud_rate_ / 4 * 5, max_baud_rate_);
+    if (ceiling_baud_rate_ != 0 && target >= ceiling_baud_rate_) {
+      target = current_baud_rate_;
+    }
+  }
+
+  if (target != current_baud_rate_) {
+    current_baud_rate_ = target;
+    // The SPI is idle between polls
+    const uint32_t actual = spi_set_baudrate(spi_port_, target);
+    LOG_INFO("IBP SPI clock set to %d Hz, %d errors in the last %d polls",
+             actual, window_errors, CONFIG_IBP_SPI_TRAINING_WINDOW);
+  }
+}
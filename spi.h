@@ -6,6 +6,7 @@
 
 #include "FreeRTOS.h"
 #include "base.h"
+#include "hardware/dma.h"
 #include "hardware/irq.h"
 #include "hardware/spi.h"
 #include "hardware/timer.h"
@@ -19,19 +20,51 @@ struct IBPSPIArgs {
   uint32_t cs_pin;
   uint32_t sck_pin;
   uint32_t baud_rate;
+  // Device only. Moves the packets with DMA instead of an interrupt every few
+  // bytes, so the device keeps up with a faster host clock. The clock of a
+  // device is set by the host, not by baud_rate. The host always uses DMA.
+  bool use_dma;
+  // Host only. The device is polled every poll_ticks input ticks, right after
+  // the host packet is built. 0 is the same as 1.
+  uint32_t poll_ticks;
+  // Host only. If larger than baud_rate, the clock starts at baud_rate and is
+  // stepped up to max_baud_rate while the link is clean, and back down when
+  // errors show up. See docs/ibp.md.
+  uint32_t max_baud_rate;
+  // Sends key events instead of the keys pressed, see docs/ibp.md. The other
+  // side must run PicoMK, the Linux module only understands the full state.
+  bool delta_encoding;
+  // Sends the switch states instead of the keycodes, see docs/ibp.md. The
+  // other side must run PicoMK.
+  bool send_matrix;
+  // Numbers and acks the packets, see docs/ibp.md. Set it on both sides.
+  bool acknowledge;
 };
 
 struct IBPIRQData {
-  std::shared_ptr<std::array<uint8_t, IBP_MAX_PACKET_LEN>> rx_buffer;
-  std::shared_ptr<std::array<uint8_t, IBP_MAX_PACKET_LEN>> tx_buffer;
+  // Packet buffers of the pool owned by the transport task for the current
+  // transaction
+  uint8_t* rx_buffer;
+  uint8_t* tx_buffer;
   uint8_t rx_buf_idx;
   int8_t rx_packet_size;
   uint8_t tx_buf_idx;
   uint8_t tx_packet_size;
   SemaphoreHandle_t rx_handle;
   SemaphoreHandle_t tx_handle;
+  StaticSemaphore_t rx_handle_buffer;
+  StaticSemaphore_t tx_handle_buffer;
   spi_inst_t* spi_port;
 
+  // DMA mode only
+  bool use_dma;
+  bool is_host;
+  uint32_t rx_dma_channel;
+  uint32_t tx_dma_channel;
+  // Device only. Receives the rest of the host packet, then triggers the TX
+  // channel.
+  dma_channel_config rx_body_dma_config;
+
   void Clear();
 };
 
@@ -43,14 +76,19 @@ class IBPSPIBase : public virtual IBPDeviceBase {
 
   void InitSPI(bool slave);
   void InitIRQData(irq_handler_t irq_handler);
+  // Claims the DMA channels. Call after InitIRQData().
+  void InitDMA(bool is_host);
 
   TaskHandle_t task_handle_;
+  StackType_t task_stack_[CONFIG_TASK_STACK_SIZE];
+  StaticTask_t task_buffer_;
   spi_inst_t* spi_port_;
   const uint32_t baud_rate_;
   const uint32_t rx_pin_;
   const uint32_t tx_pin_;
   const uint32_t cs_pin_;
   const uint32_t sck_pin_;
+  const bool use_dma_;
   IBPIRQData* irq_data_; 
 };
 
@@ -62,16 +100,54 @@ class IBPSPIDevice : public IBPSPIBase {
 
  protected:
   IBPSPIDevice(IBPSPIArgs args);
+
+ private:
+  void DeviceTaskDMA();
 };
 
+// Polls an IBP device, e.g. the other half of a split keyboard, with the three
+// steps described in docs/ibp.md. The device packet is handed to PutInPacket()
+// and its segments are applied on the next input tick.
 class IBPSPIHost : public IBPSPIBase {
  public:
   Status IBPInitialize() override;
 
+  // Wakes up the host task once the host packet is ready
+  void FinalizeInputTickOutput() override;
+
   void HostTask();
 
  protected:
   IBPSPIHost(IBPSPIArgs args);
+
+ private:
+  // Bytes clocked after the host packet to look for the device header
+  static constexpr size_t kHeaderWindow = 4;
+
+  // Full duplex transfer of size bytes. Blocks until done. Sends zeros if tx
+  // is NULL.
+  Status Transfer(const uint8_t* tx, uint8_t* rx, size_t size);
+  // Receives the device packet into the in_idx buffer. Returns its size, or 0
+  // on errors.
+  uint8_t Poll(uint8_t out_idx, uint8_t in_idx);
+  // Link training. Called after each poll, changes the clock at the end of
+  // each window of polls depending on the errors counted.
+  void AdaptBaudRate();
+
+  const uint32_t poll_ticks_;
+  uint32_t ticks_since_poll_;
+  const uint32_t max_baud_rate_;
+  uint32_t current_baud_rate_;
+  // The lowest rate which had too many errors, 0 if none. Not tried again
+  // before CONFIG_IBP_SPI_RETRAIN_WINDOWS clean windows.
+  uint32_t ceiling_baud_rate_;
+  uint32_t clean_windows_;
+  uint32_t window_polls_;
+  uint32_t window_start_errors_;
+  dma_channel_config tx_dma_config_;
+  dma_channel_config rx_dma_config_;
+  // What the device sends during the host packet is dropped in there
+  std::array<uint8_t, kPacketBufferSize> rx_scratch_;
 };
 
 #endif /* SPI_H_ */
\ No newline at end of file
@@ -0,0 +1,115 @@
+# Optional SRAM placement of the input hot path.
+#
+# With -DHOT_PATH_IN_SRAM=ON, the .text and .rodata of the translation units in
+# HOT_PATH_SOURCES are excluded from the flash sections of the SDK linker
+# script. The SDK script collects whatever it excluded into .data, which crt0
+# copies to SRAM at boot. This moves the project's own code for the scan loop,
+# debounce, layer resolution, keycode handlers, USB report building and the
+# layout lookups, as well as the tick code of the devices the input and output
+# loops call every tick, along with the vtables of all the classes implemented
+# in these files. Everything else still runs from flash through the XIP cache,
+# including FreeRTOS, tinyusb, pico-ssd1306, the SDK helpers and the libgcc
+# routines they call, so a cache miss can still happen on the hot path. base.cc
+# is left out since it is mostly config and setup code.
+#
+# Each build prints the SRAM cost of the relocated code and read-only data
+# (parsed from the link map).
+#
+# With -DCOPY_TO_RAM=ON, the whole firmware is copied to SRAM at boot instead
+# (pico-sdk's copy_to_ram binary type). Flash is then only touched by littlefs,
+# so storage.cc no longer parks the other core for writes and HOT_PATH_IN_SRAM
+# has no effect.
+#
+# This file is also run in script mode (cmake -P) to produce that report.
+
+if (CMAKE_SCRIPT_MODE_FILE)
+    # Sum the .text and .rodata input sections of the hot path objects which
+    # ended up in SRAM. Long section names are on a line of their own in the
+    # map file, with the address, size and object on the next one.
+    string(REPLACE "," ";" objects "${HOT_PATH_OBJECTS}")
+    foreach(object IN LISTS objects)
+        set(size_${object} 0)
+    endforeach()
+    file(STRINGS "${MAP_FILE}" map_lines)
+    set(section "")
+    foreach(line IN LISTS map_lines)
+        if (line MATCHES "^ (\\.[^ ]+)")
+            set(section "${CMAKE_MATCH_1}")
+        endif()
+        if (section MATCHES "^\\.(text|rodata)" AND
+            line MATCHES "^ +(\\.[^ ]+ +)?0x2[0-9a-f]+ +0x([0-9a-f]+) +.*/([^/]+\\.obj)$")
+            math(EXPR size_${CMAKE_MATCH_3} "${size_${CMAKE_MATCH_3}} + 0x${CMAKE_MATCH_2}")
+        endif()
+    endforeach()
+
+    set(total 0)
+    foreach(object IN LISTS objects)
+        message(STATUS "  ${object}: ${size_${object}} bytes")
+        math(EXPR total "${total} + ${size_${object}}")
+    endforeach()
+    message(STATUS "Hot path SRAM cost: ${total} bytes")
+    return()
+endif()
+
+option(COPY_TO_RAM "Run the whole firmware from SRAM (copy_to_ram binary)" OFF)
+option(HOT_PATH_IN_SRAM "Place the project's hot path code, device vtables and layout in SRAM (not FreeRTOS, tinyusb or the SDK)" OFF)
+
+set(HOT_PATH_SOURCES
+        keyscan.cc
+        builtin_keycode.cc
+        runner.cc
+        usb.cc
+        configs/${BOARD_CONFIG}/layout.cc
+        # Devices ticked by the runner. Their setup code moves along with them.
+        ibp.cc
+        ibp_lib.c
+        spi.cc
+        uart.cc
+        joystick.cc
+        rotary_encoder.cc
+        temperature.cc
+        ssd1306.cc
+        display_mixins.cc
+        ws2812.cc
+        config_modifier.cc)
+
+set(SRAM_PLACEMENT_SCRIPT ${CMAKE_CURRENT_LIST_FILE})
+
+function(place_hot_path_in_sram target)
+    set(memmap "${PICO_SDK_PATH}/src/rp2_common/pico_crt0/rp2040/memmap_default.ld")
+    if (NOT EXISTS ${memmap})
+        # pico-sdk 1.x
+        set(memmap "${PICO_SDK_PATH}/src/rp2_common/pico_standard_link/memmap_default.ld")
+    endif()
+    file(READ ${memmap} script)
+
+    set(excludes "")
+    set(objects "")
+    foreach(source IN LISTS HOT_PATH_SOURCES)
+        get_filename_component(name ${source} NAME)
+        string(APPEND excludes " */${name}.obj")
+        list(APPEND objects ${name}.obj)
+    endforeach()
+
+    set(flash_libs "*libgcc.a: *libc.a:*lib_a-mem*.o *libm.a:")
+    string(FIND "${script}" "EXCLUDE_FILE(${flash_libs})" found)
+    if (found EQUAL -1)
+        message(FATAL_ERROR "Unexpected linker script layout in ${memmap}")
+    endif()
+    string(REPLACE "EXCLUDE_FILE(${flash_libs})"
+                   "EXCLUDE_FILE(${flash_libs}${excludes})" script "${script}")
+
+    # Lists can't be passed through add_custom_command as-is
+    string(REPLACE ";" "," objects "${objects}")
+
+    set(output ${CMAKE_CURRENT_BINARY_DIR}/memmap_hot_path.ld)
+    file(WRITE ${output} "${script}")
+    pico_set_linker_script(${target} ${output})
+
+    add_custom_command(TARGET ${target} POST_BUILD
+            COMMAND ${CMAKE_COMMAND}
+                    -DMAP_FILE=$<TARGET_FILE:${target}>.map
+                    -DHOT_PATH_OBJECTS=${objects}
+                    -P ${SRAM_PLACEMENT_SCRIPT}
+            VERBATIM)
+endfunction()
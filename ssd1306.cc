@@ -23,12 +23,14 @@ SSD1306Display::SSD1306Display(i2c_inst_t* i2c, uint8_t sda_pin,
       i2c_addr_(i2c_addr),
       num_rows_(num_rows),
       num_cols_(128),
-      sleep_s_(0),
       buffer_changed_(false),
-      send_buffer_(true),
+      config_mode_(false),
+      wake_up_(false),
+      // A stable frame version is always even, so this makes the first output
+      // tick push the blank frame to the panel.
+      sent_version_(1),
       last_active_s_(0),
-      sleep_(false),
-      config_mode_(false) {
+      sleep_(false) {
   i2c_init(i2c_, 400 * 1000);
   gpio_set_function(sda_pin_, GPIO_FUNC_I2C);
   gpio_set_function(scl_pin_, GPIO_FUNC_I2C);
@@ -38,7 +40,6 @@ SSD1306Display::SSD1306Display(i2c_inst_t* i2c, uint8_t sda_pin,
   busy_wait_ms(250);
 
   std::fill(buffer_.begin(), buffer_.end(), 0);
-  std::fill(out_buffer_.begin(), out_buffer_.end(), 0);
   display_ = std::make_unique<SSD1306>(
       i2c_, i2c_addr_, num_rows_ == 64 ? Size::W128xH64 : Size::W128xH32);
 
@@ -48,9 +49,6 @@ SSD1306Display::SSD1306Display(i2c_inst_t* i2c, uint8_t sda_pin,
     display_->setOrientation(0);
   }
 
-  semaphore_ = xSemaphoreCreateBinary();
-  xSemaphoreGive(semaphore_);
-
   busy_wait_ms(250);
 
   last_active_s_ = time_us_64() / 1000000;
@@ -59,31 +57,17 @@ SSD1306Display::SSD1306Display(i2c_inst_t* i2c, uint8_t sda_pin,
 std::pair<std::string, std::shared_ptr<Config>>
 SSD1306Display::CreateDefaultConfig() {
   auto config = CONFIG_OBJECT(
-      CONFIG_OBJECT_ELEM("sleep_seconds", CONFIG_INT(20, 0, 300)));
+      CONFIG_OBJECT_ELEM("sleep_seconds",
+                         sleep_seconds_config_.Bind(CONFIG_INT(20, 0, 300))));
   return {"SSD1306 Screen", config};
 }
 
 void SSD1306Display::OnUpdateConfig(const Config* config) {
-  if (config->GetType() != Config::OBJECT) {
-    LOG_ERROR("Root config has to be an object.");
-    return;
-  }
-  const auto& root_map = *((ConfigObject*)config)->GetMembers();
-  auto it = root_map.find("sleep_seconds");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `sleep_seconds` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::INTEGER) {
-    LOG_ERROR("`sleep_seconds` invalid type");
-    return;
-  }
-  sleep_s_ = ((ConfigInt*)it->second.get())->GetValue();
-  last_active_s_ = time_us_64() / 1000000;
+  // The output task reads sleep_seconds_config_ directly
+  wake_up_ = true;
 }
 
 void SSD1306Display::SetConfigMode(bool is_config_mode) {
-  LockSemaphore lock(semaphore_);
   config_mode_ = is_config_mode;
 }
 
@@ -95,17 +79,24 @@ void SSD1306Display::OutputTick() {
   bool send_buffer = false;
   std::array<uint8_t, FRAMEBUFFER_SIZE + 1> local_copy;
   local_copy[0] = pico_ssd1306::SSD1306_STARTLINE;
-  {
-    LockSemaphore lock(semaphore_);
-    if (send_buffer_) {
-      std::copy(out_buffer_.begin(), out_buffer_.end(), local_copy.begin() + 1);
-      send_buffer = send_buffer_;
-      last_active_s_ = curr_s;
-    }
-    send_buffer_ = false;
+  uint32_t version;
+  if (frame_.Version() != sent_version_ &&
+      frame_.TryRead(
+          [&](const std::array<uint8_t, FRAMEBUFFER_SIZE>& frame) {
+            std::copy(frame.begin(), frame.end(), local_copy.begin() + 1);
+          },
+          &version)) {
+    send_buffer = true;
+    sent_version_ = version;
+    last_active_s_ = curr_s;
+  }
+  if (wake_up_) {
+    wake_up_ = false;
+    last_active_s_ = curr_s;
   }
 
-  if (!sleep_ && sleep_s_ > 0 && curr_s - last_active_s_ >= sleep_s_) {
+  const uint32_t sleep_s = sleep_seconds_config_.Get();
+  if (!sleep_ && sleep_s > 0 && curr_s - last_active_s_ >= sleep_s) {
     sleep_ = true;
     CMD(pico_ssd1306::SSD1306_DISPLAY_OFF);
     return;
@@ -131,10 +122,8 @@ void SSD1306Display::OutputTick() {
 void SSD1306Display::StartOfInputTick() { buffer_changed_ = false; }
 
 void SSD1306Display::FinalizeInputTickOutput() {
-  LockSemaphore lock(semaphore_);
   if (buffer_changed_) {
-    std::copy(buffer_.begin(), buffer_.end(), out_buffer_.begin());
-    send_buffer_ = true;
+    frame_.Store(buffer_);
   }
 }
 
@@ -2,6 +2,7 @@
 #define SSD1306_H_
 
 #include <array>
+#include <atomic>
 #include <memory>
 
 #include "FreeRTOS.h"
@@ -63,20 +64,22 @@ class SSD1306Display : virtual public ScreenMixinBase<SSD1306Display> {
   const uint8_t i2c_addr_;
   const size_t num_rows_;
   const size_t num_cols_;
-  uint32_t sleep_s_;
+  ConfigHandle<uint32_t> sleep_seconds_config_;
 
   std::unique_ptr<pico_ssd1306::SSD1306> display_;
 
+  // Input task side. display_ draws into buffer_.
   std::array<uint8_t, FRAMEBUFFER_SIZE> buffer_;
-  std::array<uint8_t, FRAMEBUFFER_SIZE> out_buffer_;
-
   bool buffer_changed_;
-  bool send_buffer_;
-  uint32_t last_active_s_;
-  bool sleep_;
   bool config_mode_;
 
-  SemaphoreHandle_t semaphore_;
+  SeqLock<std::array<uint8_t, FRAMEBUFFER_SIZE>> frame_;
+  std::atomic<bool> wake_up_;
+
+  // Output task side.
+  uint32_t sent_version_;
+  uint32_t last_active_s_;
+  bool sleep_;
 };
 
 #endif /* SSD1306_H_ */
@@ -2,12 +2,12 @@
 
 #include <stdint.h>
 
-#include <memory>
-
 #include "FreeRTOS.h"
 #include "config.h"
 #include "hardware/flash.h"
 #include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "kv_store.h"
 #include "pico/multicore.h"
 #include "pico/platform.h"
 #include "semphr.h"
@@ -17,10 +17,29 @@ extern "C" {
 #include "littlefs/lfs.h"
 
 static SemaphoreHandle_t __not_in_flash("storage") semaphore;
+static StaticSemaphore_t semaphore_buffer;
 static lfs_t __not_in_flash("storage") lfs;
 
 #define FS_OFFSET (PICO_FLASH_SIZE_BYTES - CONFIG_FLASH_FILESYSTEM_SIZE)
 
+// Longest stretch of page programs done with the other core parked and the
+// interrupts off. At least one page is programmed per stretch.
+#ifndef CONFIG_FLASH_MAX_BLACKOUT_US
+#define CONFIG_FLASH_MAX_BLACKOUT_US 1000
+#endif
+#define LFS_CACHE_SIZE (FLASH_SECTOR_SIZE / 4)
+#define LFS_LOOKAHEAD_SIZE 32
+
+// Static littlefs buffers, so it never calls malloc. All the file accesses are
+// serialized by the semaphore, so a single file buffer is enough.
+static uint8_t lfs_read_buffer[LFS_CACHE_SIZE];
+static uint8_t lfs_prog_buffer[LFS_CACHE_SIZE];
+alignas(4) static uint8_t lfs_lookahead_buffer[LFS_LOOKAHEAD_SIZE];
+static uint8_t lfs_file_buffer[LFS_CACHE_SIZE];
+static const struct lfs_file_config kLFSFileConfig = {
+    .buffer = lfs_file_buffer,
+};
+
 static int read(const struct lfs_config* c, lfs_block_t block, lfs_off_t off,
                 void* buffer, lfs_size_t size);
 static int prog(const struct lfs_config* c, lfs_block_t block, lfs_off_t off,
@@ -54,8 +73,11 @@ constexpr struct lfs_config CreateLFSConfig() {
       .block_size = FLASH_SECTOR_SIZE,
       .block_count = CONFIG_FLASH_FILESYSTEM_SIZE / FLASH_SECTOR_SIZE,
       .block_cycles = 500,
-      .cache_size = FLASH_SECTOR_SIZE / 4,
-      .lookahead_size = 32,
+      .cache_size = LFS_CACHE_SIZE,
+      .lookahead_size = LFS_LOOKAHEAD_SIZE,
+      .read_buffer = lfs_read_buffer,
+      .prog_buffer = lfs_prog_buffer,
+      .lookahead_buffer = lfs_lookahead_buffer,
   };
   return cfg;
 }
@@ -65,9 +87,10 @@ constexpr struct lfs_config __not_in_flash("storage1")
 
 static int read(const struct lfs_config* c, lfs_block_t block, lfs_off_t off,
                 void* buffer, lfs_size_t size) {
+  // The SDK flushes the XIP cache after each program and erase, so the cached
+  // window is never stale
   memcpy(buffer,
-         (uint8_t*)(XIP_NOCACHE_NOALLOC_BASE) + FS_OFFSET +
-             (block * c->block_size) + off,
+         (uint8_t*)(XIP_BASE) + FS_OFFSET + (block * c->block_size) + off,
          size);
   return LFS_ERR_OK;
 }
@@ -76,19 +99,36 @@ static int __no_inline_not_in_flash_func(prog)(const struct lfs_config* c,
                                                lfs_block_t block, lfs_off_t off,
                                                const void* buffer,
                                                lfs_size_t size) {
-  const uint32_t irq = save_and_disable_interrupts();
-  volatile uint32_t offset = FS_OFFSET + (block * c->block_size) + off;
-  flash_range_program(FS_OFFSET + (block * c->block_size) + off,
-                      (const uint8_t*)buffer, size);
-  restore_interrupts(irq);
+  const uint32_t offset = FS_OFFSET + (block * c->block_size) + off;
+  // size is a multiple of prog_size, i.e. of FLASH_PAGE_SIZE
+  lfs_size_t done = 0;
+  while (done < size) {
+    FlashBlackoutSection blackout;
+    const uint32_t start = time_us_32();
+    uint32_t page_start = start;
+    while (true) {
+      flash_range_program(offset + done, (const uint8_t*)buffer + done,
+                          FLASH_PAGE_SIZE);
+      done += FLASH_PAGE_SIZE;
+
+      // Stop before the next page would go over the limit
+      const uint32_t now = time_us_32();
+      if (done == size || (now - start) + (now - page_start) >
+                              CONFIG_FLASH_MAX_BLACKOUT_US) {
+        break;
+      }
+      page_start = now;
+    }
+  }
   return LFS_ERR_OK;
 }
 
+// A block is a sector, the smallest unit the flash can erase, so an erase is
+// a single blackout regardless of CONFIG_FLASH_MAX_BLACKOUT_US.
 static int __no_inline_not_in_flash_func(erase)(const struct lfs_config* c,
                                                 lfs_block_t block) {
-  const uint32_t irq = save_and_disable_interrupts();
+  FlashBlackoutSection blackout;
   flash_range_erase(FS_OFFSET + (block * c->block_size), c->block_size);
-  restore_interrupts(irq);
   return LFS_ERR_OK;
 }
 
@@ -120,8 +160,10 @@ int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer,
 }
 }
 
+FlashLock::FlashLock() : LockSemaphore(semaphore) {}
+
 Status InitializeStorage() {
-  semaphore = xSemaphoreCreateBinary();
+  semaphore = xSemaphoreCreateBinaryStatic(&semaphore_buffer);
   xSemaphoreGive(semaphore);
 
   // Mount the filesystem or format it
@@ -130,25 +172,25 @@ Status InitializeStorage() {
     lfs_format(&lfs, &kLFSConfig);
     lfs_mount(&lfs, &kLFSConfig);
   }
+  if (InitializeKVStore() != OK) {
+    return ERROR;
+  }
   return StartSyncTasks();
 }
 
 Status WriteStringToFile(const std::string& content, const std::string& name) {
-  LockSemaphore lock(semaphore);
-
-  // Block the other core to avoid executing flash code when writing to flash
-  std::unique_ptr<CoreBlockerSection> blocker;
-  if (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING) {
-    blocker = std::make_unique<CoreBlockerSection>();
-  }
+  FlashLock lock;
 
   lfs_file_t file;
-  if (lfs_file_open(&lfs, &file, name.c_str(), LFS_O_RDWR | LFS_O_CREAT) < 0) {
+  if (lfs_file_opencfg(&lfs, &file, name.c_str(),
+                       LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC,
+                       &kLFSFileConfig) < 0) {
     return ERROR;
   }
   const lfs_ssize_t written =
       lfs_file_write(&lfs, &file, content.c_str(), content.size());
   if (written < 0 || written != content.size()) {
+    lfs_file_close(&lfs, &file);
     return ERROR;
   }
   if (lfs_file_close(&lfs, &file) < 0) {
@@ -158,32 +200,28 @@ Status WriteStringToFile(const std::string& content, const std::string& name) {
 }
 
 Status ReadFileContent(const std::string& name, std::string* output) {
-  LockSemaphore lock(semaphore);
-
-  // Block the other core to avoid executing flash code when writing to flash
-  std::unique_ptr<CoreBlockerSection> blocker;
-  if (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING) {
-    blocker = std::make_unique<CoreBlockerSection>();
-  }
+  FlashLock lock;
 
   lfs_file_t file;
-  if (lfs_file_open(&lfs, &file, name.c_str(), LFS_O_RDONLY) < 0) {
+  if (lfs_file_opencfg(&lfs, &file, name.c_str(), LFS_O_RDONLY,
+                       &kLFSFileConfig) < 0) {
     return ERROR;
   }
 
   const lfs_soff_t file_size = lfs_file_size(&lfs, &file);
   if (file_size < 0) {
+    lfs_file_close(&lfs, &file);
     return ERROR;
   }
 
-  std::unique_ptr<uint8_t[]> read_buffer(new uint8_t[file_size]);
-
+  // Read straight into the output, without an intermediate copy
+  output->resize(file_size);
   const lfs_ssize_t read_bytes =
-      lfs_file_read(&lfs, &file, read_buffer.get(), file_size);
+      lfs_file_read(&lfs, &file, output->data(), file_size);
   if (read_bytes < 0 || read_bytes != file_size) {
+    lfs_file_close(&lfs, &file);
     return ERROR;
   }
-  *output = std::string((char*)read_buffer.get(), (uint32_t)file_size);
 
   if (lfs_file_close(&lfs, &file) < 0) {
     return ERROR;
@@ -192,39 +230,144 @@ Status ReadFileContent(const std::string& name, std::string* output) {
 }
 
 Status GetFileSize(const std::string& name, size_t* output) {
-  LockSemaphore lock(semaphore);
+  FlashLock lock;
 
-  // Block the other core to avoid executing flash code when writing to flash
-  std::unique_ptr<CoreBlockerSection> blocker;
-  if (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING) {
-    blocker = std::make_unique<CoreBlockerSection>();
+  // lfs_stat() doesn't need a file buffer
+  struct lfs_info info;
+  if (lfs_stat(&lfs, name.c_str(), &info) < 0 || info.type != LFS_TYPE_REG) {
+    return ERROR;
   }
+  *output = info.size;
 
-  lfs_file_t file;
-  if (lfs_file_open(&lfs, &file, name.c_str(), LFS_O_RDONLY) < 0) {
+  return OK;
+}
+
+Status RemoveFile(const std::string& name) {
+  FlashLock lock;
+
+  if (lfs_remove(&lfs, name.c_str()) < 0) {
     return ERROR;
   }
+  return OK;
+}
 
-  const lfs_soff_t file_size = lfs_file_size(&lfs, &file);
-  if (file_size < 0) {
+Status RenameFile(const std::string& from, const std::string& to) {
+  FlashLock lock;
+
+  if (lfs_rename(&lfs, from.c_str(), to.c_str()) < 0) {
+    return ERROR;
+  }
+  return OK;
+}
+
+// In copy_to_ram builds the other core keeps running during flash writes, so
+// XIP is never read outside of littlefs
+#if PICO_COPY_TO_RAM
+static constexpr bool kZeroCopyViews = false;
+#else
+static constexpr bool kZeroCopyViews = true;
+#endif
+
+MappedFile::MappedFile() : holds_lock_(false) {}
+
+MappedFile::~MappedFile() { Close(); }
+
+void MappedFile::Close() {
+  data_ = {};
+  copy_.reset();
+  if (holds_lock_) {
+    xSemaphoreGive(semaphore);
+    holds_lock_ = false;
+  }
+}
+
+Status MappedFile::Open(const std::string& name) {
+  Close();
+  xSemaphoreTake(semaphore, portMAX_DELAY);
+  const Status status = OpenLocked(name);
+  if (!holds_lock_) {
+    xSemaphoreGive(semaphore);
+  }
+  return status;
+}
+
+Status MappedFile::OpenLocked(const std::string& name) {
+  lfs_file_t file;
+  if (lfs_file_opencfg(&lfs, &file, name.c_str(), LFS_O_RDONLY,
+                       &kLFSFileConfig) < 0) {
     return ERROR;
   }
-  *output = file_size;
 
+  // Only the first block of a file has no skip-list pointers in front of its
+  // data, so a file fitting in one block is contiguous.
+  const lfs_size_t size = file.ctz.size;
+  if (kZeroCopyViews && !(file.flags & LFS_F_INLINE) &&
+      size <= kLFSConfig.block_size) {
+    if (lfs_file_close(&lfs, &file) < 0) {
+      return ERROR;
+    }
+    data_ = {(const uint8_t*)(XIP_BASE) + FS_OFFSET +
+                 (file.ctz.head * kLFSConfig.block_size),
+             size};
+    holds_lock_ = true;
+    return OK;
+  }
+
+  copy_.reset(new uint8_t[size]);
+  const lfs_ssize_t read_bytes = lfs_file_read(&lfs, &file, copy_.get(), size);
+  if (lfs_file_close(&lfs, &file) < 0 || read_bytes < 0 ||
+      (lfs_size_t)read_bytes != size) {
+    copy_.reset();
+    return ERROR;
+  }
+  data_ = {copy_.get(), size};
   return OK;
 }
 
-Status RemoveFile(const std::string& name) {
-  LockSemaphore lock(semaphore);
+// Only one FileWriter can be open at a time, since it holds the semaphore
+static lfs_file_t writer_file;
+
+FileWriter::FileWriter() : is_open_(false) {}
 
-  // Block the other core to avoid executing flash code when writing to flash
-  std::unique_ptr<CoreBlockerSection> blocker;
-  if (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING) {
-    blocker = std::make_unique<CoreBlockerSection>();
+FileWriter::~FileWriter() {
+  if (is_open_) {
+    Close();
   }
+}
 
-  if (lfs_remove(&lfs, name.c_str()) < 0) {
+Status FileWriter::Open(const std::string& name) {
+  if (is_open_) {
     return ERROR;
   }
+  xSemaphoreTake(semaphore, portMAX_DELAY);
+
+  if (lfs_file_opencfg(&lfs, &writer_file, name.c_str(),
+                       LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC,
+                       &kLFSFileConfig) < 0) {
+    xSemaphoreGive(semaphore);
+    return ERROR;
+  }
+  is_open_ = true;
   return OK;
 }
+
+Status FileWriter::Write(const void* data, size_t size) {
+  if (!is_open_) {
+    return ERROR;
+  }
+  const lfs_ssize_t written = lfs_file_write(&lfs, &writer_file, data, size);
+  if (written < 0 || (size_t)written != size) {
+    return ERROR;
+  }
+  return OK;
+}
+
+Status FileWriter::Close() {
+  if (!is_open_) {
+    return ERROR;
+  }
+  const int err = lfs_file_close(&lfs, &writer_file);
+  is_open_ = false;
+  xSemaphoreGive(semaphore);
+  return err < 0 ? ERROR : OK;
+}
@@ -1,15 +1,82 @@
 #ifndef STORAGE_H_
 #define STORAGE_H_
 
+#include <stdint.h>
+
+#include <memory>
+#include <span>
 #include <string>
 
 #include "utils.h"
 
 Status InitializeStorage();
 
+// Serializes all the flash accesses: littlefs, the KV store and the mapped
+// views. Whoever programs or erases the flash holds it, and so does whoever
+// reads it through XIP meanwhile. Without it, in copy_to_ram builds, where the
+// other core isn't parked during flash writes, a read could run on the other
+// core in the middle of a write. Not recursive, and the storage functions
+// below take it themselves.
+class FlashLock : public LockSemaphore {
+ public:
+  FlashLock();
+};
+
 Status WriteStringToFile(const std::string& content, const std::string& name);
 Status ReadFileContent(const std::string& name, std::string* output);
 Status GetFileSize(const std::string& name, size_t* output);
 Status RemoveFile(const std::string& name);
+// Atomically replaces to with from, if it exists
+Status RenameFile(const std::string& from, const std::string& to);
+
+// Read-only view of the content of a file. When the file is stored contiguously
+// in flash, i.e. it's not inlined in its directory and fits in one block, the
+// view points straight into the cached XIP window and nothing is copied. The
+// FlashLock is then held until the MappedFile is closed or destroyed, so the
+// block can't be rewritten or reused underneath. Meanwhile every other flash
+// access waits, and the owning task must not call the storage functions. Keep
+// such views short.
+//
+// Otherwise, and always in copy_to_ram builds, the content is read into a
+// single heap buffer owned by the MappedFile, and no lock is held.
+class MappedFile {
+ public:
+  MappedFile();
+  virtual ~MappedFile();
+
+  Status Open(const std::string& name);
+  // Releases the view. Called by Open() and the destructor.
+  void Close();
+
+  std::span<const uint8_t> GetData() const { return data_; }
+  bool IsZeroCopy() const { return holds_lock_; }
+
+ private:
+  // Requires the FlashLock
+  Status OpenLocked(const std::string& name);
+
+  std::span<const uint8_t> data_;
+  std::unique_ptr<uint8_t[]> copy_;
+  bool holds_lock_;
+};
+
+// Writes a file in chunks, so its content never has to be held in RAM. The
+// filesystem stays locked from Open() until Close(), so only one file can be
+// written at a time and the other storage functions can't be called
+// meanwhile.
+class FileWriter {
+ public:
+  FileWriter();
+  // Closes the file if still open
+  virtual ~FileWriter();
+
+  // Creates or truncates the file
+  Status Open(const std::string& name);
+  Status Write(const void* data, size_t size);
+  Status Close();
+
+ private:
+  bool is_open_;
+};
 
 #endif /* STORAGE_H_ */
\ No newline at end of file
@@ -19,6 +19,8 @@ struct TaskInfo {
 static spin_lock_t* __not_in_flash("sync") critical_section_lock;
 
 static TaskHandle_t __not_in_flash("sync") task_handles[2] = {NULL, NULL};
+static StackType_t task_stacks[2][configMINIMAL_STACK_SIZE];
+static StaticTask_t task_buffers[2];
 
 static TaskInfo __not_in_flash("sync") core_info[2] = {
     {.core_id = 0, .entered = false, .sync_wait_lock = NULL},
@@ -27,21 +29,26 @@ static TaskInfo __not_in_flash("sync") core_info[2] = {
 extern "C" void __no_inline_not_in_flash_func(CoreBlockerTask)(void* parameter);
 
 Status StartSyncTasks() {
-  if (xTaskCreateAffinitySet(&CoreBlockerTask, "core_0_blocker",
-                             configMINIMAL_STACK_SIZE, (void*)&core_info[0],
-                             // Higher priority to make sure it can preempt
-                             // whatever is current running on this core
-                             CONFIG_TASK_PRIORITY + 1, (1 << 0),
-                             &task_handles[0]) != pdPASS ||
-      task_handles[0] == NULL) {
+#if PICO_COPY_TO_RAM
+  // Nothing executes from flash in copy_to_ram builds, so flash writes never
+  // need to park the other core.
+  return OK;
+#else
+  task_handles[0] = xTaskCreateStaticAffinitySet(
+      &CoreBlockerTask, "core_0_blocker", configMINIMAL_STACK_SIZE,
+      (void*)&core_info[0],
+      // Higher priority to make sure it can preempt whatever is current
+      // running on this core
+      CONFIG_TASK_PRIORITY + 1, task_stacks[0], &task_buffers[0], (1 << 0));
+  if (task_handles[0] == NULL) {
     return ERROR;
   }
 
-  if (xTaskCreateAffinitySet(&CoreBlockerTask, "core_1_blocker",
-                             configMINIMAL_STACK_SIZE, (void*)&core_info[1],
-                             CONFIG_TASK_PRIORITY + 1, (1 << 1),
-                             &task_handles[1]) != pdPASS ||
-      &task_handles[1] == NULL) {
+  task_handles[1] = xTaskCreateStaticAffinitySet(
+      &CoreBlockerTask, "core_1_blocker", configMINIMAL_STACK_SIZE,
+      (void*)&core_info[1], CONFIG_TASK_PRIORITY + 1, task_stacks[1],
+      &task_buffers[1], (1 << 1));
+  if (task_handles[1] == NULL) {
     return ERROR;
   }
 
@@ -58,6 +65,7 @@ Status StartSyncTasks() {
   }
 
   return OK;
+#endif
 }
 
 extern "C" void __no_inline_not_in_flash_func(CoreBlockerTask)(
@@ -67,7 +75,7 @@ extern "C" void __no_inline_not_in_flash_func(CoreBlockerTask)(
   assert(cpuid == task_info.core_id);
 
   while (true) {
-    task_info.entered = false;
+    // entered is cleared by DisableTheOtherCore()
     xTaskNotifyWait(/*do not clear notification on enter*/ 0,
                     /*clear notification on exit*/ 0xffffffff,
                     /*pulNotificationValue=*/NULL, portMAX_DELAY);
@@ -86,6 +94,7 @@ CoreBlockerSection::CoreBlockerSection() { DisableTheOtherCore(); }
 CoreBlockerSection::~CoreBlockerSection() { ReenableTheOtherCore(); }
 
 void DisableTheOtherCore() {
+#if !PICO_COPY_TO_RAM
   // Don't disable IRQ here since flash writes we don't need to disable IRQ
   // until we actually write it.
   spin_lock_unsafe_blocking(critical_section_lock);
@@ -95,6 +104,9 @@ void DisableTheOtherCore() {
 
   // Don't hold the IRQ since we don't want to disable it for current core yet.
   spin_lock_unsafe_blocking(core_info[the_other_core].sync_wait_lock);
+  // Cleared here rather than by the blocker task, which may not have looped
+  // around since the last call yet and would leave a stale true behind
+  core_info[the_other_core].entered = false;
   xTaskNotifyGive(task_handles[the_other_core]);  // Notify the other core to
                                                   // enter blocking as well
 
@@ -102,11 +114,39 @@ void DisableTheOtherCore() {
   // SRAM mapped before we proceed.
   while (!core_info[the_other_core].entered)
     ;
+#endif
 }
 
 void ReenableTheOtherCore() {
+#if !PICO_COPY_TO_RAM
   const uint32_t cpuid = *(uint32_t*)((SIO_BASE) + (SIO_CPUID_OFFSET));
   const uint32_t the_other_core = (cpuid + 1) % 2;
   spin_unlock_unsafe(core_info[the_other_core].sync_wait_lock);
   spin_unlock_unsafe(critical_section_lock);
+#endif
+}
+
+static bool ShouldBlockTheOtherCore() {
+#if PICO_COPY_TO_RAM
+  // The whole firmware runs from SRAM. Flash writes only need to hold off
+  // interrupts on the current core while the flash is busy.
+  return false;
+#else
+  return xTaskGetSchedulerState() == taskSCHEDULER_RUNNING;
+#endif
+}
+
+FlashBlackoutSection::FlashBlackoutSection()
+    : block_the_other_core_(ShouldBlockTheOtherCore()) {
+  if (block_the_other_core_) {
+    DisableTheOtherCore();
+  }
+  irq_ = save_and_disable_interrupts();
+}
+
+FlashBlackoutSection::~FlashBlackoutSection() {
+  restore_interrupts(irq_);
+  if (block_the_other_core_) {
+    ReenableTheOtherCore();
+  }
 }
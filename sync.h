@@ -11,8 +11,23 @@ class CoreBlockerSection {
   virtual ~CoreBlockerSection();
 };
 
-// Block the other core so that we can do flash operations
+// Block the other core so that we can do flash operations. No-op in
+// copy_to_ram builds, where the other core never touches flash.
 void DisableTheOtherCore();
 void ReenableTheOtherCore();
 
+// Parks the other core once the scheduler runs and disables the interrupts of
+// the current one, since neither may execute from flash while it's being
+// written. Only meant to be held for single flash operations, so the USB task
+// and the scan loop keep running between them.
+class FlashBlackoutSection {
+ public:
+  FlashBlackoutSection();
+  virtual ~FlashBlackoutSection();
+
+ private:
+  const bool block_the_other_core_;
+  uint32_t irq_;
+};
+
 #endif /* SYNC_H_ */
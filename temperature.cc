@@ -67,50 +67,18 @@ void TemperatureInputDeivce::InputTick() {
 std::pair<std::string, std::shared_ptr<Config>>
 TemperatureInputDeivce::CreateDefaultConfig() {
   auto config = CONFIG_OBJECT(
-      CONFIG_OBJECT_ELEM("fahrenheit", CONFIG_INT(1, 0, 1)),
-      CONFIG_OBJECT_ELEM("enabled", CONFIG_INT(1, 0, 1)),
-      CONFIG_OBJECT_ELEM("sample_n_ticks", CONFIG_INT(100, 0, 1000)));
+      CONFIG_OBJECT_ELEM("fahrenheit",
+                         fahrenheit_config_.Bind(CONFIG_INT(1, 0, 1))),
+      CONFIG_OBJECT_ELEM("enabled", enabled_config_.Bind(CONFIG_INT(1, 0, 1))),
+      CONFIG_OBJECT_ELEM("sample_n_ticks", sample_n_ticks_config_.Bind(
+                                               CONFIG_INT(100, 0, 1000))));
   return {"Temperature", config};
 }
 
 void TemperatureInputDeivce::OnUpdateConfig(const Config* config) {
-  if (config->GetType() != Config::OBJECT) {
-    LOG_ERROR("Root config has to be an object.");
-    return;
-  }
-  const auto& root_map = *((ConfigObject*)config)->GetMembers();
-  auto it = root_map.find("fahrenheit");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `fahrenheit` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::INTEGER) {
-    LOG_ERROR("`fahrenheit` invalid type");
-    return;
-  }
-  is_fahrenheit_ = ((ConfigInt*)it->second.get())->GetValue() == 1;
-
-  it = root_map.find("enabled");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `enabled` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::INTEGER) {
-    LOG_ERROR("`enabled` invalid type");
-    return;
-  }
-  enabled_ = ((ConfigInt*)it->second.get())->GetValue() == 1;
-
-  it = root_map.find("sample_n_ticks");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `sample_n_ticks` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::INTEGER) {
-    LOG_ERROR("`sample_n_ticks` invalid type");
-    return;
-  }
-  sample_every_ticks_ = ((ConfigInt*)it->second.get())->GetValue();
+  is_fahrenheit_ = fahrenheit_config_.Get();
+  enabled_ = enabled_config_.Get();
+  sample_every_ticks_ = sample_n_ticks_config_.Get();
   counter_ = 0;
 }
 
@@ -129,16 +97,16 @@ void TemperatureInputDeivce::WriteTemp(int32_t temp) {
   }
 
   for (auto screen : *screen_output_) {
-    std::unique_ptr<char[]> buffer(new char[screen->GetNumCols() / 8]);
+    char buffer[16];
     const size_t padding = screen->GetNumCols() / 8 - 7;
-    size_t len = std::snprintf(buffer.get(), 16, "Temp:%*d%s", padding, temp,
-                               is_fahrenheit_ ? "F" : "C");
+    size_t len = std::snprintf(buffer, sizeof(buffer), "Temp:%*d%s", padding,
+                               temp, is_fahrenheit_ ? "F" : "C");
 
     // Clear the row first
     screen->DrawRect(screen->GetNumRows() - 8, 0, screen->GetNumRows(),
                      screen->GetNumCols(), true, ScreenOutputDevice::SUBTRACT);
     screen->DrawText(screen->GetNumRows() - 8, 0,
-                     std::string(buffer.get(), len), ScreenOutputDevice::F8X8,
+                     std::string(buffer, len), ScreenOutputDevice::F8X8,
                      ScreenOutputDevice::ADD);
   }
 }
@@ -2,6 +2,7 @@
 #define TEMPERATURE_H_
 
 #include "base.h"
+#include "configuration.h"
 #include "utils.h"
 
 class TemperatureInputDeivce : virtual public GenericInputDevice {
@@ -21,6 +22,10 @@ class TemperatureInputDeivce : virtual public GenericInputDevice {
 
   virtual void WriteTemp(int32_t temp);
 
+  ConfigHandle<bool> fahrenheit_config_;
+  ConfigHandle<bool> enabled_config_;
+  ConfigHandle<uint32_t> sample_n_ticks_config_;
+
   bool is_fahrenheit_;
   bool is_config_;
   bool enabled_;
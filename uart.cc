@@ -0,0 +1,255 @@
+#include "uart.h"
+
+#include <algorithm>
+
+#include "hardware/gpio.h"
+#include "task.h"
+
+extern "C" {
+#include "ibp_lib.h"
+}
+
+namespace {
+
+constexpr size_t kRXRingBits = 9;
+constexpr size_t kRXRingSize = 1 << kRXRingBits;
+
+// The transfer count runs out after 4G bytes, hours at a few Mbaud. The RX
+// channel is restarted well before that.
+constexpr uint32_t kRXTransferCount = 0xffffffff;
+constexpr uint32_t kRXRestartCount = 1u << 30;
+
+// One ring per UART. The DMA wraps the write address within the ring, which
+// needs it aligned to its size.
+uint8_t rx_rings[2][kRXRingSize] __attribute__((aligned(kRXRingSize)));
+
+extern "C" void IBPUARTTask(void* parameter) {
+  reinterpret_cast<IBPUARTBase*>(parameter)->UARTTask();
+}
+
+// The segments are checked before the packet is consumed, so a header found in
+// the middle of the stream after an error doesn't swallow the next packets.
+bool IsValidPacket(const uint8_t* data, size_t size) {
+  size_t offset = 1;
+  while (offset < size && data[offset] != 0) {
+    IBPSegment segment;
+    const int bytes_consumed =
+        DeSerializeSegment(data + offset, size - offset, &segment);
+    if (bytes_consumed <= 0) {
+      return false;
+    }
+    offset += bytes_consumed;
+  }
+  return true;
+}
+
+}  // namespace
+
+IBPUARTBase::IBPUARTBase(IBPUARTArgs args)
+    : task_handle_(NULL),
+      uart_port_(args.uart_port),
+      tx_pin_(args.tx_pin),
+      rx_pin_(args.rx_pin),
+      baud_rate_(args.baud_rate),
+      rx_ring_(rx_rings[uart_get_index(args.uart_port)]),
+      rx_written_before_restart_(0),
+      rx_read_count_(0),
+      in_sync_(true),
+      in_idx_(kNoPacket),
+      tx_idx_(kNoPacket) {
+  SetDeltaEncoding(args.delta_encoding);
+  SetSendMatrix(args.send_matrix);
+  SetAcknowledge(args.acknowledge);
+}
+
+Status IBPUARTBase::IBPInitialize() {
+  const uint32_t actual_baud_rate = uart_init(uart_port_, baud_rate_);
+  uart_set_format(uart_port_, /*data_bits=*/8, /*stop_bits=*/1,
+                  UART_PARITY_NONE);
+  uart_set_fifo_enabled(uart_port_, true);
+  gpio_set_function(tx_pin_, GPIO_FUNC_UART);
+  gpio_set_function(rx_pin_, GPIO_FUNC_UART);
+  // Idle when the cable is unplugged
+  gpio_pull_up(rx_pin_);
+  LOG_INFO("IBP UART at %d baud", actual_baud_rate);
+
+  rx_dma_channel_ = dma_claim_unused_channel(/*required=*/true);
+  tx_dma_channel_ = dma_claim_unused_channel(/*required=*/true);
+
+  rx_dma_config_ = dma_channel_get_default_config(rx_dma_channel_);
+  channel_config_set_transfer_data_size(&rx_dma_config_, DMA_SIZE_8);
+  channel_config_set_read_increment(&rx_dma_config_, false);
+  channel_config_set_write_increment(&rx_dma_config_, true);
+  channel_config_set_ring(&rx_dma_config_, /*write=*/true, kRXRingBits);
+  channel_config_set_dreq(&rx_dma_config_,
+                          uart_get_dreq(uart_port_, /*is_tx=*/false));
+
+  tx_dma_config_ = dma_channel_get_default_config(tx_dma_channel_);
+  channel_config_set_transfer_data_size(&tx_dma_config_, DMA_SIZE_8);
+  channel_config_set_read_increment(&tx_dma_config_, true);
+  channel_config_set_write_increment(&tx_dma_config_, false);
+  channel_config_set_dreq(&tx_dma_config_,
+                          uart_get_dreq(uart_port_, /*is_tx=*/true));
+
+  StartRX(/*offset=*/0);
+
+  task_handle_ = xTaskCreateStatic(&IBPUARTTask, "uart_task",
+                                   CONFIG_TASK_STACK_SIZE, this,
+                                   CONFIG_TASK_PRIORITY, task_stack_,
+                                   &task_buffer_);
+  if (task_handle_ == NULL) {
+    return ERROR;
+  }
+  return OK;
+}
+
+void IBPUARTBase::FinalizeInputTickOutput() {
+  IBPDeviceBase::FinalizeInputTickOutput();
+  if (task_handle_ != NULL) {
+    xTaskNotifyGive(task_handle_);
+  }
+}
+
+void IBPUARTBase::UARTTask() {
+  while (true) {
+    // Woken up by FinalizeInputTickOutput()
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    const bool received = ReceivePackets();
+    if (SendThisTick(received)) {
+      SendPacket();
+    }
+  }
+}
+
+void IBPUARTBase::StartRX(size_t offset) {
+  dma_channel_configure(rx_dma_channel_, &rx_dma_config_, rx_ring_ + offset,
+                        &uart_get_hw(uart_port_)->dr, kRXTransferCount,
+                        /*trigger=*/true);
+}
+
+uint32_t IBPUARTBase::RXBytesWritten() const {
+  const uint32_t transfer_count =
+      dma_channel_hw_addr(rx_dma_channel_)->transfer_count;
+  return rx_written_before_restart_ + (kRXTransferCount - transfer_count);
+}
+
+bool IBPUARTBase::CheckRXOverrun() {
+  const uint32_t written = RXBytesWritten();
+  if (written - rx_read_count_ <= kRXRingSize) {
+    return false;
+  }
+  // The DMA lapped the task, what's left in the ring is partly overwritten.
+  // Start over from the newest byte.
+  LOG_ERROR("IBP UART ring overrun");
+  CountLinkError();
+  rx_read_count_ = written;
+  in_sync_ = false;
+  return true;
+}
+
+bool IBPUARTBase::ReceivePackets() {
+  CheckRXOverrun();
+  const uint32_t written = RXBytesWritten();
+  bool received = false;
+  while (true) {
+    // Not masked, a full ring is kRXRingSize bytes available
+    const size_t available = written - rx_read_count_;
+    if (available == 0) {
+      break;
+    }
+    const size_t read_offset = rx_read_count_ & (kRXRingSize - 1);
+    const int8_t size = GetTransactionTotalSize(rx_ring_[read_offset]);
+    if (size < 4) {
+      Resync();
+      continue;
+    }
+    if (available < (size_t)size) {
+      // The rest is on its way
+      break;
+    }
+
+    // Kept for the next packet if this one is invalid
+    if (in_idx_ == kNoPacket) {
+      in_idx_ = AcquirePacket();
+      if (in_idx_ == kNoPacket) {
+        LOG_ERROR("No free IBP packet buffer");
+        break;
+      }
+    }
+    uint8_t* data = GetPacket(in_idx_).data;
+    for (int8_t i = 0; i < size; ++i) {
+      data[i] = rx_ring_[(read_offset + i) & (kRXRingSize - 1)];
+    }
+    if (CheckRXOverrun()) {
+      // The copy may have been overwritten meanwhile
+      break;
+    }
+    if (!IsValidPacket(data, size)) {
+      Resync();
+      continue;
+    }
+    rx_read_count_ += size;
+    in_sync_ = true;
+    // Replaces the previous packet if both came in the same tick
+    PutInPacket(in_idx_, size);
+    in_idx_ = kNoPacket;
+    received = true;
+  }
+
+  if (dma_channel_hw_addr(rx_dma_channel_)->transfer_count < kRXRestartCount) {
+    // The bytes received meanwhile wait in the UART FIFO. The count of the new
+    // run starts over, so the bytes written so far carry over.
+    dma_channel_abort(rx_dma_channel_);
+    rx_written_before_restart_ = RXBytesWritten();
+    StartRX(rx_written_before_restart_ & (kRXRingSize - 1));
+  }
+  return received;
+}
+
+void IBPUARTBase::Resync() {
+  if (in_sync_) {
+    LOG_ERROR("Invalid in bound packet");
+    CountLinkError();
+    in_sync_ = false;
+  }
+  ++rx_read_count_;
+}
+
+void IBPUARTBase::SendPacket() {
+  if (dma_channel_is_busy(tx_dma_channel_)) {
+    // The last packet is still going out, the baud rate is too low for the
+    // packet rate
+    LOG_WARNING("IBP UART packet skipped");
+    return;
+  }
+  if (tx_idx_ != kNoPacket) {
+    ReleasePacket(tx_idx_);
+  }
+  tx_idx_ = TakeOutPacket();
+  if (tx_idx_ == kNoPacket) {
+    LOG_ERROR("No free IBP packet buffer");
+    return;
+  }
+  const PacketBuffer& packet = GetPacket(tx_idx_);
+  dma_channel_configure(tx_dma_channel_, &tx_dma_config_,
+                        &uart_get_hw(uart_port_)->dr, packet.data, packet.size,
+                        /*trigger=*/true);
+}
+
+IBPUARTDevice::IBPUARTDevice(IBPUARTArgs args) : IBPUARTBase(args) {}
+
+bool IBPUARTDevice::SendThisTick(bool received) { return received; }
+
+IBPUARTHost::IBPUARTHost(IBPUARTArgs args)
+    : IBPUARTBase(args),
+      poll_ticks_(std::max<uint32_t>(args.poll_ticks, 1)),
+      ticks_since_poll_(0) {}
+
+bool IBPUARTHost::SendThisTick(bool received) {
+  if (++ticks_since_poll_ < poll_ticks_) {
+    return false;
+  }
+  ticks_since_poll_ = 0;
+  return true;
+}
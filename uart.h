@@ -0,0 +1,107 @@
+#ifndef UART_H_
+#define UART_H_
+
+#include "FreeRTOS.h"
+#include "base.h"
+#include "hardware/dma.h"
+#include "hardware/uart.h"
+#include "ibp.h"
+#include "utils.h"
+
+struct IBPUARTArgs {
+  uart_inst_t* uart_port;
+  uint32_t tx_pin;
+  uint32_t rx_pin;
+  // Both sides must use the same rate
+  uint32_t baud_rate;
+  // Host only. A packet is sent every poll_ticks input ticks. 0 is the same as
+  // 1.
+  uint32_t poll_ticks;
+  // See IBPSPIArgs
+  bool delta_encoding;
+  bool send_matrix;
+  bool acknowledge;
+};
+
+// IBP over a full duplex UART link, e.g. the TX and RX wires of a TRRS cable.
+// The received bytes are moved by DMA into a ring buffer, which the UART task
+// scans for packets on every input tick. The packets are sent by DMA straight
+// from the packet pool. See docs/ibp.md.
+class IBPUARTBase : public virtual IBPDeviceBase {
+ public:
+  Status IBPInitialize() override;
+
+  // Wakes up the UART task once the packet of the tick is ready
+  void FinalizeInputTickOutput() override;
+
+  void UARTTask();
+
+ protected:
+  IBPUARTBase(IBPUARTArgs args);
+
+ private:
+  // Whether to send a packet on this tick, given whether packets were received
+  virtual bool SendThisTick(bool received) = 0;
+
+  // (Re)starts the RX channel, writing at offset of the ring
+  void StartRX(size_t offset);
+  // Total bytes the DMA has written to the ring, wrapping at 4G
+  uint32_t RXBytesWritten() const;
+  // Skips to the newest byte if the DMA overwrote bytes which weren't read yet,
+  // which counts as a link error. Returns true if it did.
+  bool CheckRXOverrun();
+  // Hands the complete packets in the ring over to the input task. Returns
+  // true if there was any.
+  bool ReceivePackets();
+  // Skips a byte of the ring to look for the next header
+  void Resync();
+  void SendPacket();
+
+  TaskHandle_t task_handle_;
+  StackType_t task_stack_[CONFIG_TASK_STACK_SIZE];
+  StaticTask_t task_buffer_;
+  uart_inst_t* const uart_port_;
+  const uint32_t tx_pin_;
+  const uint32_t rx_pin_;
+  const uint32_t baud_rate_;
+
+  uint32_t rx_dma_channel_;
+  uint32_t tx_dma_channel_;
+  dma_channel_config rx_dma_config_;
+  dma_channel_config tx_dma_config_;
+  // Aligned to its size for the DMA ring, one per UART
+  uint8_t* rx_ring_;
+  // Written by the previous RX runs, whose transfer count is gone
+  uint32_t rx_written_before_restart_;
+  // Total bytes consumed. The offset in the ring is the low bits.
+  uint32_t rx_read_count_;
+  // Cleared when bytes are skipped, so a burst of noise counts as one error
+  bool in_sync_;
+  // Pool buffers owned by the task, kNoPacket if none
+  uint8_t in_idx_;
+  uint8_t tx_idx_;
+};
+
+// Answers each host packet with its own packet, on the next input tick
+class IBPUARTDevice : public IBPUARTBase {
+ protected:
+  IBPUARTDevice(IBPUARTArgs args);
+
+ private:
+  bool SendThisTick(bool received) override;
+};
+
+// Sends a packet every poll_ticks input ticks. The device packets are applied
+// as they come, usually one or two ticks later.
+class IBPUARTHost : public IBPUARTBase {
+ protected:
+  IBPUARTHost(IBPUARTArgs args);
+
+ private:
+  bool SendThisTick(bool received) override;
+
+  const uint32_t poll_ticks_;
+  uint32_t ticks_since_poll_;
+};
+
+#endif /* UART_H_ */
@@ -275,6 +275,7 @@ extern "C" void USBTask(void *parameter);
 // Semaphore for data accessed between USB task and other tasks. Should not be
 // used between callbacks.
 static SemaphoreHandle_t semaphore = NULL;
+static StaticSemaphore_t semaphore_buffer;
 
 #if CONFIG_DEBUG_ENABLE_USB_SERIAL
 
@@ -321,21 +322,23 @@ stdio_driver_t stdio_usb = {
 #endif /* CONFIG_DEBUG_ENABLE_USB_SERIAL */
 
 status USBInit() {
-  semaphore = xSemaphoreCreateBinary();
+  semaphore = xSemaphoreCreateBinaryStatic(&semaphore_buffer);
   xSemaphoreGive(semaphore);
   return OK;
 }
 
 static TaskHandle_t usb_task_handle = NULL;
+static StackType_t usb_task_stack[CONFIG_TASK_STACK_SIZE];
+static StaticTask_t usb_task_buffer;
 
 status StartUSBTask() {
   // Pin usb task to tick core so that the interrupts are not blocked. If the
   // interrupts are blocked for too long host might treat the device as
   // disconnected.
-  BaseType_t status = xTaskCreateAffinitySet(
+  usb_task_handle = xTaskCreateStaticAffinitySet(
       &USBTask, "usb_task", CONFIG_TASK_STACK_SIZE, NULL, CONFIG_TASK_PRIORITY,
-      (1 << (configTICK_CORE)), &usb_task_handle);
-  if (status != pdPASS || usb_task_handle == NULL) {
+      usb_task_stack, &usb_task_buffer, (1 << (configTICK_CORE)));
+  if (usb_task_handle == NULL) {
     return ERROR;
   }
   return OK;
@@ -355,13 +358,9 @@ extern "C" void USBTask(void *parameter) {
   }
 }
 
-USBOutputAddIn::USBOutputAddIn() {
-  semaphore_ = xSemaphoreCreateBinary();
-  xSemaphoreGive(semaphore_);
-}
+USBOutputAddIn::USBOutputAddIn() : idle_rate_(0) {}
 
 bool USBOutputAddIn::SetIdle(uint8_t idle_rate) {
-  LockSemaphore lock(semaphore_);
   idle_rate_ = idle_rate;
   return true;
 }
@@ -375,45 +374,42 @@ std::shared_ptr<USBKeyboardOutput> USBKeyboardOutput::GetUSBKeyboardOutput() {
 }
 
 void USBKeyboardOutput::OutputTick() {
-  LockSemaphore lock(semaphore_);
   if (is_config_mode_) {
     // Don't report key strokes to host if in config mode
     return;
   }
-  if (tud_suspended() && has_key_output_) {
+  // If the input task is publishing right now, resend the previous report.
+  report_.TryLoad(&output_report_);
+  if (tud_suspended() && output_report_.has_key_output) {
     tud_remote_wakeup();
     return;
   }
   if (!tud_hid_n_ready(ITF_KEYBOARD)) {
     return;
   }
-  auto &buffer = double_buffer_[active_buffer_];
-  tud_hid_n_report(ITF_KEYBOARD, /*report_id=*/0, buffer.data(), buffer.size());
-  tud_hid_n_report(ITF_CONSUMER, /*report_id=*/0, &consumer_keycode_, 2);
+  tud_hid_n_report(ITF_KEYBOARD, /*report_id=*/0, output_report_.keys.data(),
+                   output_report_.keys.size());
+  tud_hid_n_report(ITF_CONSUMER, /*report_id=*/0,
+                   &output_report_.consumer_keycode, 2);
 }
 
 void USBKeyboardOutput::SetConfigMode(bool is_config_mode) {
-  LockSemaphore lock(semaphore_);
   is_config_mode_ = is_config_mode;
 }
 
 void USBKeyboardOutput::StartOfInputTick() {
-  // No need to lock as Tick() does not modify reads active_buffer_.
-  const uint8_t buf_idx = (active_buffer_ + 1) % 2;
-  std::fill(double_buffer_[buf_idx].begin(), double_buffer_[buf_idx].end(), 0);
-  LockSemaphore lock(semaphore_);
-  consumer_keycode_ = 0;
+  std::fill(next_report_.keys.begin(), next_report_.keys.end(), 0);
+  next_report_.consumer_keycode = 0;
 }
 
 void USBKeyboardOutput::FinalizeInputTickOutput() {
-  LockSemaphore lock(semaphore_);
-  active_buffer_ = (active_buffer_ + 1) % 2;
-  has_key_output_ = boot_protocol_kc_count_ > 0;
+  next_report_.has_key_output = boot_protocol_kc_count_ > 0;
   boot_protocol_kc_count_ = 0;
+  report_.Store(next_report_);
 }
 
 void USBKeyboardOutput::SendKeycode(uint8_t keycode) {
-  auto &buffer = double_buffer_[(active_buffer_ + 1) % 2];
+  auto &buffer = next_report_.keys;
   buffer[keycode / 8 + 8] |= (1 << (keycode % 8));
   if (keycode >= HID_KEY_CONTROL_LEFT && keycode <= HID_KEY_GUI_RIGHT) {
     // Set the boot protocol modifier mask.
@@ -434,8 +430,7 @@ void USBKeyboardOutput::SendKeycode(const std::vector<uint8_t> &keycode) {
 }
 
 void USBKeyboardOutput::SendConsumerKeycode(uint16_t keycode) {
-  LockSemaphore lock(semaphore_);
-  consumer_keycode_ = keycode;
+  next_report_.consumer_keycode = keycode;
 }
 
 std::shared_ptr<USBKeyboardOutput>
@@ -449,11 +444,8 @@ USBKeyboardOutputDisablable::GetUSBKeyboardOutput(uint8_t disable_at_layer) {
 }
 
 void USBKeyboardOutputDisablable::OutputTick() {
-  {
-    LockSemaphore lock(semaphore_);
-    if (disabled_) {
-      return;
-    }
+  if (disabled_) {
+    return;
   }
   USBKeyboardOutput::OutputTick();
 }
@@ -479,13 +471,12 @@ std::shared_ptr<USBMouseOutput> USBMouseOutput::GetUSBMouseOutput() {
 
 USBKeyboardOutput::USBKeyboardOutput()
     : USBOutputAddIn(),
-      active_buffer_(0),
+      next_report_(),
       boot_protocol_kc_count_(0),
-      is_config_mode_(false),
-      has_key_output_(false) {}
+      output_report_(),
+      is_config_mode_(false) {}
 
 void USBMouseOutput::OutputTick() {
-  LockSemaphore lock(semaphore_);
   if (is_config_mode_) {
     // Don't report key strokes to host if in config mode
     return;
@@ -493,46 +484,45 @@ void USBMouseOutput::OutputTick() {
   if (!tud_hid_n_ready(ITF_MOUSE)) {
     return;
   }
-  auto &buffer = double_buffer_[active_buffer_];
-  tud_hid_n_mouse_report(ITF_MOUSE, /*report_id=*/0, buffer[0], buffer[1],
-                         buffer[2], buffer[3], buffer[4]);
+  report_.TryLoad(&output_report_);
+  tud_hid_n_mouse_report(ITF_MOUSE, /*report_id=*/0, output_report_[0],
+                         output_report_[1], output_report_[2],
+                         output_report_[3], output_report_[4]);
 }
 
 void USBMouseOutput::SetConfigMode(bool is_config_mode) {
-  LockSemaphore lock(semaphore_);
   is_config_mode_ = is_config_mode;
 }
 
 void USBMouseOutput::StartOfInputTick() {
-  const uint8_t buf_idx = (active_buffer_ + 1) % 2;
-  std::fill(double_buffer_[buf_idx].begin(), double_buffer_[buf_idx].end(), 0);
+  std::fill(next_report_.begin(), next_report_.end(), 0);
 }
 
-void USBMouseOutput::FinalizeInputTickOutput() {
-  LockSemaphore lock(semaphore_);
-  active_buffer_ = (active_buffer_ + 1) % 2;
-}
+void USBMouseOutput::FinalizeInputTickOutput() { report_.Store(next_report_); }
 
 void USBMouseOutput::MouseKeycode(uint8_t keycode) {
   if (keycode > MSE_FORWARD) {
     return;
   }
 
-  double_buffer_[(active_buffer_ + 1) % 2][0] |= (1 << keycode);
+  next_report_[0] |= (1 << keycode);
 }
 
 void USBMouseOutput::MouseMovement(int8_t x, int8_t y) {
-  double_buffer_[(active_buffer_ + 1) % 2][1] = x;
-  double_buffer_[(active_buffer_ + 1) % 2][2] = y;
+  next_report_[1] = x;
+  next_report_[2] = y;
 }
 
 void USBMouseOutput::Pan(int8_t horizontal, int8_t vertical) {
-  double_buffer_[(active_buffer_ + 1) % 2][3] = vertical;
-  double_buffer_[(active_buffer_ + 1) % 2][4] = horizontal;
+  next_report_[3] = vertical;
+  next_report_[4] = horizontal;
 }
 
 USBMouseOutput::USBMouseOutput()
-    : USBOutputAddIn(), active_buffer_(0), is_config_mode_(false) {}
+    : USBOutputAddIn(),
+      next_report_(),
+      output_report_(),
+      is_config_mode_(false) {}
 
 std::shared_ptr<USBMouseOutputDisablable>
 USBMouseOutputDisablable::GetUSBMouseOutput(uint8_t disable_at_layer) {
@@ -545,11 +535,8 @@ USBMouseOutputDisablable::GetUSBMouseOutput(uint8_t disable_at_layer) {
 }
 
 void USBMouseOutputDisablable::OutputTick() {
-  {
-    LockSemaphore lock(semaphore_);
-    if (disabled_) {
-      return;
-    }
+  if (disabled_) {
+    return;
   }
   USBMouseOutput::OutputTick();
 }
@@ -572,57 +559,60 @@ std::shared_ptr<USBInput> USBInput::GetUSBInput() {
 
 void USBInput::OnSetReport(hid_report_type_t report_type, uint8_t const *buffer,
                            uint16_t buffer_size) {
-  LockSemaphore lock(semaphore_);
   if (buffer_size != 1) {
     return;
   }
   const uint8_t value = buffer[0];
-  leds_.num_lock = value & 0x1;
-  leds_.caps_lock = (value >> 1) & 0x1;
-  leds_.scroll_lock = (value >> 2) & 0x1;
-  leds_.compose = (value >> 3) & 0x1;
-  leds_.kana = (value >> 4) & 0x1;
-  state_changed_ = true;
+  auto &leds = usb_state_.leds;
+  leds.num_lock = value & 0x1;
+  leds.caps_lock = (value >> 1) & 0x1;
+  leds.scroll_lock = (value >> 2) & 0x1;
+  leds.compose = (value >> 3) & 0x1;
+  leds.kana = (value >> 4) & 0x1;
+  state_.Store(usb_state_);
 }
 
 void USBInput::OnSuspend() {
-  LockSemaphore lock(semaphore_);
-  suspended_ = true;
-  state_changed_ = true;
+  usb_state_.suspended = true;
+  state_.Store(usb_state_);
 }
 
 void USBInput::OnResume() {
-  LockSemaphore lock(semaphore_);
-  suspended_ = false;
-  state_changed_ = true;
+  usb_state_.suspended = false;
+  state_.Store(usb_state_);
 }
 
 void USBInput::InputLoopStart() {
-  LockSemaphore lock(semaphore_);
+  State state;
+  if (!state_.TryLoad(&state)) {
+    return;
+  }
   for (auto device : *led_output_) {
-    device->SetLedStatus(leds_);
+    device->SetLedStatus(state.leds);
   }
 }
 
 void USBInput::InputTick() {
-  LockSemaphore lock(semaphore_);
-  if (!state_changed_) {
+  if (state_.Version() == state_version_) {
     return;
   }
-  state_changed_ = false;
+  State state;
+  uint32_t version;
+  if (!state_.TryLoad(&state, &version)) {
+    // The USB task is updating it. Pick it up on the next tick.
+    return;
+  }
+  state_version_ = version;
   for (auto device : *led_output_) {
-    device->SuspendEvent(suspended_);
-    device->SetLedStatus(leds_);
+    device->SuspendEvent(state.suspended);
+    device->SetLedStatus(state.leds);
   }
   for (auto device : *screen_output_) {
-    device->SuspendEvent(suspended_);
+    device->SuspendEvent(state.suspended);
   }
 }
 
-USBInput::USBInput() : state_changed_(false), suspended_(false) {
-  semaphore_ = xSemaphoreCreateBinary();
-  xSemaphoreGive(semaphore_);
-}
+USBInput::USBInput() : state_version_(0) {}
 
 Status RegisterUSBKeyboardOutput(uint8_t tag) {
   return DeviceRegistry::RegisterKeyboardOutputDevice(
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include <array>
+#include <atomic>
 #include <memory>
 
 #include "FreeRTOS.h"
@@ -24,8 +25,7 @@ class USBOutputAddIn {
   virtual bool SetIdle(uint8_t idle_rate);
 
  protected:
-  SemaphoreHandle_t semaphore_;
-  uint8_t idle_rate_;
+  std::atomic<uint8_t> idle_rate_;
 };
 
 class USBKeyboardOutput : public KeyboardOutputDevice, public USBOutputAddIn {
@@ -44,14 +44,22 @@ class USBKeyboardOutput : public KeyboardOutputDevice, public USBOutputAddIn {
   void ChangeActiveLayers(const std::vector<bool>&) override {}
 
  protected:
+  struct Report {
+    std::array<uint8_t, 8 + 256 / 8> keys;
+    uint16_t consumer_keycode;
+    bool has_key_output;
+  };
+
   USBKeyboardOutput();
 
-  std::array<std::array<uint8_t, 8 + 256 / 8>, 2> double_buffer_;
-  uint8_t active_buffer_;
+  // Built by the input task and published at the end of each input tick.
+  Report next_report_;
   uint8_t boot_protocol_kc_count_;
-  uint16_t consumer_keycode_;
-  bool is_config_mode_;
-  bool has_key_output_;
+  SeqLock<Report> report_;
+
+  // Last report picked up by the output task.
+  Report output_report_;
+  std::atomic<bool> is_config_mode_;
 };
 
 class USBKeyboardOutputDisablable : public USBKeyboardOutput {
@@ -67,7 +75,7 @@ class USBKeyboardOutputDisablable : public USBKeyboardOutput {
   USBKeyboardOutputDisablable(uint8_t disable_at_layer);
 
   const uint8_t disable_at_layer_;
-  bool disabled_;
+  std::atomic<bool> disabled_;
 };
 
 class USBMouseOutput : public MouseOutputDevice, public USBOutputAddIn {
@@ -85,11 +93,14 @@ class USBMouseOutput : public MouseOutputDevice, public USBOutputAddIn {
   void Pan(int8_t horizontal, int8_t vertical) override;
 
  protected:
+  using Report = std::array<int8_t, 5>;
+
   USBMouseOutput();
 
-  std::array<std::array<int8_t, 5>, 2> double_buffer_;
-  uint8_t active_buffer_;
-  bool is_config_mode_;
+  Report next_report_;
+  SeqLock<Report> report_;
+  Report output_report_;
+  std::atomic<bool> is_config_mode_;
 };
 
 class USBMouseOutputDisablable : virtual public USBMouseOutput,
@@ -109,7 +120,7 @@ class USBMouseOutputDisablable : virtual public USBMouseOutput,
   USBMouseOutputDisablable(uint8_t disable_at_layer);
 
   const uint8_t disable_at_layer_;
-  bool disabled_;
+  std::atomic<bool> disabled_;
 };
 
 class USBInput : public GenericInputDevice {
@@ -137,12 +148,19 @@ class USBInput : public GenericInputDevice {
   void InputTick() override;
 
  protected:
+  struct State {
+    LEDOutputDevice::LEDIndicators leds;
+    bool suspended = false;
+  };
+
   USBInput();
 
-  bool state_changed_;
-  bool suspended_;
-  LEDOutputDevice::LEDIndicators leds_;
-  SemaphoreHandle_t semaphore_;
+  // Only touched by the USB task.
+  State usb_state_;
+  SeqLock<State> state_;
+
+  // Version of state_ last forwarded to the outputs. Input task only.
+  uint32_t state_version_;
 };
 
 enum InterfaceID {
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 
+#include <atomic>
 #include <queue>
 #include <string>
 
@@ -57,4 +58,66 @@ class LockSpinlock {
   uint32_t irq_;
 };
 
+// Single-writer sequence lock for handing a value from one task to another
+// without going through the kernel. The writer never waits. A reader either
+// gets a consistent copy, or false if it raced with a write, in which case it
+// should keep using what it had and try again on its next tick. Readers never
+// spin, so a high priority reader can't starve a preempted writer on the same
+// core. Only plain atomic loads and stores are used, since the Cortex-M0+ has
+// no exclusive access instructions.
+template <typename T>
+class SeqLock {
+ public:
+  SeqLock() : sequence_(0), value_() {}
+  explicit SeqLock(const T& value) : sequence_(0), value_(value) {}
+
+  // Writer side. Must always be called from the same task.
+  void Store(const T& value) {
+    const uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    value_ = value;
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  // Odd while a write is in progress. Changes on every Store().
+  uint32_t Version() const {
+    return sequence_.load(std::memory_order_acquire);
+  }
+
+  // Calls reader(const T&) on the current value. Returns false if the value
+  // changed underneath, in which case whatever reader copied out is garbage.
+  template <typename F>
+  bool TryRead(F reader, uint32_t* version = NULL) const {
+    const uint32_t begin = sequence_.load(std::memory_order_acquire);
+    if (begin & 1) {
+      return false;
+    }
+    reader(value_);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence_.load(std::memory_order_relaxed) != begin) {
+      return false;
+    }
+    if (version != NULL) {
+      *version = begin;
+    }
+    return true;
+  }
+
+  // Copies through a temporary so output is untouched on failure. Use
+  // TryRead() for large values.
+  bool TryLoad(T* output, uint32_t* version = NULL) const {
+    T copy;
+    if (!TryRead([&](const T& value) { copy = value; }, version)) {
+      return false;
+    }
+    *output = copy;
+    return true;
+  }
+
+ private:
+  std::atomic<uint32_t> sequence_;
+  T value_;
+};
+
 #endif /* UTILS_H_ */
\ No newline at end of file
@@ -1,5 +1,8 @@
 #include "ws2812.h"
 
+#include <string.h>
+
+#include <algorithm>
 #include <vector>
 
 #include "FreeRTOS.h"
@@ -8,6 +11,7 @@
 #include "hardware/clocks.h"
 #include "hardware/pio.h"
 #include "hardware/timer.h"
+#include "kv_store.h"
 #include "semphr.h"
 #include "utils.h"
 #include "ws2812.pio.h"
@@ -17,23 +21,26 @@ WS2812::WS2812(uint8_t pin, uint8_t num_pixels, float max_brightness, PIO pio,
     : pin_(pin),
       pio_(pio),
       sm_(state_machine),
+      num_pixels_(num_pixels),
       max_brightness_(max_brightness > 1 ? 1 : max_brightness),
-      brightness_(0.25 < max_brightness ? 0.25 : max_brightness),
-      mode_(ROTATE),
+      settings_({.brightness = 0.25f < max_brightness ? 0.25f : max_brightness,
+                 .mode = ROTATE,
+                 .enabled = true,
+                 .suspend = false,
+                 .tick_divider = 0}),
+      pixels_(),
       redraw_(false),
-      enabled_(true),
       buffer_changed_(false),
-      active_buffer_(0),
-      tick_divider_(0),
+      brightness_generation_(0),
+      published_settings_(settings_),
+      published_pixels_(pixels_),
+      output_settings_(settings_),
+      output_pixels_(),
+      drawn_version_(0),
       counter_(0),
-      double_buffer_(2, std::vector<uint32_t>(num_pixels)),
       rotate_idx_(0),
       breath_scalar_(1.0),
-      breath_scalar_delta_(-0.02),
-      suspend_(false) {
-  semaphore_ = xSemaphoreCreateBinary();
-  xSemaphoreGive(semaphore_);
-
+      breath_scalar_delta_(-0.02) {
   // Seed the random number generator (note we only need good enough
   // randomness. Not anything for key generation).
   adc_init();
@@ -58,223 +65,185 @@ WS2812::WS2812(uint8_t pin, uint8_t num_pixels, float max_brightness, PIO pio,
 void WS2812::OutputTick() {
   const uint64_t start_time = time_us_64();
 
-  Mode mode;
-  bool enabled;
-  float brightness;
-  {
-    LockSemaphore lock(semaphore_);
-    enabled = enabled_ && !suspend_;
-    if (!enabled && !redraw_) {
-      return;
-    }
-    if (!redraw_) {
-      return;
-    }
-    if (counter_++ < tick_divider_) {
-      return;
-    }
-    counter_ = 0;
-    mode = mode_;
-    brightness = brightness_;
-    redraw_ = false;
+  uint32_t version;
+  if (!published_settings_.TryLoad(&output_settings_, &version) ||
+      version == drawn_version_) {
+    return;
+  }
+  if (counter_++ < output_settings_.tick_divider) {
+    return;
   }
+  counter_ = 0;
 
-  if (!enabled) {
+  const Settings& settings = output_settings_;
+  if (!settings.enabled || settings.suspend) {
     for (size_t i = 0; i < NumPixels(); ++i) {
       PutPixel(0);
     }
+    drawn_version_ = version;
     return;
   }
 
-  switch (mode) {
+  switch (settings.mode) {
     case SET_PIXEL: {
-      std::vector<uint32_t> copy;
-      copy.reserve(NumPixels());
-      {
-        LockSemaphore lock(semaphore_);
-        std::copy(double_buffer_[active_buffer_].begin(),
-                  double_buffer_[active_buffer_].end(), copy.begin());
+      if (!published_pixels_.TryRead([&](const PixelBuffer& pixels) {
+            std::copy_n(pixels.begin(), NumPixels(), output_pixels_.begin());
+          })) {
+        // Torn copy. Leave the request pending for the next tick.
+        return;
       }
-      for (const uint32_t pixel : copy) {
-        PutPixel(RescaleByBrightness(brightness, pixel));
+      for (size_t i = 0; i < NumPixels(); ++i) {
+        PutPixel(RescaleByBrightness(settings.brightness, output_pixels_[i]));
       }
       break;
     }
     case BREATH:
-      BreathAnimation(brightness);
+      BreathAnimation(settings.brightness);
       break;
     case ROTATE:
-      RotateAnimation(brightness);
+      RotateAnimation(settings.brightness);
       break;
   }
+  drawn_version_ = version;
 
   const uint64_t end_time = time_us_64();
   LOG_DEBUG("LED write time: %d us", end_time - start_time);
 }
 
 void WS2812::StartOfInputTick() {
-  LockSemaphore lock(semaphore_);
-  if (mode_ != SET_PIXEL && enabled_ && !suspend_) {
+  if (settings_.mode != SET_PIXEL && settings_.enabled && !settings_.suspend) {
     redraw_ = true;
   }
 }
 
 void WS2812::FinalizeInputTickOutput() {
-  LockSemaphore lock(semaphore_);
-  if (mode_ == SET_PIXEL && buffer_changed_ && enabled_ && !suspend_) {
-    active_buffer_ = (active_buffer_ + 1) % 2;
+  if (settings_.mode == SET_PIXEL && buffer_changed_ && settings_.enabled &&
+      !settings_.suspend) {
+    published_pixels_.Store(pixels_);
+    buffer_changed_ = false;
     redraw_ = true;
   }
+  if (redraw_) {
+    published_settings_.Store(settings_);
+    redraw_ = false;
+  }
 }
 
 void WS2812::IncreaseBrightness() {
-  LockSemaphore lock(semaphore_);
-  if (!enabled_) {
+  if (!settings_.enabled) {
     return;
   }
-  brightness_ += 0.05;
-  if (brightness_ > max_brightness_) {
-    brightness_ = max_brightness_;
+  settings_.brightness += 0.05;
+  if (settings_.brightness > max_brightness_) {
+    settings_.brightness = max_brightness_;
   }
   redraw_ = true;
+  SaveBrightness();
 }
 
 void WS2812::DecreaseBrightness() {
-  LockSemaphore lock(semaphore_);
-  if (!enabled_) {
+  if (!settings_.enabled) {
     return;
   }
-  brightness_ -= 0.05;
-  if (brightness_ < 0) {
-    brightness_ = 0;
+  settings_.brightness -= 0.05;
+  if (settings_.brightness < 0) {
+    settings_.brightness = 0;
   }
   redraw_ = true;
+  SaveBrightness();
 }
 
 void WS2812::IncreaseAnimationSpeed() {
-  LockSemaphore lock(semaphore_);
-  if (!enabled_) {
+  if (!settings_.enabled) {
     return;
   }
-  if (tick_divider_ != 1) {
-    tick_divider_ -= 1;
+  if (settings_.tick_divider != 1) {
+    settings_.tick_divider -= 1;
   }
   redraw_ = true;
 }
 
 void WS2812::DecreaseAnimationSpeed() {
-  LockSemaphore lock(semaphore_);
-  if (!enabled_) {
+  if (!settings_.enabled) {
     return;
   }
-  if (tick_divider_ != 0xff) {
-    tick_divider_ += 1;
+  if (settings_.tick_divider != 0xff) {
+    settings_.tick_divider += 1;
   }
   redraw_ = true;
 }
 
 void WS2812::SetFixedColor(uint8_t w, uint8_t r, uint8_t g, uint8_t b) {
-  {
-    LockSemaphore lock(semaphore_);
-    if (!enabled_) {
-      return;
-    }
-  }
-  if (mode_ != SET_PIXEL) {
+  if (!settings_.enabled || settings_.mode != SET_PIXEL) {
     return;
   }
   const uint32_t color = CombineColors(r, g, b);
-  auto& buffer = double_buffer_[(active_buffer_ + 1) % 2];
-  std::fill(buffer.begin(), buffer.end(), color);
+  std::fill_n(pixels_.begin(), NumPixels(), color);
   buffer_changed_ = true;
 }
 
 void WS2812::SetPixel(size_t idx, uint8_t w, uint8_t r, uint8_t g, uint8_t b) {
-  {
-    LockSemaphore lock(semaphore_);
-    if (!enabled_) {
-      return;
-    }
-  }
-  if (mode_ != SET_PIXEL || idx >= NumPixels()) {
+  if (!settings_.enabled || settings_.mode != SET_PIXEL ||
+      idx >= NumPixels()) {
     return;
   }
-  auto& buffer = double_buffer_[(active_buffer_ + 1) % 2];
-  buffer[idx] = CombineColors(r, g, b);
+  pixels_[idx] = CombineColors(r, g, b);
   buffer_changed_ = true;
 }
 
 void WS2812::OnUpdateConfig(const Config* config) {
-  LockSemaphore lock(semaphore_);
-  if (config->GetType() != Config::OBJECT) {
-    LOG_ERROR("Root config has to be an object.");
-    return;
-  }
-  const auto& root_map = *((ConfigObject*)config)->GetMembers();
-  auto it = root_map.find("brightness");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `brightness` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::FLOAT) {
-    LOG_ERROR("`brightness` invalid type");
-    return;
-  }
-  brightness_ = ((ConfigFloat*)it->second.get())->GetValue();
-
-  it = root_map.find("tick_dividier");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `tick_dividier` in config");
-    return;
-  }
-  if (it->second->GetType() != Config::INTEGER) {
-    LOG_ERROR("`tick_dividier` invalid type");
-    return;
-  }
-  tick_divider_ = ((ConfigInt*)it->second.get())->GetValue();
-  counter_ = 0;
+  settings_.tick_divider = tick_divider_config_.Get();
+  settings_.enabled = enabled_config_.Get();
+  settings_.mode = mode_config_.Get();
+  redraw_ = true;
 
-  it = root_map.find("enabled");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `enabled` in config");
+  const uint32_t generation = brightness_config_.GetGeneration();
+  if (generation == brightness_generation_) {
     return;
   }
-  if (it->second->GetType() != Config::INTEGER) {
-    LOG_ERROR("`enabled` invalid type");
-    return;
-  }
-  enabled_ = ((ConfigInt*)it->second.get())->GetValue();
-
-  it = root_map.find("animation");
-  if (it == root_map.end()) {
-    LOG_ERROR("Can't find `animation` in config");
+  const bool first_update = brightness_generation_ == 0;
+  brightness_generation_ = generation;
+  settings_.brightness = brightness_config_.Get();
+  if (!first_update) {
+    // Changed from the config
+    SaveBrightness();
     return;
   }
-  if (it->second->GetType() != Config::INTEGER) {
-    LOG_ERROR("`animation` invalid type");
-    return;
+  // The last brightness saved wins over the config at boot
+  uint32_t bits;
+  if (GetKVValue(KV_KEY_WS2812_BRIGHTNESS, &bits) == OK) {
+    float brightness;
+    memcpy(&brightness, &bits, sizeof(brightness));
+    if (brightness >= 0 && brightness <= max_brightness_) {
+      settings_.brightness = brightness;
+    }
   }
-  mode_ = (Mode)(((ConfigInt*)it->second.get())->GetValue());
 }
 
-void WS2812::SetConfigMode(bool is_config_mode) {
-  LockSemaphore lock(semaphore_);
-  redraw_ = true;
+void WS2812::SaveBrightness() {
+  uint32_t bits;
+  memcpy(&bits, &settings_.brightness, sizeof(bits));
+  // Written later by the config saver task, since this runs on the input task
+  SetKVValueDeferred(KV_KEY_WS2812_BRIGHTNESS, bits);
 }
 
+void WS2812::SetConfigMode(bool is_config_mode) { redraw_ = true; }
+
 std::pair<std::string, std::shared_ptr<Config>> WS2812::CreateDefaultConfig() {
   auto config = CONFIG_OBJECT(
       CONFIG_OBJECT_ELEM("brightness",
-                         CONFIG_FLOAT(0.25, 0.0, max_brightness_, 0.02)),
-      CONFIG_OBJECT_ELEM("tick_dividier", CONFIG_INT(10, 1, 250)),
-      CONFIG_OBJECT_ELEM("enabled", CONFIG_INT(1, 0, 1)),
-      CONFIG_OBJECT_ELEM("animation", CONFIG_INT(BREATH, 0, TOTAL - 1)));
+                         brightness_config_.Bind(CONFIG_FLOAT(
+                             0.25, 0.0, max_brightness_, 0.02))),
+      CONFIG_OBJECT_ELEM("tick_dividier",
+                         tick_divider_config_.Bind(CONFIG_INT(10, 1, 250))),
+      CONFIG_OBJECT_ELEM("enabled", enabled_config_.Bind(CONFIG_INT(1, 0, 1))),
+      CONFIG_OBJECT_ELEM("animation", mode_config_.Bind(CONFIG_INT(
+                                          BREATH, 0, TOTAL - 1))));
   return {"WS2812 LED", config};
 }
 
 void WS2812::SuspendEvent(bool is_suspend) {
-  LockSemaphore lock(semaphore_);
-  suspend_ = is_suspend;
+  settings_.suspend = is_suspend;
   redraw_ = true;
 }
 
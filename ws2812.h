@@ -3,6 +3,7 @@
 #ifndef WH2812_H_
 #define WH2812_H_
 
+#include <array>
 #include <vector>
 
 #include "FreeRTOS.h"
@@ -28,7 +29,7 @@ class WS2812 : public LEDOutputDevice {
   void DecreaseBrightness() override;
   void IncreaseAnimationSpeed() override;
   void DecreaseAnimationSpeed() override;
-  size_t NumPixels() const override { return double_buffer_[0].size(); }
+  size_t NumPixels() const override { return num_pixels_; }
   void SetFixedColor(uint8_t w, uint8_t r, uint8_t g, uint8_t b) override;
   void SetPixel(size_t idx, uint8_t w, uint8_t r, uint8_t g,
                 uint8_t b) override;
@@ -43,34 +44,65 @@ class WS2812 : public LEDOutputDevice {
   void SuspendEvent(bool is_suspend) override;
 
  protected:
+  // Sized for the largest strip so the buffers can go through a SeqLock
+  // without allocating
+  static constexpr size_t kMaxPixels = 255;
+  using PixelBuffer = std::array<uint32_t, kMaxPixels>;
+
+  struct Settings {
+    float brightness;
+    Mode mode;
+    bool enabled;
+    bool suspend;
+    uint8_t tick_divider;
+  };
+
   uint32_t RescaleByBrightness(float brightness, uint32_t pixel);
   uint32_t CombineColors(uint8_t r, uint8_t g, uint8_t b);
   void SeparateColors(uint32_t pixel, uint8_t* r, uint8_t* g, uint8_t* b);
   void PutPixel(uint32_t pixel);
 
+  // The last brightness is kept in the KV store, so the brightness keys
+  // survive a reboot
+  void SaveBrightness();
+
   void BreathAnimation(float brightness);
   void RotateAnimation(float brightness);
 
   const uint8_t pin_;
   const PIO pio_;
   const uint8_t sm_;
+  const uint8_t num_pixels_;
   const float max_brightness_;
-  float brightness_;
-  Mode mode_;
+
+  ConfigHandle<float> brightness_config_;
+  ConfigHandle<uint8_t> tick_divider_config_;
+  ConfigHandle<bool> enabled_config_;
+  ConfigHandle<Mode> mode_config_;
+
+  // Input task side. Settings are published at the end of the input tick
+  // whenever a redraw is needed.
+  Settings settings_;
+  PixelBuffer pixels_;
   bool redraw_;
-  bool enabled_;
   bool buffer_changed_;
-  uint8_t active_buffer_;
-  uint8_t tick_divider_;
+  // Generation of brightness_config_ last applied, 0 before the first config
+  // update. Other config changes leave the brightness set with the keys alone.
+  uint32_t brightness_generation_;
+
+  // Every publish of published_settings_ is a redraw request.
+  SeqLock<Settings> published_settings_;
+  SeqLock<PixelBuffer> published_pixels_;
+
+  // Output task side.
+  Settings output_settings_;
+  PixelBuffer output_pixels_;
+  uint32_t drawn_version_;
   uint8_t counter_;
-  std::vector<std::vector<uint32_t>> double_buffer_;
   std::vector<uint32_t> random_buffer_;
   uint8_t rotate_idx_;
   float breath_scalar_;
   float breath_scalar_delta_;
-  bool suspend_;
-
-  SemaphoreHandle_t semaphore_;
 };
 
 Status RegisterWS2812(uint8_t tag, uint8_t pin, uint8_t num_pixels,